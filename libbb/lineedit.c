@@ -829,6 +829,122 @@ static unsigned path_parse(char ***p)
 	return npth + 1;
 }
 
+# if ENABLE_FEATURE_TAB_COMPLETION_CACHE
+/* Sorted listings of $PATH directories. Unlike S, they are kept
+ * across read_line_input() calls: a directory is read again only
+ * if its mtime (or inode) changes.
+ */
+struct path_dir {
+	struct path_dir *next;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	unsigned count;
+	char **names;
+	uint8_t *is_dir; /* 0: don't know yet, 1: no, 2: yes */
+	char path[1];
+};
+static struct path_dir *path_dirs;
+
+static struct path_dir *get_path_dir(const char *lpath)
+{
+	struct path_dir *d;
+	struct dirent *next;
+	struct stat st;
+	DIR *dir;
+
+	if (stat(lpath, &st) != 0)
+		return NULL;
+	for (d = path_dirs; d; d = d->next) {
+		if (strcmp(d->path, lpath) == 0)
+			break;
+	}
+	if (!d) {
+		d = xzalloc(sizeof(*d) + strlen(lpath));
+		strcpy(d->path, lpath);
+		d->next = path_dirs;
+		path_dirs = d;
+	} else {
+		if (d->ino == st.st_ino
+		 && d->dev == st.st_dev
+		 && d->mtime == st.st_mtime
+		 && d->mtime_nsec == st.st_mtim.tv_nsec
+		) {
+			return d;
+		}
+		while (d->count)
+			free(d->names[--d->count]);
+		free(d->names);
+		free(d->is_dir);
+		d->names = NULL;
+		d->is_dir = NULL;
+		d->ino = 0;
+	}
+
+	dir = opendir(lpath);
+	if (!dir)
+		return NULL;
+	while ((next = readdir(dir)) != NULL) {
+		if (DOT_OR_DOTDOT(next->d_name))
+			continue;
+		d->names = xrealloc_vector(d->names, 6, d->count);
+		d->names[d->count++] = xstrdup(next->d_name);
+	}
+	closedir(dir);
+	qsort_string_vector(d->names, d->count);
+	d->is_dir = xzalloc(d->count);
+
+	/* With one-second timestamps, a change made in the same second
+	 * would not be noticed: such a listing is only used once */
+	if (st.st_mtime + 1 < time(NULL)) {
+		d->dev = st.st_dev;
+		d->ino = st.st_ino;
+		d->mtime = st.st_mtime;
+		d->mtime_nsec = st.st_mtim.tv_nsec;
+	}
+	return d;
+}
+
+static void complete_in_path_dir(const char *lpath, const char *basecmd, unsigned baselen)
+{
+	struct path_dir *d;
+	unsigned lo, hi;
+
+	d = get_path_dir(lpath);
+	if (!d)
+		return;
+
+	/* Find the first name >= basecmd */
+	lo = 0;
+	hi = d->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (strcmp(d->names[mid], basecmd) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* All names with this prefix follow it */
+	for (; lo < d->count; lo++) {
+		const char *name = d->names[lo];
+
+		if (strncmp(basecmd, name, baselen) != 0)
+			break;
+		if (!d->is_dir[lo]) {
+			struct stat st;
+			char *found = concat_path_file(lpath, name);
+			/* dangling links still match */
+			d->is_dir[lo] = (stat(found, &st) == 0 && S_ISDIR(st.st_mode)) + 1;
+			free(found);
+		}
+		/* skip directories when searching PATH */
+		if (d->is_dir[lo] == 1)
+			add_match(xstrdup(name));
+	}
+}
+# endif
+
 /* Complete command, directory or file name.
  * Return the length of the prefix used for matching.
  */
@@ -903,6 +1019,12 @@ static NOINLINE unsigned complete_cmd_dir_file(const char *command, int type)
 		}
 
 		lpath = *paths[i] ? paths[i] : ".";
+# if ENABLE_FEATURE_TAB_COMPLETION_CACHE
+		if (type == FIND_EXE_ONLY && !dirbuf) {
+			complete_in_path_dir(lpath, basecmd, baselen);
+			continue;
+		}
+# endif
 		dir = opendir(lpath);
 		if (!dir)
 			continue; /* don't print an error */
@@ -21,6 +21,14 @@
 //config:	default y
 //config:	help
 //config:	Small and static DNS server daemon.
+//config:
+//config:config FEATURE_DNSD_BATCH
+//config:	bool "Receive and answer queries in batches"
+//config:	default y
+//config:	depends on DNSD
+//config:	help
+//config:	Receive up to 16 queued queries per recvmmsg() call and send
+//config:	the replies with one sendmmsg() call. Needs Linux 3.0+.
 
 //applet:IF_DNSD(APPLET(dnsd, BB_DIR_USR_SBIN, BB_SUID_DROP))
 
@@ -57,6 +65,10 @@ enum {
 	MAX_NAME_LEN = IP_STRING_LEN - 1 + sizeof(".in-addr.arpa"),
 	REQ_A = 1,
 	REQ_PTR = 12,
+	/* answer RR without RDATA: name ptr, type, class, TTL, RDLENGTH */
+	RR_HEAD_LEN = 2 + 2 + 2 + 4 + 2,
+	A_RR_LEN = RR_HEAD_LEN + 4,
+	BATCH = ENABLE_FEATURE_DNSD_BATCH ? 16 : 1,
 };
 
 /* the message from client and first part of response msg */
@@ -80,10 +92,23 @@ struct type_and_class {
 /* element of known name, ip address and reversed ip address */
 struct dns_entry {
 	struct dns_entry *next;
-	uint32_t ip;
+	struct dns_entry *next_by_name; /* hash chains */
+	struct dns_entry *next_by_rip;
+	uint8_t *ptr_rr;        /* prebuilt PTR answer RR, after name[] */
+	unsigned ptr_rr_len;
+	unsigned name_len;
+	unsigned rip_len;
+	uint8_t a_rr[A_RR_LEN]; /* prebuilt A answer RR */
 	char rip[IP_STRING_LEN]; /* length decimal reversed IP */
 	char name[1];
 };
+/* hash tables of dns_entry'es */
+struct dns_index {
+	unsigned mask;
+	struct dns_entry *wildcard;
+	struct dns_entry **by_name;
+	struct dns_entry **by_rip;
+};
 
 #define OPT_verbose (option_mask32 & 1)
 #define OPT_silent  (option_mask32 & 2)
@@ -109,10 +134,31 @@ static void undot(char *rip)
 	}
 }
 
+static int is_wildcard(struct dns_entry *d)
+{
+	return d->name[0] == 1 && d->name[1] == '*';
+}
+
+/* Answers always name the query: the question starts at offset 12 */
+static uint8_t *put_rr_head(uint8_t *p, unsigned type, uint32_t ttl, unsigned rdlen)
+{
+	*p++ = 0xc0; /* compressed name: pointer */
+	*p++ = 12;
+	*p++ = 0;
+	*p++ = type;
+	*p++ = 0;
+	*p++ = 1; /* class INET */
+	move_to_unaligned32((uint32_t *)p, htonl(ttl));
+	p += 4;
+	*p++ = rdlen >> 8;
+	*p++ = rdlen;
+	return p;
+}
+
 /*
  * Read hostname/IP records from file
  */
-static struct dns_entry *parse_conf_file(const char *fileconf)
+static struct dns_entry *parse_conf_file(const char *fileconf, uint32_t conf_ttl)
 {
 	char *token[2];
 	parser_t *parser;
@@ -126,6 +172,7 @@ static struct dns_entry *parse_conf_file(const char *fileconf)
 	while (config_read(parser, token, 2, 2, "# \t", PARSE_NORMAL)) {
 		struct in_addr ip;
 		uint32_t v32;
+		unsigned len;
 
 		if (inet_aton(token[1], &ip) == 0) {
 			bb_error_msg("error at line %u, skipping", parser->lineno);
@@ -136,7 +183,8 @@ static struct dns_entry *parse_conf_file(const char *fileconf)
 			bb_info_msg("name:%s, ip:%s", token[0], token[1]);
 
 		/* sizeof(*m) includes 1 byte for m->name[0] */
-		m = xzalloc(sizeof(*m) + strlen(token[0]) + 1);
+		len = strlen(token[0]) + 1;
+		m = xzalloc(sizeof(*m) + len + RR_HEAD_LEN + len + 1);
 		/*m->next = NULL;*/
 		*nextp = m;
 		nextp = &m->next;
@@ -144,10 +192,15 @@ static struct dns_entry *parse_conf_file(const char *fileconf)
 		m->name[0] = '.';
 		strcpy(m->name + 1, token[0]);
 		undot(m->name);
-		m->ip = ip.s_addr; /* in network order */
-		v32 = ntohl(m->ip);
+		m->name_len = len;
+		/* PTR RDATA is the name, with root label (NUL) */
+		m->ptr_rr = (uint8_t *)m->name + len + 1;
+		memcpy(put_rr_head(m->ptr_rr, REQ_PTR, conf_ttl, len + 1), m->name, len + 1);
+		m->ptr_rr_len = RR_HEAD_LEN + len + 1;
+		memcpy(put_rr_head(m->a_rr, REQ_A, conf_ttl, 4), &ip.s_addr, 4);
+		v32 = ntohl(ip.s_addr);
 		/* inverted order */
-		sprintf(m->rip, ".%u.%u.%u.%u",
+		m->rip_len = sprintf(m->rip, ".%u.%u.%u.%u",
 			(uint8_t)(v32),
 			(uint8_t)(v32 >> 8),
 			(uint8_t)(v32 >> 16),
@@ -159,28 +212,20 @@ static struct dns_entry *parse_conf_file(const char *fileconf)
 	return conf_data;
 }
 
-/*
- * Look query up in dns records and return answer if found.
- */
-static char *table_lookup(struct dns_entry *d,
-		uint16_t type,
-		char* query_string)
+static unsigned hash_name(const char *s, unsigned len)
+{
+	unsigned h = 0;
+
+	while (len--)
+		h = h * 31 + (uint8_t)tolower(*s++);
+	return h;
+}
+
+static struct dns_entry *find_name(struct dns_index *idx, const char *name, unsigned len)
 {
+	struct dns_entry *d = idx->by_name[hash_name(name, len) & idx->mask];
+
 	while (d) {
-		unsigned len = d->name[0];
-		/* d->name[len] is the last (non NUL) char */
-#if DEBUG
-		char *p, *q;
-		q = query_string + 1;
-		p = d->name + 1;
-		fprintf(stderr, "%d/%d p:%s q:%s %d\n",
-			(int)strlen(p), len,
-			p, q, (int)strlen(q)
-		);
-#endif
-		if (type == htons(REQ_A)) {
-			/* search by host name */
-			if (len != 1 || d->name[1] != '*') {
 /* we are lax, hope no name component is ever >64 so that length
  * (which will be represented as 'A','B'...) matches a lowercase letter.
  * Actually, I think false matches are hard to construct.
@@ -190,31 +235,102 @@ static char *table_lookup(struct dns_entry *d,
  * [65+32]<65 same chars>1   <31 same chars>NUL
  * This example seems to be the minimal case when false match occurs.
  */
-				if (strcasecmp(d->name, query_string) != 0)
-					goto next;
-			}
-			return (char *)&d->ip;
-#if DEBUG
-			fprintf(stderr, "Found IP:%x\n", (int)d->ip);
-#endif
-			return 0;
+		if (d->name_len == len && strncasecmp(d->name, name, len) == 0)
+			break;
+		d = d->next_by_name;
+	}
+	return d;
+}
+
+static struct dns_entry *find_rip(struct dns_index *idx, const char *rip, unsigned len)
+{
+	struct dns_entry *d = idx->by_rip[hash_name(rip, len) & idx->mask];
+
+	while (d) {
+		if (d->rip_len == len && memcmp(d->rip, rip, len) == 0)
+			break;
+		d = d->next_by_rip;
+	}
+	return d;
+}
+
+/*
+ * Hash the records. The first record for a name (or IP) wins,
+ * and a "*" record hides all names after it, as if we scanned
+ * the list in file order.
+ */
+static struct dns_index *index_conf_data(struct dns_entry *d)
+{
+	struct dns_index *idx;
+	struct dns_entry *m;
+	unsigned size;
+
+	size = 1;
+	for (m = d; m; m = m->next)
+		size++;
+	while (size & (size - 1)) /* round up to power of 2 */
+		size += size & -size;
+
+	idx = xzalloc(sizeof(*idx) + 2 * size * sizeof(idx->by_name[0]));
+	idx->mask = size - 1;
+	idx->by_name = (void *)(idx + 1);
+	idx->by_rip = idx->by_name + size;
+
+	for (; d; d = d->next) {
+		if (is_wildcard(d)) {
+			if (!idx->wildcard)
+				idx->wildcard = d;
+			continue; /* wildcards never answer PTR queries */
 		}
-		/* search by IP-address */
-		if ((len != 1 || d->name[1] != '*')
-		/* we assume (do not check) that query_string
-		 * ends in ".in-addr.arpa" */
-		 && is_prefixed_with(query_string, d->rip)
-		) {
-#if DEBUG
-			fprintf(stderr, "Found name:%s\n", d->name);
-#endif
-			return d->name;
+		if (!idx->wildcard && !find_name(idx, d->name, d->name_len)) {
+			struct dns_entry **head = &idx->by_name[hash_name(d->name, d->name_len) & idx->mask];
+			d->next_by_name = *head;
+			*head = d;
+		}
+		if (!find_rip(idx, d->rip, d->rip_len)) {
+			struct dns_entry **head = &idx->by_rip[hash_name(d->rip, d->rip_len) & idx->mask];
+			d->next_by_rip = *head;
+			*head = d;
 		}
- next:
-		d = d->next;
 	}
+	return idx;
+}
 
-	return NULL;
+/*
+ * Look query up in dns records and return the record if found.
+ */
+static struct dns_entry *table_lookup(struct dns_index *idx,
+		uint16_t type,
+		const char *query_string,
+		unsigned query_len)
+{
+	struct dns_entry *d;
+
+	if (type == htons(REQ_A)) {
+		/* search by host name */
+		d = find_name(idx, query_string, query_len);
+		if (!d)
+			d = idx->wildcard;
+	} else {
+		/* search by IP-address. We assume (do not check)
+		 * that query_string ends in ".in-addr.arpa",
+		 * and look up its first four labels */
+		const char *p = query_string;
+		int i;
+
+		for (i = 0; i < 4; i++) {
+			unsigned n = (uint8_t)*p;
+			if (n == 0 || strnlen(p + 1, n) != n)
+				return NULL;
+			p += 1 + n;
+		}
+		d = find_rip(idx, query_string, p - query_string);
+	}
+#if DEBUG
+	if (d)
+		fprintf(stderr, "Found name:%s\n", d->name);
+#endif
+	return d;
 }
 
 /*
@@ -377,8 +493,7 @@ Domain name in a message can be represented as either:
    - a pointer
    - a sequence of labels ending with a pointer
  */
-static int process_packet(struct dns_entry *conf_data,
-		uint32_t conf_ttl,
+static int process_packet(struct dns_index *idx,
 		uint8_t *buf,
 		unsigned buflen)
 {
@@ -386,9 +501,10 @@ static int process_packet(struct dns_entry *conf_data,
 	struct type_and_class *unaligned_type_class;
 	const char *err_msg;
 	char *query_string;
-	char *answstr;
+	struct dns_entry *d;
+	const uint8_t *rr;
 	uint8_t *answb;
-	uint16_t outr_rlen;
+	unsigned rr_len;
 	uint16_t outr_flags;
 	uint16_t type;
 	uint16_t class;
@@ -407,10 +523,9 @@ static int process_packet(struct dns_entry *conf_data,
 	/* start of query string */
 	query_string = (void *)(head + 1);
 	/* caller guarantees strlen is <= MAX_PACK_LEN */
-	query_len = strlen(query_string) + 1;
+	query_len = strlen(query_string);
 	/* may be unaligned! */
-	unaligned_type_class = (void *)(query_string + query_len);
-	query_len += sizeof(*unaligned_type_class);
+	unaligned_type_class = (void *)(query_string + query_len + 1);
 	/* where to append answer block */
 	answb = (void *)(unaligned_type_class + 1);
 
@@ -442,18 +557,24 @@ static int process_packet(struct dns_entry *conf_data,
 	}
 
 	/* look up the name */
-	answstr = table_lookup(conf_data, type, query_string);
+	d = table_lookup(idx, type, query_string, query_len);
 #if DEBUG
 	/* Shows lengths instead of dots, unusable for !DEBUG */
-	bb_info_msg("'%s'->'%s'", query_string, answstr);
+	bb_info_msg("'%s'->'%s'", query_string, d ? d->name : NULL);
 #endif
-	outr_rlen = 4;
-	if (answstr && type == htons(REQ_PTR)) {
-		/* returning a host name */
-		outr_rlen = strlen(answstr) + 1;
+	rr = NULL;
+	rr_len = 0;
+	if (d) {
+		rr = d->a_rr;
+		rr_len = A_RR_LEN;
+		if (type == htons(REQ_PTR)) {
+			/* returning a host name */
+			rr = d->ptr_rr;
+			rr_len = d->ptr_rr_len;
+		}
 	}
-	if (!answstr
-	 || (unsigned)(answb - buf) + query_len + 4 + 2 + outr_rlen > MAX_PACK_LEN
+	if (!rr
+	 || (unsigned)(answb - buf) + rr_len > MAX_PACK_LEN
 	) {
 		/* QR = 1 "response"
 		 * AA = 1 "Authoritative Answer"
@@ -464,14 +585,8 @@ static int process_packet(struct dns_entry *conf_data,
 	}
 
 	/* Append answer Resource Record */
-	memcpy(answb, query_string, query_len); /* name, type, class */
-	answb += query_len;
-	move_to_unaligned32((uint32_t *)answb, htonl(conf_ttl));
-	answb += 4;
-	move_to_unaligned16((uint16_t *)answb, htons(outr_rlen));
-	answb += 2;
-	memcpy(answb, answstr, outr_rlen);
-	answb += outr_rlen;
+	memcpy(answb, rr, rr_len);
+	answb += rr_len;
 
 	/* QR = 1 "response",
 	 * AA = 1 "Authoritative Answer",
@@ -504,20 +619,118 @@ static int process_packet(struct dns_entry *conf_data,
 	return answb - buf;
 }
 
+#if ENABLE_FEATURE_DNSD_BATCH
+/* Turn IP[V6]_PKTINFO of a received packet into one which makes
+ * sendmsg() reply from the address the query was sent to,
+ * like recv_from_to() + send_to_from() do.
+ */
+static void pktinfo_to_reply(struct msghdr *msg)
+{
+	struct cmsghdr *cmsgptr;
+
+	for (cmsgptr = CMSG_FIRSTHDR(msg);
+			cmsgptr != NULL;
+			cmsgptr = CMSG_NXTHDR(msg, cmsgptr)
+	) {
+		/* cmsgs are in our aligned buffers, can access them directly */
+		if (cmsgptr->cmsg_level == IPPROTO_IP
+		 && cmsgptr->cmsg_type == IP_PKTINFO
+		) {
+			struct in_pktinfo *pktptr = (void *)CMSG_DATA(cmsgptr);
+			pktptr->ipi_ifindex = 0;
+			pktptr->ipi_spec_dst = pktptr->ipi_addr;
+		}
+# if ENABLE_FEATURE_IPV6 && defined(IPV6_PKTINFO)
+		if (cmsgptr->cmsg_level == IPPROTO_IPV6
+		 && cmsgptr->cmsg_type == IPV6_PKTINFO
+		) {
+			struct in6_pktinfo *pktptr = (void *)CMSG_DATA(cmsgptr);
+			pktptr->ipi6_ifindex = 0;
+		}
+# endif
+	}
+}
+
+static void NOINLINE serve_batched(int udps, struct dns_index *idx)
+{
+	struct mmsghdr msgs[BATCH];
+	struct mmsghdr replies[BATCH];
+	struct iovec iov[BATCH];
+	len_and_sockaddr from[BATCH];
+	union {
+		char cmsg[CMSG_SPACE(sizeof(struct in_pktinfo))];
+# if ENABLE_FEATURE_IPV6 && defined(IPV6_PKTINFO)
+		char cmsg6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+# endif
+	} u[BATCH] ALIGN_PTR;
+	/* Ensure buf is 32bit aligned (we need 16bit, but 32bit can't hurt) */
+	uint8_t buf[BATCH][MAX_PACK_LEN + 1] ALIGN4;
+
+	memset(msgs, 0, sizeof(msgs));
+	while (1) {
+		int i, n, cnt;
+
+		for (i = 0; i < BATCH; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = MAX_PACK_LEN + 1;
+			msgs[i].msg_hdr.msg_name = &from[i].u.sa;
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i].u);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = &u[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(u[i]);
+		}
+		/* Block until a query arrives, then also take
+		 * whatever else is already queued, without blocking */
+		cnt = recvmmsg(udps, msgs, BATCH, MSG_WAITFORONE, NULL);
+		if (cnt < 0) {
+			bb_simple_perror_msg("recvmmsg");
+			continue;
+		}
+
+		n = 0;
+		for (i = 0; i < cnt; i++) {
+			int r = msgs[i].msg_len;
+			if (r < 12 || r > MAX_PACK_LEN) {
+				bb_error_msg("packet size %d, ignored", r);
+				continue;
+			}
+			if (OPT_verbose)
+				bb_simple_info_msg("got UDP packet");
+			buf[i][r] = '\0'; /* paranoia */
+			r = process_packet(idx, buf[i], r);
+			if (r <= 0)
+				continue;
+			iov[i].iov_len = r;
+			pktinfo_to_reply(&msgs[i].msg_hdr);
+			replies[n++].msg_hdr = msgs[i].msg_hdr;
+		}
+
+		for (i = 0; i < n;) {
+			int r = sendmmsg(udps, replies + i, n - i, 0);
+			if (r <= 0) {
+				/* the failed one is lost, try the rest */
+				bb_simple_perror_msg("sendmmsg");
+				r = 1;
+			}
+			i += r;
+		}
+	}
+}
+#endif
+
 int dnsd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int dnsd_main(int argc UNUSED_PARAM, char **argv)
 {
 	const char *listen_interface = "0.0.0.0";
 	const char *fileconf = "/etc/dnsd.conf";
-	struct dns_entry *conf_data;
+	struct dns_index *idx;
 	uint32_t conf_ttl = DEFAULT_TTL;
 	char *sttl, *sport;
-	len_and_sockaddr *lsa, *from, *to;
-	unsigned lsa_size;
+	len_and_sockaddr *lsa IF_NOT_FEATURE_DNSD_BATCH(, *from, *to);
+	IF_NOT_FEATURE_DNSD_BATCH(unsigned lsa_size;)
 	int udps, opts;
 	uint16_t port = 53;
-	/* Ensure buf is 32bit aligned (we need 16bit, but 32bit can't hurt) */
-	uint8_t buf[MAX_PACK_LEN + 1] ALIGN4;
 
 	opts = getopt32(argv, "vsi:c:t:p:d", &listen_interface, &fileconf, &sttl, &sport);
 	//if (opts & (1 << 0)) // -v
@@ -534,15 +747,12 @@ int dnsd_main(int argc UNUSED_PARAM, char **argv)
 		logmode = LOGMODE_SYSLOG;
 	}
 
-	conf_data = parse_conf_file(fileconf);
+	idx = index_conf_data(parse_conf_file(fileconf, conf_ttl));
 
 	lsa = xdotted2sockaddr(listen_interface, port);
 	udps = xsocket(lsa->u.sa.sa_family, SOCK_DGRAM, 0);
 	xbind(udps, &lsa->u.sa, lsa->len);
 	socket_want_pktinfo(udps); /* needed for recv_from_to to work */
-	lsa_size = LSA_LEN_SIZE + lsa->len;
-	from = xzalloc(lsa_size);
-	to = xzalloc(lsa_size);
 
 	{
 		char *p = xmalloc_sockaddr2dotted(&lsa->u.sa);
@@ -550,7 +760,16 @@ int dnsd_main(int argc UNUSED_PARAM, char **argv)
 		free(p);
 	}
 
+#if ENABLE_FEATURE_DNSD_BATCH
+	serve_batched(udps, idx);
+#else
+	lsa_size = LSA_LEN_SIZE + lsa->len;
+	from = xzalloc(lsa_size);
+	to = xzalloc(lsa_size);
+
 	while (1) {
+		/* Ensure buf is 32bit aligned (we need 16bit, but 32bit can't hurt) */
+		uint8_t buf[MAX_PACK_LEN + 1] ALIGN4;
 		int r;
 		/* Try to get *DEST* address (to which of our addresses
 		 * this query was directed), and reply from the same address.
@@ -566,10 +785,11 @@ int dnsd_main(int argc UNUSED_PARAM, char **argv)
 		if (OPT_verbose)
 			bb_simple_info_msg("got UDP packet");
 		buf[r] = '\0'; /* paranoia */
-		r = process_packet(conf_data, conf_ttl, buf, r);
+		r = process_packet(idx, buf, r);
 		if (r <= 0)
 			continue;
 		send_to_from(udps, buf, r, 0, &from->u.sa, &to->u.sa, lsa->len);
 	}
+#endif
 	return 0;
 }
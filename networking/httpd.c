@@ -46,6 +46,8 @@
  * D:*               # Deny from other IP connections
  * E404:/path/e404.html # /path/e404.html is the 404 (not found) error page
  * I:index.html      # Show index.html when a directory is requested
+ * Z:/var/cache/httpd # Keep gzipped copies of text files here
+ *                   # (only with FEATURE_HTTPD_GZIP_DYNAMIC)
  *
  * P:/url:[http://]hostname[:port]/new/path
  *                   # When /urlXXXXXX is requested, reverse proxy
@@ -221,6 +223,22 @@
 //config:	Makes httpd send files using GZIP content encoding if the
 //config:	client supports it and a pre-compressed <file>.gz exists.
 //config:
+//config:config FEATURE_HTTPD_GZIP_DYNAMIC
+//config:	bool "Compress CGI output and text files on the fly"
+//config:	default n
+//config:	depends on FEATURE_HTTPD_GZIP
+//config:	help
+//config:	If the client supports GZIP, text output of CGI scripts
+//config:	(this includes directory listings made by index.cgi)
+//config:	is piped through gzip. With "Z:/cache/dir" in httpd.conf,
+//config:	text files which have no <file>.gz are compressed into that
+//config:	directory when first requested, and recompressed whenever
+//config:	their modification time changes.
+//config:
+//config:	Needs gzip in PATH, or the gzip applet and
+//config:	FEATURE_PREFER_APPLETS. CGIs which stream output slowly
+//config:	(e.g. event streams) will see it delayed by compression.
+//config:
 //config:config FEATURE_HTTPD_ETAG
 //config:	bool "Support caching via ETag header"
 //config:	default y
@@ -258,6 +276,37 @@
 //config:	depends on HTTPD
 //config:	help
 //config:	Support IP deny/allow rules
+//config:
+//config:config FEATURE_HTTPD_KEEPALIVE
+//config:	bool "Support persistent connections"
+//config:	default y
+//config:	depends on HTTPD
+//config:	help
+//config:	Serve more than one request over a connection if the client
+//config:	allows it (HTTP/1.1 default, or "Connection: keep-alive").
+//config:	Pipelined requests are answered in order. Only replies with
+//config:	known length (static files, HEAD, 304) keep the connection,
+//config:	CGI, proxy and error replies still close it.
+//config:
+//config:config FEATURE_HTTPD_PREFORK
+//config:	bool "Enable -P N option (prefork worker processes)"
+//config:	default y
+//config:	depends on FEATURE_HTTPD_KEEPALIVE && !NOMMU
+//config:	help
+//config:	With -P N, N worker processes are started at startup. Each one
+//config:	accepts connections and serves static files itself, instead of
+//config:	the server forking a process per connection. Workers only fork
+//config:	for CGI and proxy requests.
+//config:
+//config:config FEATURE_HTTPD_CACHE
+//config:	bool "Cache static file lookups in -P workers"
+//config:	default y
+//config:	depends on FEATURE_HTTPD_PREFORK
+//config:	help
+//config:	-P workers remember open file descriptors, sizes, mtimes
+//config:	and MIME types of files they served, and which directories
+//config:	have no httpd.conf. Each cached file is stat()ed again
+//config:	on its first use in every request, so changes are noticed.
 
 //applet:IF_HTTPD(APPLET(httpd, BB_DIR_USR_SBIN, BB_SUID_DROP))
 
@@ -269,6 +318,7 @@
 //usage:       " [-p [IP:]PORT]"
 //usage:	IF_FEATURE_HTTPD_SETUID(" [-u USER[:GRP]]")
 //usage:	IF_FEATURE_HTTPD_BASIC_AUTH(" [-r REALM]")
+//usage:	IF_FEATURE_HTTPD_PREFORK(" [-P N]")
 //usage:       " [-h HOME]\n"
 //usage:       "or httpd -d/-e" IF_FEATURE_HTTPD_AUTH_MD5("/-m") " STRING"
 //usage:#define httpd_full_usage "\n\n"
@@ -281,6 +331,8 @@
 //usage:     "\n	-u USER[:GRP]	Set uid/gid after binding to port")
 //usage:	IF_FEATURE_HTTPD_BASIC_AUTH(
 //usage:     "\n	-r REALM	Authentication Realm for Basic Authentication")
+//usage:	IF_FEATURE_HTTPD_PREFORK(
+//usage:     "\n	-P N		Serve connections by N preforked workers")
 //usage:     "\n	-h HOME		Home directory (default .)"
 //usage:     "\n	-c FILE		Configuration file (default {/etc,HOME}/httpd.conf)"
 //usage:	IF_FEATURE_HTTPD_AUTH_MD5(
@@ -303,6 +355,9 @@
 #if ENABLE_FEATURE_USE_SENDFILE
 # include <sys/sendfile.h>
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+# include <netinet/tcp.h>
+#endif
 
 /* see sys/netinet6/in6.h */
 #if defined(__FreeBSD__)
@@ -320,7 +375,15 @@
 #define IOBUF_SIZE 8192
 #define MAX_HTTP_HEADERS_SIZE (32*1024)
 
+/* Do we look at any request header at all? */
+#define HTTPD_READS_HEADERS ( \
+	ENABLE_FEATURE_HTTPD_CGI || ENABLE_FEATURE_HTTPD_BASIC_AUTH || \
+	ENABLE_FEATURE_HTTPD_RANGES || ENABLE_FEATURE_HTTPD_GZIP || \
+	ENABLE_FEATURE_HTTPD_ETAG || ENABLE_FEATURE_HTTPD_KEEPALIVE)
+
 #define HEADER_READ_TIMEOUT 60
+/* How long an idle persistent connection is kept open */
+#define KEEPALIVE_TIMEOUT 5
 
 #define STR1(s) #s
 #define STR(s) STR1(s)
@@ -351,6 +414,24 @@ typedef struct Htaccess_IP {
 } Htaccess_IP;
 #endif
 
+#if ENABLE_FEATURE_HTTPD_CACHE
+/* Number of files -P worker keeps open, power of 2 */
+# define FILE_CACHE_SIZE 256
+typedef struct file_cache {
+	char *path;             /* NULL: free slot */
+	const char *mime_type;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	dev_t dev;
+	ino_t ino;
+	mode_t mode;            /* 0: file does not exist */
+	smallint mime_known;
+	unsigned checked;       /* G.cache_gen when last stat()ed */
+	int fd;                 /* -1: not a regular file, or can't open */
+} file_cache;
+#endif
+
 /* Must have "next" as a first member */
 typedef struct Htaccess_Proxy {
 	struct Htaccess_Proxy *next;
@@ -456,8 +537,30 @@ struct globals {
 #if ENABLE_FEATURE_HTTPD_GZIP
 	/* client can handle gzip / we are going to send gzip */
 	smallint content_gzip;
+#endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	smallint keepalive_ok;  /* client allows another request after this one */
+	smallint has_body;      /* request has a body we don't read */
+	smallint keepalive;     /* and this reply has known length */
+	smallint keepalive_idle; /* waiting for the next request */
+	smallint conf_merged;   /* subdir httpd.conf was merged into config */
+#endif
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	smallint worker;        /* we are a -P worker, not a per-connection child */
+	volatile smallint reload_conf; /* got SIGHUP */
+	unsigned worker_cnt;
+	pid_t *worker_pid;
+	unsigned char *worker_busy; /* [worker_cnt], shared with workers */
+	int listen_fd;          /* worker: to see whether clients wait */
+#endif
+#if ENABLE_FEATURE_HTTPD_CACHE
+	unsigned cache_gen;     /* incremented for each request */
+	file_cache *file_cache; /* [FILE_CACHE_SIZE] if caching */
 #endif
 	time_t last_mod;
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	long last_mod_nsec;
+#endif
 #if ENABLE_FEATURE_HTTPD_ETAG
 	char *if_none_match;
 #endif
@@ -468,6 +571,10 @@ struct globals {
 	const char *opt_c_configFile;
 	const char *home_httpd;
 	const char *index_page;
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	smallint vary_encoding; /* reply depends on Accept-Encoding */
+	char *gzip_cache_dir;
+#endif
 
 	const char *found_mime_type;
 	const char *found_moved_temporarily;
@@ -482,7 +589,6 @@ struct globals {
 #if ENABLE_FEATURE_HTTPD_RANGES
 	off_t range_start;
 	off_t range_end;
-	off_t range_len;
 #endif
 
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
@@ -506,6 +612,12 @@ struct globals {
 #if ENABLE_FEATURE_HTTPD_PROXY
 	Htaccess_Proxy *proxy;
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	sigjmp_buf next_request;
+#endif
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	sigjmp_buf next_connection;
+#endif
 };
 #define G (*ptr_to_globals)
 #define verbose           (G.verbose          )
@@ -529,14 +641,17 @@ struct globals {
 #if ENABLE_FEATURE_HTTPD_RANGES
 #define range_start       (G.range_start      )
 #define range_end         (G.range_end        )
-#define range_len         (G.range_len        )
 #else
 enum {
 	range_start = -1,
 	range_end = MAXINT(off_t) - 1,
-	range_len = MAXINT(off_t),
 };
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+# define keepalive        (G.keepalive        )
+#else
+# define keepalive        0
+#endif
 #define rmt_ip_str        (G.rmt_ip_str       )
 #define g_auth            (G.g_auth           )
 #define mime_a            (G.mime_a           )
@@ -676,6 +791,148 @@ static int scan_ip_mask(const char *str, unsigned *ipp, unsigned *maskp)
 }
 #endif
 
+#if ENABLE_FEATURE_HTTPD_CACHE
+static void cache_flush(void)
+{
+	file_cache *e;
+
+	for (e = G.file_cache; e < G.file_cache + FILE_CACHE_SIZE; e++) {
+		free(e->path);
+		e->path = NULL;
+		if (e->fd >= 0)
+			close(e->fd);
+		e->fd = -1;
+	}
+}
+
+static void cache_init(void)
+{
+	G.file_cache = xzalloc(FILE_CACHE_SIZE * sizeof(G.file_cache[0]));
+	cache_flush(); /* set all fds to -1 */
+}
+
+/* Called before each request: entries are checked again on first use */
+static void cache_check(void)
+{
+	G.cache_gen++;
+}
+
+/* Returned entry is valid until next cache_get() */
+static file_cache *cache_get(const char *path)
+{
+	unsigned hash;
+	const char *p;
+	file_cache *e;
+	struct stat sb;
+	int r;
+
+	hash = 0;
+	for (p = path; *p; p++)
+		hash = hash * 31 + (unsigned char)*p;
+	e = &G.file_cache[hash & (FILE_CACHE_SIZE - 1)];
+	if (e->path && strcmp(e->path, path) == 0) {
+		if (e->checked == G.cache_gen)
+			return e;
+		/* First use in this request: was the file changed or replaced?
+		 * stat() walks the whole path, so this also notices renamed
+		 * directories and swapped symlinks above the file. */
+		e->checked = G.cache_gen;
+		r = stat(path, &sb);
+		if (r != 0 ? e->mode == 0
+		    : (e->mode == sb.st_mode
+		      && e->ino == sb.st_ino
+		      && e->dev == sb.st_dev
+		      && e->size == sb.st_size
+		      && e->mtime == sb.st_mtime
+		      && e->mtime_nsec == sb.st_mtim.tv_nsec)
+		) {
+			return e;
+		}
+	} else {
+		free(e->path);
+		e->path = xstrdup(path);
+		e->checked = G.cache_gen;
+		r = stat(path, &sb);
+	}
+
+	if (e->fd >= 0)
+		close(e->fd);
+	e->fd = -1;
+	e->mode = 0;
+	e->mime_known = 0;
+	if (r == 0) {
+		e->mode = sb.st_mode;
+		e->size = sb.st_size;
+		e->mtime = sb.st_mtime;
+		e->mtime_nsec = sb.st_mtim.tv_nsec;
+		e->dev = sb.st_dev;
+		e->ino = sb.st_ino;
+		if (S_ISREG(sb.st_mode))
+			e->fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	return e;
+}
+
+/* stat(), open() and close() which use the cache if we have it */
+static int cached_stat(const char *path, struct stat *sb)
+{
+	file_cache *e;
+
+	if (!G.file_cache)
+		return stat(path, sb);
+	e = cache_get(path);
+	if (!e->mode) {
+		errno = ENOENT;
+		return -1;
+	}
+	sb->st_mode = e->mode;
+	sb->st_size = e->size;
+	sb->st_mtime = e->mtime;
+	sb->st_mtim.tv_nsec = e->mtime_nsec;
+	return 0;
+}
+
+static void cached_close(int fd)
+{
+	if (!G.file_cache)
+		close(fd);
+}
+
+/* Does path certainly not exist? */
+static int cached_missing(const char *path)
+{
+	return G.file_cache && cache_get(path)->mode == 0;
+}
+#else
+# define cached_stat(path, sb) stat(path, sb)
+# define cached_close(fd) close(fd)
+# define cached_missing(path) 0
+#endif
+
+/* If sb is not NULL, also fstat() the file */
+static int cached_open(const char *path, struct stat *sb)
+{
+	int fd;
+
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (G.file_cache) {
+		file_cache *e = cache_get(path);
+		if (sb) {
+			sb->st_size = e->size;
+			sb->st_mtime = e->mtime;
+			sb->st_mtim.tv_nsec = e->mtime_nsec;
+		}
+		if (!ENABLE_FEATURE_USE_SENDFILE && e->fd >= 0)
+			lseek(e->fd, 0, SEEK_SET);
+		return e->fd;
+	}
+#endif
+	fd = open(path, O_RDONLY);
+	if (fd >= 0 && sb)
+		fstat(fd, sb);
+	return fd;
+}
+
 /*
  * Parse configuration file into in-memory linked list.
  *
@@ -703,6 +960,20 @@ static int parse_conf(const char *path, int flag)
 	const char *filename;
 	char buf[160];
 
+	filename = opt_c_configFile;
+	if (flag == SUBDIR_PARSE || filename == NULL) {
+		filename = alloca(strlen(path) + sizeof(HTTPD_CONF) + 2);
+		sprintf((char *)filename, "%s/%s", path, HTTPD_CONF);
+	}
+	if (flag == SUBDIR_PARSE && cached_missing(filename))
+		return -1;
+	f = fopen_for_read(filename);
+	if (!f && flag == SUBDIR_PARSE) {
+		/* config file not found, no changes to config
+		 * (-P worker goes on with it to the next connection) */
+		return -1;
+	}
+
 	/* discard old rules */
 #if ENABLE_FEATURE_HTTPD_ACL_IP
 	free_Htaccess_IP_list(&G.ip_a_d);
@@ -716,18 +987,16 @@ static int parse_conf(const char *path, int flag)
 #endif
 #if ENABLE_FEATURE_HTTPD_CONFIG_WITH_SCRIPT_INTERPR
 		free_Htaccess_list(&script_i);
+#endif
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+		free(G.gzip_cache_dir);
+		G.gzip_cache_dir = NULL;
 #endif
 	}
 
-	filename = opt_c_configFile;
-	if (flag == SUBDIR_PARSE || filename == NULL) {
-		filename = alloca(strlen(path) + sizeof(HTTPD_CONF) + 2);
-		sprintf((char *)filename, "%s/%s", path, HTTPD_CONF);
-	}
-
-	while ((f = fopen_for_read(filename)) == NULL) {
-		if (flag >= SUBDIR_PARSE) { /* SUBDIR or TRY_CURDIR */
-			/* config file not found, no changes to config */
+	while (f == NULL) {
+		if (flag >= SUBDIR_PARSE) { /* TRY_CURDIR */
+			/* config file not found */
 			return -1;
 		}
 		if (flag == FIRST_PARSE) {
@@ -739,6 +1008,7 @@ static int parse_conf(const char *path, int flag)
 		}
 		flag = TRY_CURDIR_PARSE;
 		filename = HTTPD_CONF;
+		f = fopen_for_read(filename);
 	}
 
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
@@ -804,6 +1074,14 @@ static int parse_conf(const char *path, int flag)
 			continue;
 		}
 
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+		if (flag != SUBDIR_PARSE && ch == 'Z') {
+			free(G.gzip_cache_dir);
+			G.gzip_cache_dir = xstrdup(after_colon);
+			continue;
+		}
+#endif
+
 		/* do not allow jumping around using H in subdir's configs */
 		if (flag == FIRST_PARSE && ch == 'H') {
 			home_httpd = xstrdup(after_colon);
@@ -1048,12 +1326,31 @@ static int openServer(void)
 	return n;
 }
 
+/*
+ * We are done with this connection: exit,
+ * or in -P worker go back to accept() the next one.
+ */
+static void close_and_exit(void) NORETURN;
+static void close_and_exit(void)
+{
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	if (G.worker)
+		siglongjmp(G.next_connection, 1);
+#endif
+	_exit(xfunc_error_retval);
+}
+
 /*
  * Log the connection closure and exit.
+ * If the reply was complete and the client wants more, read the next request.
  */
 static void log_and_exit(void) NORETURN;
 static void log_and_exit(void)
 {
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	if (keepalive)
+		siglongjmp(G.next_request, 1);
+#endif
 	/* Paranoia. IE said to be buggy. It may send some extra data
 	 * or be confused by us just exiting without SHUT_WR. Oh well. */
 	shutdown(1, SHUT_WR);
@@ -1066,7 +1363,7 @@ static void log_and_exit(void)
 
 	if (verbose > 2)
 		bb_simple_error_msg("closed");
-	_exit(xfunc_error_retval);
+	close_and_exit();
 }
 
 /*
@@ -1106,6 +1403,16 @@ static void send_headers(unsigned responseNum)
 	if (verbose)
 		bb_error_msg("response:%u", responseNum);
 
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* Only a reply of known length can be followed by another one */
+	keepalive = G.keepalive_ok && !G.has_body && !G.conf_merged
+		&& (responseNum == HTTP_NOT_MODIFIED
+		   || (file_size != -1
+		      && (responseNum == HTTP_OK || responseNum == HTTP_PARTIAL_CONTENT)
+		      )
+		   );
+#endif
+
 	/* We use sprintf, not snprintf (it's less code).
 	 * iobuf[] is several kbytes long and all headers we generate
 	 * always fit into those kbytes.
@@ -1122,11 +1429,12 @@ static void send_headers(unsigned responseNum)
 #if ENABLE_FEATURE_HTTPD_DATE
 			"Date: %s\r\n"
 #endif
-			"Connection: close\r\n",
-			responseNum, responseString
+			"Connection: %s\r\n",
+			responseNum, responseString,
 #if ENABLE_FEATURE_HTTPD_DATE
-			, date_str
+			date_str,
 #endif
+			keepalive ? "keep-alive" : "close"
 		);
 	}
 
@@ -1234,7 +1542,8 @@ static void send_headers(unsigned responseNum)
 #endif
 
 	/* Because of 4.4 (5), we can forgo sending of "Content-Length"
-	 * since we close connection afterwards, but it helps clients
+	 * if we close connection afterwards (persistent connections
+	 * do need it), but it helps clients
 	 * to e.g. estimate download times, show progress bars etc.
 	 * Theoretically we should not send it if page is compressed,
 	 * but de-facto standard is to send it (see comment below).
@@ -1261,6 +1570,11 @@ static void send_headers(unsigned responseNum)
 	 */
 	if (content_gzip)
 		len += sprintf(iobuf + len, "Content-Encoding: gzip\r\n");
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	/* tell caches not to give gzip to clients which did not ask for it */
+	if (G.vary_encoding)
+		len += sprintf(iobuf + len, "Vary: Accept-Encoding\r\n");
+#endif
 
 	iobuf[len++] = '\r';
 	iobuf[len++] = '\n';
@@ -1295,6 +1609,34 @@ static void send_headers_and_exit(int responseNum)
 	log_and_exit();
 }
 
+#if ENABLE_FEATURE_HTTPD_PREFORK
+/* -P worker waits for the next request on a persistent connection.
+ * Browsers keep several idle connections open, this must not keep
+ * other clients out: if someone waits to connect and no other worker
+ * takes him in a moment, close ours.
+ * Returns 0 if the connection should be closed.
+ */
+static int keepalive_wait(void)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = G.listen_fd;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		/* alarm() limits the wait */
+		safe_poll(pfd, 2, -1);
+		if (pfd[0].revents)
+			return 1;
+		if (safe_poll(pfd, 1, 50) > 0)
+			return 1;
+		if (safe_poll(pfd + 1, 1, 0) > 0)
+			return 0;
+	}
+}
+#endif
+
 /*
  * Read from the socket until '\n' or EOF.
  * '\r' chars are removed.
@@ -1306,42 +1648,200 @@ static void send_headers_and_exit(int responseNum)
 static unsigned get_line(void)
 {
 	unsigned count;
-	char c;
+	char *p;
 
 	count = 0;
 	while (1) {
+		char *nl;
+		unsigned len, n;
+
 		if (hdr_cnt <= 0) {
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+			alarm(G.keepalive_idle ? KEEPALIVE_TIMEOUT : HEADER_READ_TIMEOUT);
+#else
 			alarm(HEADER_READ_TIMEOUT);
+#endif
+#if ENABLE_FEATURE_HTTPD_PREFORK
+			if (G.keepalive_idle && G.worker && !keepalive_wait())
+				break; /* as if client closed it */
+#endif
 			hdr_cnt = safe_read(STDIN_FILENO, hdr_buf, sizeof_hdr_buf);
 			if (hdr_cnt <= 0)
-				goto ret;
+				break;
 			hdr_ptr = hdr_buf;
 		}
-		hdr_cnt--;
-		c = *hdr_ptr++;
-		if (c == '\r')
-			continue;
-		if (c == '\n')
+		nl = memchr(hdr_ptr, '\n', hdr_cnt);
+		len = (nl ? nl : hdr_ptr + hdr_cnt) - hdr_ptr;
+		/* Copy what fits, the rest of too long line is lost */
+		n = MIN(len, (IOBUF_SIZE - 1) - count);
+		memcpy(iobuf + count, hdr_ptr, n);
+		count += n;
+		hdr_ptr += len;
+		hdr_cnt -= len;
+		if (nl) {
+			hdr_ptr++;
+			hdr_cnt--;
 			break;
-		iobuf[count] = c;
-		if (count < (IOBUF_SIZE - 1))      /* check overflow */
-			count++;
+		}
+	}
+	/* Usually there is one '\r', at the end */
+	p = memchr(iobuf, '\r', count);
+	if (p) {
+		char *s, *end = iobuf + count;
+		for (s = p; s < end; s++) {
+			if (*s != '\r')
+				*p++ = *s;
+		}
+		count = p - iobuf;
 	}
- ret:
 	iobuf[count] = '\0';
 	return count;
 }
 
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+/* Is it worth compressing? Images, archives etc are already compressed */
+static int compressible_type(const char *mime_type)
+{
+	return mime_type
+		&& (is_prefixed_with(mime_type, "text/")
+		 || strstr(mime_type, "json")
+		 || strstr(mime_type, "javascript")
+		 || strstr(mime_type, "xml") /* also image/svg+xml */
+		);
+}
+
+/* Start gzip reading from in_fd and writing to out_fd.
+ * Returns its pid, or 0 if it can't be run.
+ */
+static pid_t spawn_gzip(int in_fd, int out_fd)
+{
+	volatile int vfork_exec_errno = 0;
+	pid_t pid = xvfork();
+
+	if (pid == 0) {
+		/* child */
+		xmove_fd(in_fd, STDIN_FILENO);
+		xmove_fd(out_fd, STDOUT_FILENO);
+		BB_EXECLP("gzip", "gzip", (char*)NULL);
+		vfork_exec_errno = errno;
+		_exit_FAILURE();
+	}
+	/* parent, child has exec'ed or exited */
+	if (vfork_exec_errno) {
+		safe_waitpid(pid, NULL, 0);
+		return 0;
+	}
+	return pid;
+}
+#endif
+
 #if ENABLE_FEATURE_HTTPD_CGI || ENABLE_FEATURE_HTTPD_PROXY
 
+# if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+/* Returns pointer past the empty line which ends CGI header, or NULL */
+static char *cgi_header_end(char *buf, int len)
+{
+	char *p = buf;
+	char *end = buf + len;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if (p < end && p[0] == '\n')
+			return p + 1;
+		if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+			return p + 2;
+	}
+	return NULL;
+}
+
+/* If CGI output is text, send its header with "Vary: Accept-Encoding"
+ * added. If client accepts gzip, also add "Content-Encoding: gzip"
+ * (and remove Content-Length) and start gzip to send the body.
+ * Replies which have no body (HEAD, 1xx, 204, 304) are not compressed.
+ * *prbuf, *pcount: CGI output, advanced past the header if it was sent.
+ * Its first line is the status, unless we already sent "200 OK" for it.
+ * Returns fd to write the body to: either gzip's stdin or the peer.
+ */
+static int cgi_start_gzip(char **prbuf, int *pcount, pid_t *gzip_pid, int is_head)
+{
+	static const char vary[] ALIGN1 = "Vary: Accept-Encoding\r\n";
+	static const char content_encoding[] ALIGN1 = "Content-Encoding: gzip\r\n";
+	char *rbuf = *prbuf;
+	char *end = cgi_header_end(rbuf, *pcount);
+	char *line, *eol;
+	char *hdr, *p;
+	int compress = 0;
+	unsigned status;
+	struct fd_pair gz;
+
+	if (!end) /* header is too big */
+		return STDOUT_FILENO;
+	/* "HTTP/1.1 304 Not Modified" or (from "Status:") "304 Not Modified" */
+	p = rbuf;
+	if (memcmp(p, HTTP_200, 5) == 0)
+		p = skip_whitespace(skip_non_whitespace(p));
+	status = isdigit(*p) ? atoi(p) : 200;
+	for (line = rbuf; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (STRNCASECMP(line, "Content-Encoding:") == 0
+		 || STRNCASECMP(line, "Transfer-Encoding:") == 0
+		) {
+			return STDOUT_FILENO; /* CGI did it itself */
+		}
+		if (STRNCASECMP(line, "Content-type:") == 0) {
+			*eol = '\0';
+			compress = compressible_type(skip_whitespace(line + sizeof("Content-type:")-1));
+			*eol = '\n';
+		}
+	}
+	if (!compress)
+		return STDOUT_FILENO;
+
+	gz.wr = STDOUT_FILENO;
+	if (content_gzip && !is_head
+	 && status >= 200 && status != 204 && status != 304
+	) {
+		xpiped_pair(gz);
+		close_on_exec_on(gz.wr);
+		*gzip_pid = spawn_gzip(gz.rd, STDOUT_FILENO);
+		close(gz.rd);
+		if (!*gzip_pid) {
+			close(gz.wr);
+			gz.wr = STDOUT_FILENO;
+		}
+	}
+
+	p = hdr = xmalloc((end - rbuf) + sizeof(vary) + sizeof(content_encoding));
+	for (line = rbuf; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (eol + 1 == end) { /* empty line */
+			p = stpcpy(p, vary);
+			if (*gzip_pid)
+				p = stpcpy(p, content_encoding);
+		}
+		if (!*gzip_pid || STRNCASECMP(line, "Content-Length:") != 0)
+			p = mempcpy(p, line, eol + 1 - line);
+	}
+	full_write(STDOUT_FILENO, hdr, p - hdr);
+	free(hdr);
+
+	*pcount -= end - rbuf;
+	*prbuf = end;
+	return gz.wr;
+}
+# endif
+
 /* gcc 4.2.1 fares better with NOINLINE */
-static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post_len) NORETURN;
-static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post_len)
+/* gzip: 0 - send as is (proxy), 1 - CGI reply to GET/POST, 2 - to HEAD */
+static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post_len, int gzip) NORETURN;
+static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post_len, int gzip UNUSED_PARAM)
 {
 	enum { FROM_CGI = 1, TO_CGI = 2 }; /* indexes in pfd[] */
 	struct pollfd pfd[3];
 	int out_cnt; /* we buffer a bit of initial CGI output */
 	int count;
+	int out_fd = STDOUT_FILENO; /* or pipe to gzip */
+	IF_FEATURE_HTTPD_GZIP_DYNAMIC(pid_t gzip_pid = 0;)
 
 	/* iobuf is used for CGI -> network data,
 	 * hdr_buf is for network -> CGI data (POSTDATA) */
@@ -1468,8 +1968,15 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post
 				 * CGI may output a few first bytes and then wait
 				 * for POSTDATA without closing stdout.
 				 * With full_read we may wait here forever. */
-				count = safe_read(fromCgi_rd, rbuf + out_cnt, IOBUF_SIZE - 8);
+				count = safe_read(fromCgi_rd, rbuf + out_cnt, IOBUF_SIZE - 8 - out_cnt);
 				if (count <= 0) {
+# if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+					if (out_cnt >= 4) {
+						/* eof while waiting for the end of header (see below):
+						 * send it as is, next read will see eof again */
+						goto got_header;
+					}
+# endif
 					/* eof (or error) and there was no "HTTP",
 					 * send "HTTP/1.1 200 OK\r\n", then send received data */
 					if (out_cnt) {
@@ -1479,6 +1986,17 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post
 					break; /* CGI stdout is closed, exiting */
 				}
 				out_cnt += count;
+# if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+				/* To decide whether to compress (or whether the reply
+				 * varies with Accept-Encoding), need the whole header */
+				if (gzip
+				 && out_cnt < IOBUF_SIZE - 8
+				 && !cgi_header_end(rbuf, out_cnt)
+				) {
+					continue;
+				}
+ got_header:
+# endif
 				count = 0;
 				/* "Status" header format is: "Status: 302 Redirected\r\n" */
 				if (out_cnt >= 8 && memcmp(rbuf, "Status: ", 8) == 0) {
@@ -1508,16 +2026,32 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr, int post
 					count = out_cnt;
 					out_cnt = -1; /* buffering off */
 				}
+# if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+				if (out_cnt < 0 && gzip) {
+					/* gzip must not keep CGI's pipes open */
+					close_on_exec_on(fromCgi_rd);
+					if (toCgi_wr)
+						close_on_exec_on(toCgi_wr);
+					out_fd = cgi_start_gzip(&rbuf, &count, &gzip_pid, gzip == 2);
+				}
+# endif
 			} else {
 				count = safe_read(fromCgi_rd, rbuf, IOBUF_SIZE);
 				if (count <= 0)
 					break;  /* eof (or error) */
 			}
-			if (full_write(STDOUT_FILENO, rbuf, count) != count)
+			if (full_write(out_fd, rbuf, count) != count)
 				break;
 			dbg("cgi read %d bytes: '%.*s'\n", count, count, rbuf);
 		} /* if (pfd[FROM_CGI].revents) */
 	} /* while (1) */
+# if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	if (gzip_pid) {
+		/* let gzip finish sending to the peer */
+		close(out_fd);
+		safe_waitpid(gzip_pid, NULL, 0);
+	}
+# endif
 	log_and_exit();
 }
 #endif
@@ -1723,69 +2257,21 @@ static void send_cgi_and_exit(
 	/* Pump data */
 	close(fromCgi.wr);
 	close(toCgi.rd);
-	cgi_io_loop_and_exit(fromCgi.rd, toCgi.wr, post_len);
+	cgi_io_loop_and_exit(fromCgi.rd, toCgi.wr, post_len,
+			/*gzip:*/ strcasecmp(request, "HEAD") == 0 ? 2 : 1);
 }
 
 #endif          /* FEATURE_HTTPD_CGI */
 
 /*
- * Send a file response to a HTTP request, and exit
- *
- * Parameters:
- * const char *url  The requested URL (with leading /).
- * what             What to send (headers/body/both).
+ * MIME type for the file name suffix: built-in table, then user's
+ * ".ext:mime/type" lines. NULL if not found.
  */
-static NOINLINE void send_file_and_exit(const char *url, int what)
+static const char *find_mime_type(const char *url)
 {
+	const char *found = NULL;
 	char *suffix;
-	int fd;
-	ssize_t count;
-
-	if (content_gzip) {
-		/* does <url>.gz exist? Then use it instead */
-		char *gzurl = xasprintf("%s.gz", url);
-		fd = open(gzurl, O_RDONLY);
-		free(gzurl);
-		if (fd != -1) {
-			struct stat sb;
-			fstat(fd, &sb);
-			file_size = sb.st_size;
-			last_mod = sb.st_mtime;
-		} else {
-			IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
-			fd = open(url, O_RDONLY);
-		}
-	} else {
-		fd = open(url, O_RDONLY);
-		/* file_size and last_mod are already populated */
-	}
-	if (fd < 0) {
-		dbg("can't open '%s'\n", url);
-		/* Error pages are sent by using send_file_and_exit(SEND_BODY).
-		 * IOW: it is unsafe to call send_headers_and_exit
-		 * if what is SEND_BODY! Can recurse! */
-		if (what != SEND_BODY)
-			send_headers_and_exit(HTTP_NOT_FOUND);
-		log_and_exit();
-	}
-#if ENABLE_FEATURE_HTTPD_ETAG
-	/* ETag is "hex(last_mod)-hex(file_size)" e.g. "5e132e20-417" */
-	sprintf(G.etag, "\"%llx-%llx\"", (unsigned long long)last_mod, (unsigned long long)file_size);
-
-	if (G.if_none_match) {
-		dbg("If-None-Match:'%s' file's ETag:'%s'\n", G.if_none_match, G.etag);
-		/* Weak ETag comparision.
-		 * If-None-Match may have many ETags but they are quoted so we can use simple substring search */
-		if (strstr(G.if_none_match, G.etag))
-			send_headers_and_exit(HTTP_NOT_MODIFIED);
-	}
-#endif
-	/* If you want to know about EPIPE below
-	 * (happens if you abort downloads from local httpd): */
-	signal(SIGPIPE, SIG_IGN);
 
-	/* If not found, default is to not send "Content-type:" */
-	/*found_mime_type = NULL; - already is */
 	suffix = strrchr(url, '.');
 	if (suffix) {
 		static const char suffixTable[] ALIGN1 =
@@ -1830,7 +2316,7 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 				continue;
 			try_suffix += strlen(suffix);
 			if (*try_suffix == '\0' || *try_suffix == '.') {
-				found_mime_type = mime_type;
+				found = mime_type;
 				break;
 			}
 			/* Example: strstr(table, ".av") != NULL, but it
@@ -1843,11 +2329,197 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 		/* ...then user's table */
 		for (cur = mime_a; cur; cur = cur->next) {
 			if (strcmp(cur->before_colon, suffix) == 0) {
-				found_mime_type = cur->after_colon;
+				found = cur->after_colon;
 				break;
 			}
 		}
 	}
+	return found;
+}
+
+static const char *cached_mime_type(const char *url)
+{
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (G.file_cache) {
+		file_cache *e = cache_get(url);
+		if (!e->mime_known) {
+			e->mime_type = find_mime_type(url);
+			e->mime_known = 1;
+		}
+		return e->mime_type;
+	}
+#endif
+	return find_mime_type(url);
+}
+
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+/* Compressing tiny files gains nothing */
+#define GZIP_MIN_SIZE 512
+
+/* Open gzipped copy of url in the Z: directory, (re)making it
+ * if it is missing, or its mtime (to the nanosecond) or the size
+ * recorded in its gzip trailer differ from url's: a file rewritten
+ * within the same second must not keep the old copy.
+ * Returns -1 if there is no copy and we can't make it.
+ */
+static int gzip_cache_open(const char *url, struct stat *sb)
+{
+	char *name, *tmp;
+	int fd, src, dst;
+	int status;
+	pid_t pid;
+	void (*old_sigchld)(int);
+
+	if (!G.gzip_cache_dir
+	 || file_size < GZIP_MIN_SIZE
+	 || !compressible_type(found_mime_type)
+	) {
+		return -1;
+	}
+
+	name = xasprintf("%s/%s.gz", G.gzip_cache_dir, url);
+	fd = cached_open(name, sb);
+	if (fd >= 0) {
+		uint32_t isize;
+		if (sb->st_mtime == last_mod
+		 && sb->st_mtim.tv_nsec == G.last_mod_nsec
+		 /* gzip trailer ends with input size mod 2^32, little-endian */
+		 && pread(fd, &isize, 4, sb->st_size - 4) == 4
+		 && SWAP_LE32(isize) == (uint32_t)file_size
+		) {
+			goto ret;
+		}
+		cached_close(fd);
+		fd = -1;
+	}
+
+	/* Compress into a temporary file and rename it:
+	 * other workers never see a partially written copy */
+	tmp = xasprintf("%s.%u", name, (unsigned)getpid());
+	dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dst < 0 && errno == ENOENT) {
+		char *dir = xstrdup(tmp);
+		bb_make_directory(dirname(dir), -1, FILEUTILS_RECUR);
+		free(dir);
+		dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	src = open(url, O_RDONLY);
+	status = -1;
+	if (dst >= 0 && src >= 0) {
+		/* we need gzip's exit status, don't let it be reaped */
+		old_sigchld = signal(SIGCHLD, SIG_DFL);
+		pid = spawn_gzip(src, dst);
+		if (pid)
+			safe_waitpid(pid, &status, 0);
+		signal(SIGCHLD, old_sigchld);
+		if (old_sigchld == SIG_IGN) {
+			/* reap what exited meanwhile */
+			while (wait_any_nohang(NULL) > 0)
+				continue;
+		}
+	}
+	if (status == 0) {
+		struct timespec ts[2];
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1].tv_sec = last_mod;
+		ts[1].tv_nsec = G.last_mod_nsec;
+		if (futimens(dst, ts) != 0 || rename(tmp, name) != 0)
+			status = -1;
+	}
+	if (src >= 0)
+		close(src);
+	if (dst >= 0)
+		close(dst);
+	if (status != 0) {
+		if (verbose)
+			bb_error_msg("can't compress '%s'", url);
+		unlink(tmp);
+	}
+	free(tmp);
+
+	if (status == 0) {
+		/* cache has the old copy (or its absence), recheck it */
+		IF_FEATURE_HTTPD_CACHE(if (G.file_cache) cache_check();)
+		fd = cached_open(name, sb);
+	}
+ ret:
+	free(name);
+	return fd;
+}
+#endif
+
+/*
+ * Send a file response to a HTTP request, and exit
+ *
+ * Parameters:
+ * const char *url  The requested URL (with leading /).
+ * what             What to send (headers/body/both).
+ */
+static NOINLINE void send_file_and_exit(const char *url, int what)
+{
+	int fd;
+	ssize_t count;
+	off_t left;
+
+	/* If not found, default is to not send "Content-type:".
+	 * Look it up before opening: in -P worker, opening <url>.gz
+	 * may take over <url>'s cache slot */
+	found_mime_type = cached_mime_type(url);
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	/* Z: may send it compressed or not, depending on Accept-Encoding */
+	G.vary_encoding = (G.gzip_cache_dir
+		&& file_size >= GZIP_MIN_SIZE
+		&& compressible_type(found_mime_type)
+	);
+#endif
+
+	if (content_gzip) {
+		/* does <url>.gz exist? Then use it instead */
+		struct stat sb;
+		char *gzurl = xasprintf("%s.gz", url);
+		fd = cached_open(gzurl, &sb);
+		free(gzurl);
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+		if (fd == -1) /* no, but maybe we can make one */
+			fd = gzip_cache_open(url, &sb);
+#endif
+		if (fd != -1) {
+			file_size = sb.st_size;
+			last_mod = sb.st_mtime;
+		} else {
+			IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
+			fd = cached_open(url, NULL);
+		}
+	} else {
+		fd = cached_open(url, NULL);
+		/* file_size and last_mod are already populated */
+	}
+	if (fd < 0) {
+		dbg("can't open '%s'\n", url);
+		/* Error pages are sent by using send_file_and_exit(SEND_BODY).
+		 * IOW: it is unsafe to call send_headers_and_exit
+		 * if what is SEND_BODY! Can recurse! */
+		if (what != SEND_BODY)
+			send_headers_and_exit(HTTP_NOT_FOUND);
+		log_and_exit();
+	}
+#if ENABLE_FEATURE_HTTPD_ETAG
+	/* ETag is "hex(last_mod)-hex(file_size)" e.g. "5e132e20-417" */
+	sprintf(G.etag, "\"%llx-%llx\"", (unsigned long long)last_mod, (unsigned long long)file_size);
+
+	if (G.if_none_match) {
+		dbg("If-None-Match:'%s' file's ETag:'%s'\n", G.if_none_match, G.etag);
+		/* Weak ETag comparision.
+		 * If-None-Match may have many ETags but they are quoted so we can use simple substring search */
+		if (strstr(G.if_none_match, G.etag)) {
+			cached_close(fd);
+			send_headers_and_exit(HTTP_NOT_MODIFIED);
+		}
+	}
+#endif
+	/* If you want to know about EPIPE below
+	 * (happens if you abort downloads from local httpd): */
+	signal(SIGPIPE, SIG_IGN);
 
 	dbg("sending file '%s' content-type:%s\n", url, found_mime_type);
 
@@ -1857,7 +2529,6 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 	) {
 		range_start = -1;
 	}
-	range_len = MAXINT(off_t);
 	if (range_start >= 0) {
 		if (!range_end || range_end > file_size - 1) {
 			range_end = file_size - 1;
@@ -1868,14 +2539,20 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 			lseek(fd, 0, SEEK_SET);
 			range_start = -1;
 		} else {
-			range_len = range_end - range_start + 1;
 			send_headers(HTTP_PARTIAL_CONTENT);
-			what = SEND_BODY;
+			what &= ~SEND_HEADERS;
 		}
 	}
 #endif
 	if (what & SEND_HEADERS)
 		send_headers(HTTP_OK);
+	if (!(what & SEND_BODY)) { /* HEAD */
+		cached_close(fd);
+		log_and_exit();
+	}
+	/* send_headers() has set file_size to the Content-Length it promised
+	 * (range length for 206). Error pages are sent without it. */
+	left = (file_size >= 0) ? file_size : MAXINT(off_t);
 #if ENABLE_FEATURE_USE_SENDFILE
 	{
 		off_t offset;
@@ -1889,27 +2566,33 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 		while (1) {
 			/* sz is rounded down to 64k */
 			ssize_t sz = MAXINT(ssize_t) - 0xffff;
-			IF_FEATURE_HTTPD_RANGES(if (sz > range_len) sz = range_len;)
+			if (sz > left)
+				sz = left;
 			count = sendfile(STDOUT_FILENO, fd, &offset, sz);
 			if (count < 0) {
-				if (offset == range_start) /* was it the very 1st sendfile? */
-					break; /* fall back to read/write loop */
+				if (offset == range_start) { /* was it the very 1st sendfile? */
+					/* fall back to read/write loop
+					 * (cached fd may be positioned anywhere) */
+					lseek(fd, offset, SEEK_SET);
+					break;
+				}
 				goto fin;
 			}
-			IF_FEATURE_HTTPD_RANGES(range_len -= count;)
-			if (count == 0 || range_len == 0)
-				log_and_exit();
+			left -= count;
+			if (count == 0 || left == 0)
+				goto done;
 		}
 	}
 #endif
 	while ((count = safe_read(fd, iobuf, IOBUF_SIZE)) > 0) {
 		ssize_t n;
-		IF_FEATURE_HTTPD_RANGES(if (count > range_len) count = range_len;)
+		if (count > left)
+			count = left;
 		n = full_write(STDOUT_FILENO, iobuf, count);
 		if (count != n)
 			break;
-		IF_FEATURE_HTTPD_RANGES(range_len -= count;)
-		if (range_len == 0)
+		left -= count;
+		if (left == 0)
 			break;
 	}
 	if (count < 0) {
@@ -1917,6 +2600,14 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 		if (verbose > 1)
 			bb_simple_perror_msg("error");
 	}
+ IF_FEATURE_USE_SENDFILE(done:)
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* File shrank under us, or write error: the peer can't
+	 * find where the next reply starts */
+	if (left != 0)
+		keepalive = 0;
+#endif
+	cached_close(fd);
 	log_and_exit();
 }
 
@@ -2164,12 +2855,73 @@ static Htaccess_Proxy *find_proxy_entry(const char *url)
 }
 #endif
 
+#if ENABLE_FEATURE_HTTPD_PREFORK \
+ && (ENABLE_FEATURE_HTTPD_CGI || ENABLE_FEATURE_HTTPD_PROXY)
+/*
+ * -P worker passes slow requests (CGI, proxy) to a child
+ * and goes back to accept() more connections.
+ */
+static void hand_over_to_child(void)
+{
+	pid_t pid;
+
+	if (!G.worker)
+		return;
+	pid = fork();
+	if (pid < 0)
+		send_headers_and_exit(HTTP_INTERNAL_SERVER_ERROR);
+	if (pid > 0) {
+		/* child owns the connection now */
+		siglongjmp(G.next_connection, 1);
+	}
+	G.worker = 0;
+	signal(SIGHUP, SIG_IGN);
+}
+#else
+# define hand_over_to_child() ((void)0)
+#endif
+
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+/*
+ * Forget what the previous request on this connection has set up.
+ */
+static void reset_request_state(void)
+{
+	keepalive = 0;
+	G.keepalive_ok = 0;
+	G.has_body = 0;
+	IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
+	IF_FEATURE_HTTPD_GZIP_DYNAMIC(G.vary_encoding = 0;)
+	g_query = NULL;
+	found_mime_type = NULL;
+	found_moved_temporarily = NULL;
+	file_size = -1;
+# if ENABLE_FEATURE_HTTPD_RANGES
+	range_start = -1;
+	range_end = 0;
+# endif
+# if ENABLE_FEATURE_HTTPD_ETAG
+	free(G.if_none_match);
+	G.if_none_match = NULL;
+# endif
+# if ENABLE_FEATURE_HTTPD_BASIC_AUTH
+	free(remoteuser);
+	remoteuser = NULL;
+# endif
+}
+#endif
+
 /*
  * Handle timeouts
  */
 static void send_REQUEST_TIMEOUT_and_exit(int sig) NORETURN;
 static void send_REQUEST_TIMEOUT_and_exit(int sig UNUSED_PARAM)
 {
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* No next request on a persistent connection: just close it */
+	if (G.keepalive_idle)
+		close_and_exit();
+#endif
 	send_headers_and_exit(HTTP_REQUEST_TIMEOUT);
 }
 
@@ -2200,19 +2952,20 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		CGI_NORMAL,
 		CGI_INDEX,
 		CGI_INTERPRETER,
-	} cgi_type = CGI_NONE;
+	} cgi_type;
 #endif
 #if ENABLE_FEATURE_HTTPD_PROXY
 	Htaccess_Proxy *proxy_entry;
 #endif
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
-	smallint authorized = -1;
+	smallint authorized;
 #endif
 	char *HTTP_slash;
 
 	/* Allocation of iobuf is postponed until now
 	 * (IOW, server process doesn't need to waste 8k) */
-	iobuf = xmalloc(IOBUF_SIZE);
+	if (!iobuf) /* -P worker allocates it only once */
+		iobuf = xmalloc(IOBUF_SIZE);
 
 	if (ENABLE_FEATURE_HTTPD_CGI || DEBUG || verbose) {
 		/* NB: can be NULL (user runs httpd -i by hand?) */
@@ -2240,6 +2993,18 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 	if_ip_denied_send_HTTP_FORBIDDEN_and_exit(remote_ip);
 #endif
 
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* Header and body are separate writes, don't let Nagle
+	 * hold back the end of a reply when we keep connection open */
+	setsockopt_1(STDOUT_FILENO, IPPROTO_TCP, TCP_NODELAY);
+	/* log_and_exit() returns here after a complete reply */
+	if (sigsetjmp(G.next_request, 1) != 0)
+		G.keepalive_idle = 1;
+	reset_request_state();
+#endif
+	IF_FEATURE_HTTPD_CGI(cgi_type = CGI_NONE;)
+	IF_FEATURE_HTTPD_BASIC_AUTH(authorized = -1;)
+
 	/* Install timeout handler. get_line() needs it. */
 	signal(SIGALRM, send_REQUEST_TIMEOUT_and_exit);
 
@@ -2256,8 +3021,13 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		 * just close the socket.
 		 */
 		//send_headers_and_exit(HTTP_BAD_REQUEST);
-		_exit(xfunc_error_retval);
+		close_and_exit();
 	}
+	IF_FEATURE_HTTPD_KEEPALIVE(G.keepalive_idle = 0;)
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (G.file_cache)
+		cache_check();
+#endif
 	dbg("Request:'%s'\n", iobuf);
 
 	/* Find URL */
@@ -2276,6 +3046,10 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 	if (!HTTP_slash || strncmp(HTTP_slash + 1, HTTP_200, 5) != 0)
 		send_headers_and_exit(HTTP_BAD_REQUEST);
 	*HTTP_slash++ = '\0';
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* HTTP/1.1 connections are persistent by default */
+	G.keepalive_ok = (strcmp(HTTP_slash, "HTTP/1.0") != 0);
+#endif
 
 #if ENABLE_FEATURE_HTTPD_PROXY
 	proxy_entry = find_proxy_entry(urlp);
@@ -2283,6 +3057,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		int proxy_fd;
 		len_and_sockaddr *lsa;
 
+		hand_over_to_child();
 		if (verbose > 1)
 			bb_error_msg("proxy:%s", urlp);
 		lsa = host2sockaddr(proxy_entry->host_port, 80);
@@ -2306,7 +3081,9 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 				urlp + strlen(proxy_entry->url_from), /* "SFX" */
 				HTTP_slash /* "HTTP/xyz" */
 		);
-		cgi_io_loop_and_exit(proxy_fd, proxy_fd, /*max POST length:*/ INT_MAX);
+		/* Upstream reply goes to the client as is: it can be chunked,
+		 * and Vary etc is upstream's business */
+		cgi_io_loop_and_exit(proxy_fd, proxy_fd, /*max POST length:*/ INT_MAX, /*gzip:*/ 0);
 	}
 #endif
 
@@ -2391,8 +3168,11 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		/* have path1/path2 */
 		*tptr = '\0';
 		/* may have subdir config */
-		if (parse_conf(urlcopy + 1, SUBDIR_PARSE) == 0)
+		if (parse_conf(urlcopy + 1, SUBDIR_PARSE) == 0) {
+			/* merged config must not be seen by later requests */
+			IF_FEATURE_HTTPD_KEEPALIVE(G.conf_merged = 1;)
 			if_ip_denied_send_HTTP_FORBIDDEN_and_exit(remote_ip);
+		}
 		*tptr = '/';
 	}
 
@@ -2415,11 +3195,11 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			 * query string would be lost and not available to the CGI.
 			 * Work around it by making a deep copy.
 			 */
-			if (ENABLE_FEATURE_HTTPD_CGI)
-				g_query = xstrdup(g_query); /* ok for NULL too */
+			if (ENABLE_FEATURE_HTTPD_CGI && g_query)
+				g_query = strcpy(alloca(strlen(g_query) + 1), g_query);
 			strcpy(urlp, index_page);
 		}
-		if (stat(tptr, &sb) == 0) {
+		if (cached_stat(tptr, &sb) == 0) {
 			/* If URL is a directory with no slash, set up
 			 * "HTTP/1.1 302 Found" "Location: /dir/" reply */
 			if (urlp[-1] != '/' && S_ISDIR(sb.st_mode)) {
@@ -2439,6 +3219,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 #endif
 				file_size = sb.st_size;
 				last_mod = sb.st_mtime;
+				IF_FEATURE_HTTPD_GZIP_DYNAMIC(G.last_mod_nsec = sb.st_mtim.tv_nsec;)
 			}
 		}
 #if ENABLE_FEATURE_HTTPD_CGI
@@ -2460,10 +3241,26 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 #if ENABLE_FEATURE_HTTPD_CGI
 	total_headers_len = 0;
 	POST_length = 0;
+	if (cgi_type != CGI_NONE)
+		hand_over_to_child();
 #endif
 
 	/* Read until blank line */
 	while (1) {
+#if HTTPD_READS_HEADERS
+		static const char header_names[] ALIGN1 =
+			"content-length\0""authorization\0""range\0"
+			"accept-encoding\0""if-none-match\0""connection\0"
+			"transfer-encoding\0""content-type\0";
+		enum {
+			HDR_content_length = 1, HDR_authorization, HDR_range,
+			HDR_accept_encoding, HDR_if_none_match, HDR_connection,
+			HDR_transfer_encoding, HDR_content_type,
+		};
+		smalluint hdr;
+		char *val;
+		char *colon;
+#endif
 		unsigned iobuf_len = get_line();
 		if (!iobuf_len)
 			break; /* EOF or error or empty line */
@@ -2474,14 +3271,39 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			send_headers_and_exit(HTTP_ENTITY_TOO_LARGE);
 #endif
 		dbg("header:'%s'\n", iobuf);
+#if HTTPD_READS_HEADERS
+		colon = strchr(iobuf, ':');
+		if (!colon)
+			continue;
+		/* Lowercase the name and look it up once,
+		 * instead of strncasecmp'ing it against every name we know */
+		for (tptr = iobuf; tptr < colon; tptr++) {
+			if ((unsigned char)(*tptr - 'A') <= ('Z' - 'A'))
+				*tptr |= 0x20;
+		}
+		*colon = '\0';
+		hdr = index_in_strings(header_names, iobuf) + 1;
+		*colon = ':';
+		val = skip_whitespace(colon + 1);
+#endif
+
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		/* Request body which we won't read? Can't find next request then.
+		 * No later header (e.g. "Connection: keep-alive") can undo this.
+		 */
+		if (hdr == HDR_transfer_encoding
+		 || (hdr == HDR_content_length && (bb_strtou(val, NULL, 10) != 0 || errno))
+		) {
+			G.has_body = 1;
+		}
+#endif
 #if ENABLE_FEATURE_HTTPD_CGI
 		/* Only POST needs to know POST_length */
-		if (prequest == request_POST && STRNCASECMP(iobuf, "Content-Length:") == 0) {
-			tptr = skip_whitespace(iobuf + sizeof("Content-Length:") - 1);
-			if (!tptr[0])
+		if (prequest == request_POST && hdr == HDR_content_length) {
+			if (!val[0])
 				send_headers_and_exit(HTTP_BAD_REQUEST);
 			/* not using strtoul: it ignores leading minus! */
-			POST_length = bb_strtou(tptr, NULL, 10);
+			POST_length = bb_strtou(val, NULL, 10);
 			/* length is "ulong", but we need to pass it to int later */
 			if (errno || POST_length > INT_MAX)
 				send_headers_and_exit(HTTP_BAD_REQUEST);
@@ -2489,14 +3311,13 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		}
 #endif
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
-		if (STRNCASECMP(iobuf, "Authorization:") == 0) {
+		if (hdr == HDR_authorization) {
 			/* We only allow Basic credentials.
 			 * It shows up as "Authorization: Basic <user>:<passwd>" where
 			 * "<user>:<passwd>" is base64 encoded.
 			 */
-			tptr = skip_whitespace(iobuf + sizeof("Authorization:")-1);
-			if (STRNCASECMP(tptr, "Basic") == 0) {
-				tptr += sizeof("Basic")-1;
+			if (STRNCASECMP(val, "Basic") == 0) {
+				tptr = val + sizeof("Basic")-1;
 				/* decodeBase64() skips whitespace itself */
 				decodeBase64(tptr);
 				authorized = check_user_passwd(urlcopy, tptr);
@@ -2505,10 +3326,9 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		}
 #endif
 #if ENABLE_FEATURE_HTTPD_RANGES
-		if (STRNCASECMP(iobuf, "Range:") == 0) {
+		if (hdr == HDR_range) {
 			/* We know only bytes=NNN-[MMM] */
-			char *s = skip_whitespace(iobuf + sizeof("Range:")-1);
-			s = is_prefixed_with(s, "bytes=");
+			char *s = is_prefixed_with(val, "bytes=");
 			if (s) {
 				range_start = BB_STRTOOFF(s, &s, 10);
 				if (s[0] != '-' || range_start < 0) {
@@ -2523,11 +3343,11 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		}
 #endif
 #if ENABLE_FEATURE_HTTPD_GZIP
-		if (STRNCASECMP(iobuf, "Accept-Encoding:") == 0) {
+		if (hdr == HDR_accept_encoding) {
 			/* Note: we do not support "gzip;q=0"
 			 * method of _disabling_ gzip
 			 * delivery. No one uses that, though */
-			const char *s = strstr(iobuf, "gzip");
+			const char *s = strstr(val, "gzip");
 			if (s) {
 				// want more thorough checks?
 				//if (s[-1] == ' '
@@ -2541,20 +3361,25 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		}
 #endif
 #if ENABLE_FEATURE_HTTPD_ETAG
-		if (STRNCASECMP(iobuf, "If-None-Match:") == 0) {
+		if (hdr == HDR_if_none_match) {
 			free(G.if_none_match);
-			G.if_none_match = xstrdup(skip_whitespace(iobuf + sizeof("If-None-Match:") - 1));
+			G.if_none_match = xstrdup(val);
 			continue;
 		}
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		if (hdr == HDR_connection) {
+			/* "close", "keep-alive", maybe with other tokens */
+			if (strcasestr(val, "close"))
+				G.keepalive_ok = 0;
+			else if (strcasestr(val, "keep-alive"))
+				G.keepalive_ok = 1;
+		}
+#endif
 #if ENABLE_FEATURE_HTTPD_CGI
 		if (cgi_type != CGI_NONE) {
-			bool ct = (STRNCASECMP(iobuf, "Content-Type:") == 0);
 			char *cp;
-			char *colon = strchr(iobuf, ':');
 
-			if (!colon)
-				continue;
 			cp = iobuf;
 			while (cp < colon) {
 				/* a-z => A-Z, not-alnum => _ */
@@ -2568,9 +3393,9 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 				cp++;
 			}
 			/* "Content-Type:" gets no HTTP_ prefix, all others do */
-			cp = xasprintf(ct ? "HTTP_%.*s=%s" + 5 : "HTTP_%.*s=%s",
+			cp = xasprintf(hdr == HDR_content_type ? "HTTP_%.*s=%s" + 5 : "HTTP_%.*s=%s",
 				(int)(colon - iobuf), iobuf,
-				skip_whitespace(colon + 1)
+				val
 			);
 			putenv(cp);
 		}
@@ -2633,6 +3458,27 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
  * Never returns.
  */
 #if BB_MMU
+static void fork_and_handle_incoming(int server_socket, int n, const len_and_sockaddr *fromAddr)
+{
+	if (fork() == 0) {
+		/* child */
+		/* Do not reload config on HUP */
+		signal(SIGHUP, SIG_IGN);
+# if ENABLE_FEATURE_HTTPD_PREFORK
+		/* -P parent has its own handlers for these */
+		bb_signals((1 << SIGTERM) | (1 << SIGINT), SIG_DFL);
+		signal(SIGCHLD, SIG_IGN);
+# endif
+		close(server_socket);
+		xmove_fd(n, 0);
+		xdup2(0, 1);
+
+		handle_incoming_and_exit(fromAddr);
+	}
+	/* parent, or fork failed */
+	close(n);
+}
+
 static void mini_httpd(int server_socket) NORETURN;
 static void mini_httpd(int server_socket)
 {
@@ -2661,21 +3507,169 @@ static void mini_httpd(int server_socket)
 		/* set the KEEPALIVE option to cull dead connections */
 		setsockopt_keepalive(n);
 
-		if (fork() == 0) {
-			/* child */
-			/* Do not reload config on HUP */
-			signal(SIGHUP, SIG_IGN);
-			close(server_socket);
-			xmove_fd(n, 0);
-			xdup2(0, 1);
-
-			handle_incoming_and_exit(&fromAddr);
-		}
-		/* parent, or fork failed */
-		close(n);
+		fork_and_handle_incoming(server_socket, n, &fromAddr);
 	} /* while (1) */
 	/* never reached */
 }
+
+# if ENABLE_FEATURE_HTTPD_PREFORK
+static void signal_workers(int sig)
+{
+	unsigned i;
+
+	for (i = 0; i < G.worker_cnt; i++)
+		if (G.worker_pid[i] > 0)
+			kill(G.worker_pid[i], sig);
+}
+
+static void kill_workers_and_exit(int sig)
+{
+	signal_workers(sig);
+	_exit(EXIT_SUCCESS);
+}
+
+static void worker_sighup_handler(int sig UNUSED_PARAM)
+{
+	G.reload_conf = 1;
+}
+
+/*
+ * -P worker: accept connections and serve them ourself.
+ * Never returns.
+ */
+static void httpd_worker(int server_socket, unsigned idx) NORETURN;
+static void httpd_worker(int server_socket, unsigned idx)
+{
+	const char *name = applet_name;
+
+	G.worker = 1;
+	G.listen_fd = server_socket;
+	/* reload config between connections, not in the middle of one */
+	signal(SIGHUP, worker_sighup_handler);
+	bb_signals((1 << SIGTERM) | (1 << SIGINT), SIG_DFL);
+	/* CGI children */
+	signal(SIGCHLD, SIG_IGN);
+	IF_FEATURE_HTTPD_CACHE(cache_init();)
+
+	/* close_and_exit() returns here when a connection is done */
+	sigsetjmp(G.next_connection, 1);
+	alarm(0);
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	free(rmt_ip_str);
+	rmt_ip_str = NULL;
+	applet_name = name;
+	hdr_cnt = 0;
+	G.keepalive_idle = 0;
+	G.worker_busy[idx] = 0;
+
+	while (1) {
+		int n;
+		len_and_sockaddr fromAddr;
+		struct pollfd pfd;
+
+		/* server_socket is O_NONBLOCK, see prefork_workers() */
+		pfd.fd = server_socket;
+		pfd.events = POLLIN;
+		safe_poll(&pfd, 1, -1);
+		fromAddr.len = LSA_SIZEOF_SA;
+		n = accept(server_socket, &fromAddr.u.sa, &fromAddr.len);
+		if (n < 0)
+			continue;
+		G.worker_busy[idx] = 1;
+		ndelay_off(n); /* Linux does not inherit it, others may */
+		if (G.reload_conf || G.conf_merged) {
+			G.reload_conf = G.conf_merged = 0;
+			/* subdir config may have changed index page */
+			if (index_page != index_html)
+				free((char*)index_page);
+			index_page = index_html;
+			parse_conf(DEFAULT_PATH_HTTPD_CONF, SIGNALED_PARSE);
+			/* cached MIME types may point to freed config */
+			IF_FEATURE_HTTPD_CACHE(if (G.file_cache) cache_flush();)
+		}
+		setsockopt_keepalive(n);
+		xmove_fd(n, 0);
+		xdup2(0, 1);
+		handle_incoming_and_exit(&fromAddr);
+	}
+}
+
+/*
+ * Start G.worker_cnt workers, restart them when they die.
+ * Workers serve one connection at a time: when all of them are busy
+ * (with slow or silent clients...), serve new connections
+ * by forking a process for each, as without -P.
+ * Never returns.
+ */
+static void prefork_workers(int server_socket) NORETURN;
+static void prefork_workers(int server_socket)
+{
+	G.worker_pid = xzalloc(G.worker_cnt * sizeof(G.worker_pid[0]));
+	G.worker_busy = mmap(NULL, G.worker_cnt,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			/* ignored: */ -1, 0);
+	if (G.worker_busy == MAP_FAILED)
+		bb_die_memory_exhausted();
+	/* Both we and workers poll() it, and only then accept():
+	 * whoever is late must not block in accept() */
+	ndelay_on(server_socket);
+	/* we wait() for workers, make poll() below return when one dies */
+	signal_no_SA_RESTART_empty_mask(SIGCHLD, record_signo);
+	bb_signals((1 << SIGTERM) | (1 << SIGINT), kill_workers_and_exit);
+
+	while (1) {
+		unsigned i;
+		pid_t pid;
+		struct pollfd pfd;
+
+		for (i = 0; i < G.worker_cnt; i++) {
+			if (G.worker_pid[i] != 0)
+				continue;
+			G.worker_busy[i] = 0;
+			pid = fork();
+			if (pid == 0)
+				httpd_worker(server_socket, i);
+			if (pid < 0) {
+				bb_simple_perror_msg("fork");
+				sleep(1);
+				break;
+			}
+			G.worker_pid[i] = pid;
+		}
+
+		pfd.fd = server_socket;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) > 0) {
+			/* Let a free worker, or one idling on a persistent
+			 * connection (see keepalive_wait()), take it */
+			poll(NULL, 0, 100);
+			for (i = 0; i < G.worker_cnt; i++)
+				if (!G.worker_busy[i])
+					break;
+			if (i == G.worker_cnt && poll(&pfd, 1, 0) > 0) {
+				len_and_sockaddr fromAddr;
+				int n;
+
+				fromAddr.len = LSA_SIZEOF_SA;
+				n = accept(server_socket, &fromAddr.u.sa, &fromAddr.len);
+				if (n >= 0) {
+					ndelay_off(n);
+					setsockopt_keepalive(n);
+					fork_and_handle_incoming(server_socket, n, &fromAddr);
+				}
+			}
+		}
+
+		/* Reap workers and per-connection children */
+		while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+			for (i = 0; i < G.worker_cnt; i++)
+				if (G.worker_pid[i] == pid)
+					G.worker_pid[i] = 0;
+		}
+	}
+}
+# endif
 #else
 static void mini_httpd_nommu(int server_socket, int argc, char **argv) NORETURN;
 static void mini_httpd_nommu(int server_socket, int argc, char **argv)
@@ -2741,6 +3735,9 @@ static void sighup_handler(int sig UNUSED_PARAM)
 {
 	int sv = errno;
 	parse_conf(DEFAULT_PATH_HTTPD_CONF, SIGNALED_PARSE);
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	signal_workers(SIGHUP);
+#endif
 	errno = sv;
 }
 
@@ -2752,6 +3749,7 @@ enum {
 	IF_FEATURE_HTTPD_BASIC_AUTH(    r_opt_realm     ,)
 	IF_FEATURE_HTTPD_AUTH_MD5(      m_opt_md5       ,)
 	IF_FEATURE_HTTPD_SETUID(        u_opt_setuid    ,)
+	IF_FEATURE_HTTPD_PREFORK(       P_opt_prefork   ,)
 	p_opt_port      ,
 	p_opt_inetd     ,
 	p_opt_foreground,
@@ -2763,6 +3761,7 @@ enum {
 	OPT_REALM       = IF_FEATURE_HTTPD_BASIC_AUTH(    (1 << r_opt_realm     )) + 0,
 	OPT_MD5         = IF_FEATURE_HTTPD_AUTH_MD5(      (1 << m_opt_md5       )) + 0,
 	OPT_SETUID      = IF_FEATURE_HTTPD_SETUID(        (1 << u_opt_setuid    )) + 0,
+	OPT_PREFORK     = IF_FEATURE_HTTPD_PREFORK(       (1 << P_opt_prefork   )) + 0,
 	OPT_PORT        = 1 << p_opt_port,
 	OPT_INETD       = 1 << p_opt_inetd,
 	OPT_FOREGROUND  = 1 << p_opt_foreground,
@@ -2780,6 +3779,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 	IF_FEATURE_HTTPD_SETUID(const char *s_ugid = NULL;)
 	IF_FEATURE_HTTPD_SETUID(struct bb_uidgid_t ugid;)
 	IF_FEATURE_HTTPD_AUTH_MD5(const char *pass;)
+	IF_FEATURE_HTTPD_PREFORK(const char *opt_P;)
 
 	INIT_G();
 
@@ -2798,6 +3798,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 			IF_FEATURE_HTTPD_BASIC_AUTH("r:")
 			IF_FEATURE_HTTPD_AUTH_MD5("m:")
 			IF_FEATURE_HTTPD_SETUID("u:")
+			IF_FEATURE_HTTPD_PREFORK("P:")
 			"p:ifv"
 			"\0"
 			/* -v counts, -i implies -f */
@@ -2807,6 +3808,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 			IF_FEATURE_HTTPD_BASIC_AUTH(, &g_realm)
 			IF_FEATURE_HTTPD_AUTH_MD5(, &pass)
 			IF_FEATURE_HTTPD_SETUID(, &s_ugid)
+			IF_FEATURE_HTTPD_PREFORK(, &opt_P)
 			, &bind_addr_or_port
 			, &verbose
 		);
@@ -2836,6 +3838,10 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 		xget_uidgid(&ugid, s_ugid);
 	}
 #endif
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	if (opt & OPT_PREFORK)
+		G.worker_cnt = xatou_range(opt_P, 0, 1024);
+#endif
 
 #if !BB_MMU
 	if (!(opt & OPT_FOREGROUND)) {
@@ -2893,6 +3899,10 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 #if BB_MMU
 	if (!(opt & OPT_FOREGROUND))
 		bb_daemonize(0); /* don't change current directory */
+# if ENABLE_FEATURE_HTTPD_PREFORK
+	if (G.worker_cnt)
+		prefork_workers(server_socket); /* never returns */
+# endif
 	mini_httpd(server_socket); /* never returns */
 #else
 	mini_httpd_nommu(server_socket, argc, argv); /* never returns */
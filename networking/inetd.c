@@ -219,6 +219,15 @@
 //config:	depends on INETD
 //config:	help
 //config:	Support Sun-RPC based services
+//config:
+//config:config FEATURE_INETD_EPOLL
+//config:	bool "Use epoll instead of select"
+//config:	default y
+//config:	depends on INETD
+//config:	help
+//config:	Wait for connections with epoll(). Listening sockets are not
+//config:	limited to FD_SETSIZE (1024) fds, and the kernel does not have
+//config:	to rescan all of them on every wait.
 
 //applet:IF_INETD(APPLET(inetd, BB_DIR_USR_SBIN, BB_SUID_DROP))
 
@@ -239,6 +248,9 @@
 #include <sys/resource.h> /* setrlimit */
 #include <sys/socket.h> /* un.h may need this */
 #include <sys/un.h>
+#if ENABLE_FEATURE_INETD_EPOLL
+# include <sys/epoll.h>
+#endif
 
 #include "libbb.h"
 #include "common_bufsiz.h"
@@ -385,10 +397,16 @@ struct globals {
 	struct rlimit rlim_ofile;
 	servtab_t *serv_list;
 	int global_queuelen;
+#if ENABLE_FEATURE_INETD_EPOLL
+	int epoll_fd;
+	unsigned fd2sep_size;
+	servtab_t **fd2sep;  /* [fd] -> service listening on it, or NULL */
+#else
 	int maxsock;         /* max fd# in allsock, -1: unknown */
 	/* whenever maxsock grows, prev_maxsock is set to new maxsock,
 	 * but if maxsock is set to -1, prev_maxsock is not changed */
 	int prev_maxsock;
+#endif
 	unsigned max_concurrency;
 	smallint alarm_armed;
 	uid_t real_uid; /* user ID who ran us */
@@ -400,7 +418,9 @@ struct globals {
 	char *ring_pos;
 	char ring[128];
 #endif
+#if !ENABLE_FEATURE_INETD_EPOLL
 	fd_set allsock;
+#endif
 	/* Used in next_line(), and as scratch read buffer */
 	char line[256];          /* _at least_ 256, see LINE_SIZE */
 } FIX_ALIASING;
@@ -410,6 +430,9 @@ enum { LINE_SIZE = COMMON_BUFSIZE - offsetof(struct globals, line) };
 #define rlim_ofile      (G.rlim_ofile     )
 #define serv_list       (G.serv_list      )
 #define global_queuelen (G.global_queuelen)
+#define epoll_fd        (G.epoll_fd       )
+#define fd2sep_size     (G.fd2sep_size    )
+#define fd2sep          (G.fd2sep         )
 #define maxsock         (G.maxsock        )
 #define prev_maxsock    (G.prev_maxsock   )
 #define max_concurrency (G.max_concurrency)
@@ -536,7 +559,9 @@ static void bump_nofile(void)
 	/* Never fails under Linux (except if you pass it bad arguments) */
 	getrlimit(RLIMIT_NOFILE, &rl);
 	rl.rlim_cur = MIN(rl.rlim_max, rl.rlim_cur + FD_CHUNK);
+#if !ENABLE_FEATURE_INETD_EPOLL
 	rl.rlim_cur = MIN(FD_SETSIZE, rl.rlim_cur + FD_CHUNK);
+#endif
 	if (rl.rlim_cur <= rlim_ofile_cur) {
 		bb_error_msg("can't extend file limit, max = %d",
 						(int) rl.rlim_cur);
@@ -551,8 +576,46 @@ static void bump_nofile(void)
 	rlim_ofile_cur = rl.rlim_cur;
 }
 
-static void remove_fd_from_set(int fd)
+#if ENABLE_FEATURE_INETD_EPOLL
+static void remove_fd_from_set(servtab_t *sep)
 {
+	if (sep->se_fd >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sep->se_fd, NULL);
+		fd2sep[sep->se_fd] = NULL;
+		dbg("stopped listening on fd:%d\n", sep->se_fd);
+	}
+}
+
+static void add_fd_to_set(servtab_t *sep)
+{
+	int fd = sep->se_fd;
+
+	if (fd >= 0) {
+		struct epoll_event ev;
+
+		if ((unsigned)fd >= fd2sep_size) {
+			unsigned old = fd2sep_size;
+			fd2sep_size = fd + 32;
+			fd2sep = xrealloc(fd2sep, fd2sep_size * sizeof(fd2sep[0]));
+			memset(&fd2sep[old], 0, (fd2sep_size - old) * sizeof(fd2sep[0]));
+		}
+		fd2sep[fd] = sep;
+		ev.events = EPOLLIN;
+		/* not sep: SIGHUP may free it while it is in ready[],
+		 * remove_fd_from_set() clears fd2sep[] before that */
+		ev.data.fd = fd;
+		/* EEXIST is possible (see reread_config_file) and harmless */
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		dbg("started listening on fd:%d\n", fd);
+		if ((rlim_t)fd > rlim_ofile_cur - FD_MARGIN)
+			bump_nofile();
+	}
+}
+#else
+static void remove_fd_from_set(servtab_t *sep)
+{
+	int fd = sep->se_fd;
+
 	if (fd >= 0) {
 		FD_CLR(fd, &allsock);
 		dbg("stopped listening on fd:%d\n", fd);
@@ -561,8 +624,10 @@ static void remove_fd_from_set(int fd)
 	}
 }
 
-static void add_fd_to_set(int fd)
+static void add_fd_to_set(servtab_t *sep)
 {
+	int fd = sep->se_fd;
+
 	if (fd >= 0) {
 		FD_SET(fd, &allsock);
 		dbg("started listening on fd:%d\n", fd);
@@ -592,6 +657,7 @@ static void recalculate_maxsock(void)
 	if ((rlim_t)maxsock > rlim_ofile_cur - FD_MARGIN)
 		bump_nofile();
 }
+#endif
 
 static void prepare_socket_fd(servtab_t *sep)
 {
@@ -653,8 +719,8 @@ static void prepare_socket_fd(servtab_t *sep)
 		dbg("new sep->se_fd:%d (!stream)\n", fd);
 	}
 
-	add_fd_to_set(fd);
 	sep->se_fd = fd;
+	add_fd_to_set(sep);
 }
 
 static int reopen_config_file(void)
@@ -1009,7 +1075,7 @@ static void reread_config_file(int sig UNUSED_PARAM)
 				 * for a child (and not accepting connects).
 				 * Stop waiting, start listening again.
 				 * (if it's not true, this op is harmless) */
-				add_fd_to_set(sep->se_fd);
+				add_fd_to_set(sep);
 			}
 			sep->se_wait = cp->se_wait;
 			sep->se_max = cp->se_max;
@@ -1094,7 +1160,7 @@ static void reread_config_file(int sig UNUSED_PARAM)
 		 || lsa->len != sep->se_lsa->len
 		 || memcmp(&lsa->u.sa, &sep->se_lsa->u.sa, lsa->len) != 0
 		) {
-			remove_fd_from_set(sep->se_fd);
+			remove_fd_from_set(sep);
 			maybe_close(sep->se_fd);
 			free(sep->se_lsa);
 			sep->se_lsa = lsa;
@@ -1121,7 +1187,7 @@ static void reread_config_file(int sig UNUSED_PARAM)
 			continue;
 		}
 		*sepp = sep->se_next;
-		remove_fd_from_set(sep->se_fd);
+		remove_fd_from_set(sep);
 		maybe_close(sep->se_fd);
 #if ENABLE_FEATURE_INETD_RPC
 		if (is_rpc_service(sep))
@@ -1159,7 +1225,7 @@ static void reap_child(int sig UNUSED_PARAM)
 				bb_error_msg("%s: exit signal %u",
 						sep->se_program, WTERMSIG(status));
 			sep->se_wait = 1;
-			add_fd_to_set(sep->se_fd);
+			add_fd_to_set(sep);
 			break;
 		}
 	}
@@ -1287,11 +1353,24 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 	sa.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &sa, &saved_pipe_handler);
 
+#if ENABLE_FEATURE_INETD_EPOLL
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		bb_simple_perror_msg_and_die("epoll_create1");
+#endif
 	reread_config_file(SIGHUP); /* load config from file */
 
 	for (;;) {
 		int ready_fd_cnt;
 		int ctrl, accepted_fd, new_udp_fd;
+#if ENABLE_FEATURE_INETD_EPOLL
+		struct epoll_event ready[16];
+		int i;
+
+		/* if there are no fds to wait on, we will block
+		 * until signal wakes us up */
+		ready_fd_cnt = epoll_wait(epoll_fd, ready, ARRAY_SIZE(ready), -1);
+#else
 		fd_set readable;
 
 		if (maxsock < 0)
@@ -1302,21 +1381,31 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 		 * until signal wakes us up (maxsock == 0, but readable
 		 * never contains fds 0 and 1...) */
 		ready_fd_cnt = select(maxsock + 1, &readable, NULL, NULL, NULL);
+#endif
 		if (ready_fd_cnt < 0) {
 			if (errno != EINTR) {
-				bb_simple_perror_msg("select");
+				bb_simple_perror_msg(ENABLE_FEATURE_INETD_EPOLL ? "epoll_wait" : "select");
 				sleep1();
 			}
 			continue;
 		}
 		dbg("ready_fd_cnt:%d\n", ready_fd_cnt);
 
+#if ENABLE_FEATURE_INETD_EPOLL
+		for (i = 0; i < ready_fd_cnt; i++) {
+			/* Signals are unblocked between ready[] entries,
+			 * reread_config_file() may have changed serv_list */
+			sep = fd2sep[ready[i].data.fd];
+			if (!sep)
+				continue;
+#else
 		for (sep = serv_list; ready_fd_cnt && sep; sep = sep->se_next) {
 			if (sep->se_fd == -1 || !FD_ISSET(sep->se_fd, &readable))
 				continue;
+			ready_fd_cnt--;
+#endif
 
 			dbg("ready fd:%d\n", sep->se_fd);
-			ready_fd_cnt--;
 			ctrl = sep->se_fd;
 			accepted_fd = -1;
 			new_udp_fd = -1;
@@ -1381,7 +1470,7 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 						if (now - sep->se_time <= CNT_INTERVAL) {
 							bb_error_msg("%s/%s: too many connections, pausing",
 									sep->se_service, sep->se_proto);
-							remove_fd_from_set(sep->se_fd);
+							remove_fd_from_set(sep);
 							close(sep->se_fd);
 							sep->se_fd = -1;
 							sep->se_count = 0;
@@ -1422,12 +1511,18 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 					/* wait: we passed socket to child,
 					 * will wait for child to terminate */
 					sep->se_wait = pid;
-					remove_fd_from_set(sep->se_fd);
+					remove_fd_from_set(sep);
 				}
 				if (new_udp_fd >= 0) {
 					/* udp nowait: child connected the socket,
 					 * we created and will use new, unconnected one */
+					/* (epoll would keep watching the old one:
+					 * it is still open in the child) */
+					if (ENABLE_FEATURE_INETD_EPOLL)
+						remove_fd_from_set(sep);
 					xmove_fd(new_udp_fd, sep->se_fd);
+					if (ENABLE_FEATURE_INETD_EPOLL)
+						add_fd_to_set(sep);
 					dbg("moved new_udp_fd:%d to sep->se_fd:%d\n", new_udp_fd, sep->se_fd);
 				}
 				restore_sigmask(&omask);
@@ -1531,7 +1626,7 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 			if (sep->se_socktype != SOCK_STREAM)
 				recv(0, line, LINE_SIZE, MSG_DONTWAIT);
 			_exit_FAILURE();
-		} /* for (sep = servtab...) */
+		} /* for (sep = servtab... or ready[]...) */
 	} /* for (;;) */
 }
 
@@ -7,9 +7,25 @@
  *
  * Licensed under GPLv2, see file LICENSE in this source tree.
  */
+//config:config ISRV
+//config:	bool #No description makes it a hidden option
+//config:	default n
+//config:
+//config:config FEATURE_ISRV_EPOLL
+//config:	bool "Use epoll in isrv-based servers (fakeidentd)"
+//config:	default y
+//config:	depends on ISRV
+//config:	help
+//config:	Wait for connections with epoll(). This removes the limit
+//config:	of FD_SETSIZE (1024) connections served at once.
+
+//kbuild:lib-$(CONFIG_ISRV) += isrv.o
 
 #include "libbb.h"
 #include "isrv.h"
+#if ENABLE_FEATURE_ISRV_EPOLL
+# include <sys/epoll.h>
+#endif
 
 #define DEBUG 0
 
@@ -25,6 +41,10 @@
 
 struct isrv_state_t {
 	short  *fd2peer; /* one per registered fd */
+#if ENABLE_FEATURE_ISRV_EPOLL
+	uint32_t *fd2events; /* one per registered fd: EPOLLIN/OUT we wait for */
+	int     epoll_fd;
+#endif
 	void  **param_tbl; /* one per registered peer */
 	/* one per registered peer; doesn't exist if !timeout */
 	time_t *timeo_tbl;
@@ -34,10 +54,13 @@ struct isrv_state_t {
 	int     fd_count;
 	int     peer_count;
 	int     wr_count;
+#if !ENABLE_FEATURE_ISRV_EPOLL
 	fd_set  rd;
 	fd_set  wr;
+#endif
 };
 #define FD2PEER    (state->fd2peer)
+#define FD2EVENTS  (state->fd2events)
 #define PARAM_TBL  (state->param_tbl)
 #define TIMEO_TBL  (state->timeo_tbl)
 #define CURTIME    (state->curtime)
@@ -46,6 +69,52 @@ struct isrv_state_t {
 #define PEER_COUNT (state->peer_count)
 #define WR_COUNT   (state->wr_count)
 
+#if ENABLE_FEATURE_ISRV_EPOLL
+static void set_events(isrv_state_t *state, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	uint32_t old = FD2EVENTS[fd];
+
+	if (events == old)
+		return;
+	FD2EVENTS[fd] = events;
+	ev.events = events;
+	ev.data.fd = fd;
+	epoll_ctl(state->epoll_fd,
+		!old ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL,
+		fd, &ev);
+}
+
+/* callback */
+void isrv_want_rd(isrv_state_t *state, int fd)
+{
+	set_events(state, fd, FD2EVENTS[fd] | EPOLLIN);
+}
+
+/* callback */
+void isrv_want_wr(isrv_state_t *state, int fd)
+{
+	if (!(FD2EVENTS[fd] & EPOLLOUT)) {
+		WR_COUNT++;
+		set_events(state, fd, FD2EVENTS[fd] | EPOLLOUT);
+	}
+}
+
+/* callback */
+void isrv_dont_want_rd(isrv_state_t *state, int fd)
+{
+	set_events(state, fd, FD2EVENTS[fd] & ~EPOLLIN);
+}
+
+/* callback */
+void isrv_dont_want_wr(isrv_state_t *state, int fd)
+{
+	if (FD2EVENTS[fd] & EPOLLOUT) {
+		WR_COUNT--;
+		set_events(state, fd, FD2EVENTS[fd] & ~EPOLLOUT);
+	}
+}
+#else
 /* callback */
 void isrv_want_rd(isrv_state_t *state, int fd)
 {
@@ -75,6 +144,7 @@ void isrv_dont_want_wr(isrv_state_t *state, int fd)
 		FD_CLR(fd, &state->wr);
 	}
 }
+#endif
 
 /* callback */
 int isrv_register_fd(isrv_state_t *state, int peer, int fd)
@@ -83,7 +153,9 @@ int isrv_register_fd(isrv_state_t *state, int peer, int fd)
 
 	DPRINTF("register_fd(peer:%d,fd:%d)", peer, fd);
 
+#if !ENABLE_FEATURE_ISRV_EPOLL
 	if (FD_COUNT >= FD_SETSIZE) return -1;
+#endif
 	if (FD_COUNT <= fd) {
 		n = FD_COUNT;
 		FD_COUNT = fd + 1;
@@ -91,6 +163,10 @@ int isrv_register_fd(isrv_state_t *state, int peer, int fd)
 		DPRINTF("register_fd: FD_COUNT %d", FD_COUNT);
 
 		FD2PEER = xrealloc(FD2PEER, FD_COUNT * sizeof(FD2PEER[0]));
+#if ENABLE_FEATURE_ISRV_EPOLL
+		FD2EVENTS = xrealloc(FD2EVENTS, FD_COUNT * sizeof(FD2EVENTS[0]));
+		memset(&FD2EVENTS[n], 0, (FD_COUNT - n) * sizeof(FD2EVENTS[0]));
+#endif
 		while (n < fd) FD2PEER[n++] = -1;
 	}
 
@@ -105,9 +181,9 @@ void isrv_close_fd(isrv_state_t *state, int fd)
 {
 	DPRINTF("close_fd(%d)", fd);
 
-	close(fd);
 	isrv_dont_want_rd(state, fd);
 	if (WR_COUNT) isrv_dont_want_wr(state, fd);
+	close(fd);
 
 	FD2PEER[fd] = -1;
 	if (fd == FD_COUNT-1) {
@@ -117,6 +193,9 @@ void isrv_close_fd(isrv_state_t *state, int fd)
 		DPRINTF("close_fd: FD_COUNT %d", FD_COUNT);
 
 		FD2PEER = xrealloc(FD2PEER, FD_COUNT * sizeof(FD2PEER[0]));
+#if ENABLE_FEATURE_ISRV_EPOLL
+		FD2EVENTS = xrealloc(FD2EVENTS, FD_COUNT * sizeof(FD2EVENTS[0]));
+#endif
 	}
 }
 
@@ -125,7 +204,8 @@ int isrv_register_peer(isrv_state_t *state, void *param)
 {
 	int n;
 
-	if (PEER_COUNT >= FD_SETSIZE) return -1;
+	/* (fd2peer[] is short) */
+	if (PEER_COUNT >= (ENABLE_FEATURE_ISRV_EPOLL ? SHRT_MAX : FD_SETSIZE)) return -1;
 	n = PEER_COUNT++;
 
 	DPRINTF("register_peer: PEER_COUNT %d", PEER_COUNT);
@@ -141,7 +221,7 @@ int isrv_register_peer(isrv_state_t *state, void *param)
 
 static void remove_peer(isrv_state_t *state, int peer)
 {
-	int movesize;
+	int n;
 	int fd;
 
 	DPRINTF("remove_peer(%d)", peer);
@@ -150,6 +230,9 @@ static void remove_peer(isrv_state_t *state, int peer)
 	while (fd >= 0) {
 		if (FD2PEER[fd] == peer) {
 			isrv_close_fd(state, fd);
+			/* FD2PEER[] may have shrunk past unused fds below fd */
+			if (fd > FD_COUNT)
+				fd = FD_COUNT;
 			fd--;
 			continue;
 		}
@@ -161,11 +244,12 @@ static void remove_peer(isrv_state_t *state, int peer)
 	PEER_COUNT--;
 	DPRINTF("remove_peer: PEER_COUNT %d", PEER_COUNT);
 
-	movesize = (PEER_COUNT - peer) * sizeof(void*);
-	if (movesize > 0) {
-		memcpy(&PARAM_TBL[peer], &PARAM_TBL[peer+1], movesize);
+	/* (overlapping areas: memmove, not memcpy) */
+	n = PEER_COUNT - peer;
+	if (n > 0) {
+		memmove(&PARAM_TBL[peer], &PARAM_TBL[peer+1], n * sizeof(PARAM_TBL[0]));
 		if (TIMEOUT)
-			memcpy(&TIMEO_TBL[peer], &TIMEO_TBL[peer+1], movesize);
+			memmove(&TIMEO_TBL[peer], &TIMEO_TBL[peer+1], n * sizeof(TIMEO_TBL[0]));
 	}
 	PARAM_TBL = xrealloc(PARAM_TBL, PEER_COUNT * sizeof(PARAM_TBL[0]));
 	if (TIMEOUT)
@@ -178,27 +262,73 @@ static void handle_accept(isrv_state_t *state, int fd)
 
 	/* suppress gcc warning "cast from ptr to int of different size" */
 	fcntl(fd, F_SETFL, (int)(ptrdiff_t)(PARAM_TBL[0]) | O_NONBLOCK);
-	newfd = accept(fd, NULL, 0);
+	/* Take all pending connections, not just one */
+	while ((newfd = accept(fd, NULL, 0)) >= 0) {
+		DPRINTF("new_peer(%d)", newfd);
+		n = state->new_peer(state, newfd);
+		if (n)
+			remove_peer(state, n); /* unsuccessful peer start */
+	}
+	n = errno;
 	fcntl(fd, F_SETFL, (int)(ptrdiff_t)(PARAM_TBL[0]));
-	if (newfd < 0) {
-		if (errno == EAGAIN) return;
+	if (n != EAGAIN) {
 		/* Most probably someone gave us wrong fd type
 		 * (for example, non-socket). Don't want
 		 * to loop forever. */
+		errno = n;
 		bb_simple_perror_msg_and_die("accept");
 	}
+}
 
-	DPRINTF("new_peer(%d)", newfd);
-	n = state->new_peer(state, newfd);
-	if (n)
-		remove_peer(state, n); /* unsuccessful peer start */
+/* fd is active: accept on it, or call h() for its peer */
+static void handle_fd(isrv_state_t *state, int fd, int (*h)(int, void **))
+{
+	int peer;
+
+	DPRINTF("handle_fd: fd %d is active", fd);
+	if (fd >= FD_COUNT)
+		return; /* closed by previous handlers */
+	peer = FD2PEER[fd];
+	if (peer < 0)
+		return; /* peer is already gone */
+	if (peer == 0) {
+		handle_accept(state, fd);
+		return;
+	}
+	DPRINTF("h(fd:%d)", fd);
+	if (h(fd, &PARAM_TBL[peer])) {
+		/* this peer is gone */
+		remove_peer(state, peer);
+	} else if (TIMEOUT) {
+		TIMEO_TBL[peer] = monotonic_sec();
+	}
 }
 
+#if ENABLE_FEATURE_ISRV_EPOLL
+static void handle_events(isrv_state_t *state, struct epoll_event *ev, int n,
+		int (*do_rd)(int, void **), int (*do_wr)(int, void **))
+{
+	while (--n >= 0) {
+		int fd = ev->data.fd;
+		/* like select, report errors and hangups as readiness */
+		uint32_t events = (ev->events & (EPOLLERR | EPOLLHUP))
+				? EPOLLIN | EPOLLOUT : ev->events;
+		ev++;
+		/* earlier handlers may have closed fd (and even reused it) */
+		if (fd >= FD_COUNT)
+			continue;
+		if (events & FD2EVENTS[fd] & EPOLLIN)
+			handle_fd(state, fd, do_rd);
+		if (fd < FD_COUNT && (events & FD2EVENTS[fd] & EPOLLOUT))
+			handle_fd(state, fd, do_wr);
+	}
+}
+#else
 static void handle_fd_set(isrv_state_t *state, fd_set *fds, int (*h)(int, void **))
 {
 	enum { LONG_CNT = sizeof(fd_set) / sizeof(long) };
 	int fds_pos;
-	int fd, peer;
+	int fd;
 	/* need to know value at _the beginning_ of this routine */
 	int fd_cnt = FD_COUNT;
 
@@ -229,23 +359,10 @@ static void handle_fd_set(isrv_state_t *state, fd_set *fds, int (*h)(int, void *
 					fd, fd_cnt);
 			break;
 		}
-		DPRINTF("handle_fd_set: fd %d is active", fd);
-		peer = FD2PEER[fd];
-		if (peer < 0)
-			continue; /* peer is already gone */
-		if (peer == 0) {
-			handle_accept(state, fd);
-			continue;
-		}
-		DPRINTF("h(fd:%d)", fd);
-		if (h(fd, &PARAM_TBL[peer])) {
-			/* this peer is gone */
-			remove_peer(state, peer);
-		} else if (TIMEOUT) {
-			TIMEO_TBL[peer] = monotonic_sec();
-		}
+		handle_fd(state, fd, h);
 	}
 }
+#endif
 
 static void handle_timeout(isrv_state_t *state, int (*do_timeout)(void **))
 {
@@ -278,6 +395,11 @@ void isrv_run(
 	isrv_state_t *state = xzalloc(sizeof(*state));
 	state->new_peer = new_peer;
 	state->timeout  = timeout;
+#if ENABLE_FEATURE_ISRV_EPOLL
+	state->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (state->epoll_fd < 0)
+		bb_simple_perror_msg_and_die("epoll_create1");
+#endif
 
 	/* register "peer" #0 - it will accept new connections */
 	isrv_register_peer(state, NULL);
@@ -289,15 +411,26 @@ void isrv_run(
 
 	while (1) {
 		struct timeval tv;
+#if ENABLE_FEATURE_ISRV_EPOLL
+		struct epoll_event ev[16];
+#else
 		fd_set rd;
 		fd_set wr;
 		fd_set *wrp = NULL;
+#endif
 		int n;
 
 		tv.tv_sec = timeout;
 		if (PEER_COUNT <= 1)
 			tv.tv_sec = linger_timeout;
 		tv.tv_usec = 0;
+#if ENABLE_FEATURE_ISRV_EPOLL
+		DPRINTF("run: epoll_wait(FD_COUNT:%d,timeout:%d)...",
+				FD_COUNT, (int)tv.tv_sec);
+		n = epoll_wait(state->epoll_fd, ev, ARRAY_SIZE(ev),
+				tv.tv_sec ? tv.tv_sec * 1000 : -1);
+		DPRINTF("run: ...epoll_wait:%d", n);
+#else
 		rd = state->rd;
 		if (WR_COUNT) {
 			wr = state->wr;
@@ -308,10 +441,11 @@ void isrv_run(
 				FD_COUNT, (int)tv.tv_sec);
 		n = select(FD_COUNT, &rd, wrp, NULL, tv.tv_sec ? &tv : NULL);
 		DPRINTF("run: ...select:%d", n);
+#endif
 
 		if (n < 0) {
 			if (errno != EINTR)
-				bb_simple_perror_msg("select");
+				bb_simple_perror_msg(ENABLE_FEATURE_ISRV_EPOLL ? "epoll_wait" : "select");
 			continue;
 		}
 
@@ -326,9 +460,13 @@ void isrv_run(
 			}
 		}
 		if (n > 0) {
+#if ENABLE_FEATURE_ISRV_EPOLL
+			handle_events(state, ev, n, do_rd, do_wr);
+#else
 			handle_fd_set(state, &rd, do_rd);
 			if (wrp)
 				handle_fd_set(state, wrp, do_wr);
+#endif
 		}
 	}
 	DPRINTF("run: bailout");
@@ -10,13 +10,14 @@
 //config:	bool "fakeidentd (9 kb)"
 //config:	default y
 //config:	select FEATURE_SYSLOG
+//config:	select ISRV
 //config:	help
 //config:	fakeidentd listens on the ident port and returns a predefined
 //config:	fake value on any query.
 
 //applet:IF_FAKEIDENTD(APPLET(fakeidentd, BB_DIR_USR_SBIN, BB_SUID_DROP))
 
-//kbuild:lib-$(CONFIG_FAKEIDENTD) += isrv_identd.o isrv.o
+//kbuild:lib-$(CONFIG_FAKEIDENTD) += isrv_identd.o
 
 //usage:#define fakeidentd_trivial_usage
 //usage:       "[-fiw] [-b ADDR] [STRING]"
@@ -160,7 +161,7 @@ int fakeidentd_main(int argc UNUSED_PARAM, char **argv)
 	if (!(opt & OPT_inetdwait)) {
 		fd = create_and_bind_stream_or_die(bind_address,
 				bb_lookup_std_port("identd", "tcp", 113));
-		xlisten(fd, 5);
+		xlisten(fd, 128);
 	}
 
 	isrv_run(fd, new_peer, do_rd, /*do_wr:*/ NULL, do_timeout,
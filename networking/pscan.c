@@ -10,23 +10,30 @@
 //config:	default y
 //config:	help
 //config:	Simple network port scanner.
+//config:	Many ports (and hosts) are probed at once,
+//config:	with nonblocking connects waited for by epoll().
 
 //applet:IF_PSCAN(APPLET(pscan, BB_DIR_USR_BIN, BB_SUID_DROP))
 
 //kbuild:lib-$(CONFIG_PSCAN) += pscan.o
 
 //usage:#define pscan_trivial_usage
-//usage:       "[-cb] [-p MIN_PORT] [-P MAX_PORT] [-t TIMEOUT] [-T MIN_RTT] HOST"
+//usage:       "[-cb] [-p MIN_PORT] [-P MAX_PORT] [-t TIMEOUT] [-T MIN_RTT] [-n N] [-r N] HOST[/PREFIX]..."
 //usage:#define pscan_full_usage "\n\n"
-//usage:       "Scan HOST, print all open ports\n"
+//usage:       "Scan HOSTs, print all open ports\n"
+//usage:       "HOST/PREFIX (IPv4, PREFIX 16..32) scans all addresses in the subnet\n"
 //usage:     "\n	-c	Show closed ports too"
 //usage:     "\n	-b	Show blocked ports too"
 //usage:     "\n	-p PORT	Scan from this port (default 1)"
 //usage:     "\n	-P PORT	Scan up to this port (default 1024)"
 //usage:     "\n	-t MS	Timeout (default 5000 ms)"
 //usage:     "\n	-T MS	Minimum rtt (default 5 ms)"
+//usage:     "\n	-n N	Up to N connects in flight (default 1024)"
+//usage:     "\n	-r N	Retry unanswered ports N times (default 1)"
 
 #include "libbb.h"
+#include "common_bufsiz.h"
+#include <sys/epoll.h>
 
 /* debugging */
 #ifdef DEBUG_PSCAN
@@ -37,6 +44,94 @@
 #define DERR(...) ((void)0)
 #endif
 
+/* We don't expect to see 1000+ seconds delay, unsigned is enough */
+#define MONOTONIC_US() ((unsigned)monotonic_us())
+
+enum {
+	OPT_c = 1 << 0,
+	OPT_b = 1 << 1,
+};
+
+enum {
+	ST_UNKNOWN = 0,
+	ST_OPEN,
+	ST_CLOSED,
+	ST_BLOCKED,
+};
+
+/* Hosts are scanned in command line order, and their results are printed
+ * in this order too: a host is printed and freed once it and all hosts
+ * before it have all their ports resolved. Probes of the next host
+ * are started while the last ports of the previous one are still waited for.
+ */
+struct host {
+	struct host *next;
+	char *name;
+	len_and_sockaddr *lsa;
+	unsigned pending;       /* ports started but not yet resolved */
+	uint8_t state[];        /* ST_xxx for each port */
+};
+
+/* A connect in flight. They are kept in a ring in the order
+ * they were started, thus the oldest one is the first to time out.
+ * Resolved probes leave holes (host == NULL) in the ring.
+ */
+struct probe {
+	struct host *host;
+	int fd;
+	uint16_t port;
+	uint8_t tries;
+	unsigned start;
+};
+
+struct globals {
+	unsigned opt;
+	unsigned min_port, max_port, nports;
+	unsigned retries;
+	int epfd;
+
+	/* Host/port generator */
+	char **argv;
+	len_and_sockaddr *subnet_lsa;
+	uint32_t subnet_addr;
+	unsigned subnet_left;
+	struct host *first_host;
+	struct host *last_host;
+	unsigned next_port;
+
+	/* Probes in flight */
+	struct probe *ring;
+	unsigned ring_size;
+	unsigned ring_head, ring_tail;  /* free running, index is % ring_size */
+	unsigned inflight;
+
+	/* Timed out probes to be retried */
+	struct probe *retry;
+	unsigned retry_head, retry_cnt;
+
+	/* Congestion control: like TCP's, slow start up to ssthresh,
+	 * then +1 per cwnd resolved probes. When a retried probe gets
+	 * an answer, the first try was likely lost: halve cwnd,
+	 * but not more often than once per rto.
+	 */
+	unsigned max_inflight;
+	unsigned cwnd, ssthresh, cwnd_acc;
+	unsigned last_cut;
+
+	/* all in usec */
+	unsigned timeout;
+	unsigned min_rtt;
+	unsigned srtt;
+	/* We estimate rtt and wait rtt*4 before concluding that port is
+	 * totally blocked. Until the first answer, we wait for timeout */
+	unsigned rto;
+} FIX_ALIASING;
+#define G (*(struct globals*)bb_common_bufsiz1)
+#define INIT_G() do { \
+	setup_common_bufsiz(); \
+	BUILD_BUG_ON(sizeof(G) > COMMON_BUFSIZE); \
+} while (0)
+
 static const char *port_name(unsigned port)
 {
 	struct servent *server;
@@ -47,8 +142,283 @@ static const char *port_name(unsigned port)
 	return "unknown";
 }
 
-/* We don't expect to see 1000+ seconds delay, unsigned is enough */
-#define MONOTONIC_US() ((unsigned)monotonic_us())
+static struct host *new_host(void)
+{
+	struct host *h;
+	len_and_sockaddr *lsa;
+	char *name;
+
+	if (G.subnet_left == 0) {
+		char *arg, *slash;
+
+		arg = *G.argv;
+		if (!arg)
+			return NULL;
+		G.argv++;
+		slash = strchr(arg, '/');
+		if (!slash) {
+			lsa = xhost2sockaddr(arg, G.min_port);
+			name = xstrdup(arg);
+			goto add;
+		}
+		*slash = '\0';
+		free(G.subnet_lsa);
+		G.subnet_lsa = xhost2sockaddr(arg, G.min_port);
+		if (G.subnet_lsa->u.sa.sa_family != AF_INET)
+			bb_error_msg_and_die("bad subnet '%s'", arg);
+		G.subnet_left = 32 - xatou_range(slash + 1, 16, 32);
+		G.subnet_addr = ntohl(G.subnet_lsa->u.sin.sin_addr.s_addr)
+				& ~((1UL << G.subnet_left) - 1);
+		G.subnet_left = 1 << G.subnet_left;
+	}
+	lsa = xmemdup(G.subnet_lsa, LSA_LEN_SIZE + G.subnet_lsa->len);
+	lsa->u.sin.sin_addr.s_addr = htonl(G.subnet_addr);
+	G.subnet_addr++;
+	G.subnet_left--;
+	name = xmalloc_sockaddr2dotted_noport(&lsa->u.sa);
+ add:
+	h = xzalloc(sizeof(*h) + G.nports);
+	h->name = name;
+	h->lsa = lsa;
+	if (G.last_host)
+		G.last_host->next = h;
+	else
+		G.first_host = h;
+	G.last_host = h;
+	G.next_port = G.min_port;
+	return h;
+}
+
+/* Fills host and port of the next probe to start. 0: nothing left */
+static int next_probe(struct probe *p)
+{
+	if (G.retry_cnt != 0) {
+		*p = G.retry[G.retry_head++ % G.ring_size];
+		G.retry_cnt--;
+		return 1;
+	}
+	if (!G.last_host || G.next_port > G.max_port) {
+		if (!new_host())
+			return 0;
+	}
+	p->host = G.last_host;
+	p->port = G.next_port++;
+	p->tries = 0;
+	p->host->pending++;
+	return 1;
+}
+
+static void queue_retry(struct probe *p)
+{
+	G.retry[(G.retry_head + G.retry_cnt) % G.ring_size] = *p;
+	G.retry_cnt++;
+}
+
+static void set_state(struct host *h, unsigned port, int state)
+{
+	h->state[port - G.min_port] = state;
+	h->pending--;
+}
+
+static void cut_cwnd(unsigned now)
+{
+	if (now - G.last_cut < G.rto)
+		return;
+	G.last_cut = now;
+	G.ssthresh = G.cwnd / 2;
+	if (G.ssthresh < 2)
+		G.ssthresh = 2;
+	G.cwnd = G.ssthresh;
+	G.cwnd_acc = 0;
+	DMSG("cwnd cut to %u", G.cwnd);
+}
+
+static void grow_cwnd(void)
+{
+	if (G.cwnd >= G.max_inflight)
+		return;
+	if (G.cwnd < G.ssthresh) {
+		G.cwnd++;
+		return;
+	}
+	if (++G.cwnd_acc >= G.cwnd) {
+		G.cwnd_acc = 0;
+		G.cwnd++;
+	}
+}
+
+/* Returns 0 if the probe could not be started for lack of local resources */
+static int start_probe(struct probe *p)
+{
+	struct host *h = p->host;
+	struct epoll_event ev;
+	unsigned idx;
+	int state;
+	int s;
+
+	s = socket(h->lsa->u.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s < 0) {
+		if (errno == EMFILE || errno == ENFILE
+		 || errno == ENOBUFS || errno == ENOMEM
+		) {
+			return 0;
+		}
+		bb_simple_perror_msg_and_die("socket");
+	}
+	set_nport(&h->lsa->u.sa, htons(p->port));
+	DMSG("connect to %s port %u", h->name, p->port);
+	p->start = MONOTONIC_US();
+	if (connect(s, &h->lsa->u.sa, h->lsa->len) == 0) {
+		/* Unlikely, for me even localhost fails :) */
+		state = ST_OPEN;
+		goto done;
+	}
+	switch (errno) {
+	case EINPROGRESS:
+		break;
+	case ECONNREFUSED:
+		state = ST_CLOSED;
+		goto done;
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+	case EACCES:
+	case EPERM:
+		state = ST_BLOCKED;
+		goto done;
+	case EAGAIN:
+	case EADDRNOTAVAIL:
+	case ENOBUFS:
+		/* Out of local ports or buffers */
+		close(s);
+		return 0;
+	default:
+		bb_perror_nomsg_and_die();
+	}
+
+	idx = G.ring_tail++ % G.ring_size;
+	p->fd = s;
+	G.ring[idx] = *p;
+	G.inflight++;
+	ev.events = EPOLLOUT;
+	ev.data.u32 = idx;
+	if (epoll_ctl(G.epfd, EPOLL_CTL_ADD, s, &ev) != 0)
+		bb_simple_perror_msg_and_die("epoll_ctl");
+	return 1;
+ done:
+	close(s);
+	set_state(h, p->port, state);
+	return 1;
+}
+
+static void probe_answered(struct probe *p, int state)
+{
+	unsigned now = MONOTONIC_US();
+	unsigned rtt = now - p->start;
+
+	DMSG("%s port %u: %d @%u", p->host->name, p->port, state, rtt);
+	close(p->fd);
+	G.inflight--;
+	set_state(p->host, p->port, state);
+
+	/* Smoothed rtt, *4 allows for rise in net delay */
+	G.srtt = G.srtt ? (G.srtt * 7 + rtt) / 8 : rtt;
+	G.rto = G.srtt * 4;
+	if (G.rto < G.min_rtt)
+		G.rto = G.min_rtt;
+	if (G.rto > G.timeout)
+		G.rto = G.timeout;
+
+	if (p->tries != 0)
+		cut_cwnd(now);
+	else
+		grow_cwnd();
+	p->host = NULL;
+}
+
+/* Pops resolved probes off the ring head, times out expired ones.
+ * Returns usec until the oldest probe in flight expires, or -1.
+ */
+static int expire_probes(void)
+{
+	unsigned now = MONOTONIC_US();
+
+	while (G.ring_head != G.ring_tail) {
+		struct probe *p = &G.ring[G.ring_head % G.ring_size];
+		unsigned age;
+
+		if (p->host) {
+			age = now - p->start;
+			if (age < G.rto)
+				return G.rto - age;
+			DERR("%s port %u timed out", p->host->name, p->port);
+			close(p->fd);
+			G.inflight--;
+			if (p->tries < G.retries) {
+				p->tries++;
+				queue_retry(p);
+			} else {
+				set_state(p->host, p->port, ST_BLOCKED);
+			}
+			/* Unanswered probes are not evidence of congestion:
+			 * firewalls drop them silently */
+			grow_cwnd();
+			p->host = NULL;
+		}
+		G.ring_head++;
+	}
+	return -1;
+}
+
+static void print_done_hosts(void)
+{
+	struct host *h;
+
+	while ((h = G.first_host) != NULL
+	 && h->pending == 0
+	 && (h != G.last_host || G.next_port > G.max_port)
+	) {
+		unsigned closed_ports = 0;
+		unsigned open_ports = 0;
+		unsigned port;
+
+		printf("Scanning %s ports %u to %u\n Port\tProto\tState\tService\n",
+				h->name, G.min_port, G.max_port);
+		for (port = G.min_port; port <= G.max_port; port++) {
+			const char *result_str = NULL;
+
+			switch (h->state[port - G.min_port]) {
+			case ST_OPEN:
+				open_ports++;
+				result_str = "open";
+				break;
+			case ST_CLOSED:
+				closed_ports++;
+				if (G.opt & OPT_c) /* -c: show closed too */
+					result_str = "closed";
+				break;
+			default:
+				if (G.opt & OPT_b) /* -b: show blocked too */
+					result_str = "blocked";
+				break;
+			}
+			if (result_str)
+				printf("%5u" "\t" "tcp" "\t" "%s" "\t" "%s" "\n",
+						port, result_str, port_name(port));
+		}
+		printf("%u closed, %u open, %u timed out (or blocked) ports\n",
+					closed_ports,
+					open_ports,
+					G.nports - (closed_ports + open_ports));
+		fflush_all();
+
+		G.first_host = h->next;
+		if (!G.first_host)
+			G.last_host = NULL;
+		free(h->name);
+		free(h->lsa);
+		free(h);
+	}
+}
 
 int pscan_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int pscan_main(int argc UNUSED_PARAM, char **argv)
@@ -56,122 +426,117 @@ int pscan_main(int argc UNUSED_PARAM, char **argv)
 	const char *opt_max_port = "1024";      /* -P: default max port */
 	const char *opt_min_port = "1";         /* -p: default min port */
 	const char *opt_timeout = "5000";       /* -t: default timeout in msec */
-	/* We estimate rtt and wait rtt*4 before concluding that port is
-	 * totally blocked. min rtt of 5 ms may be too low if you are
-	 * scanning an Internet host behind saturated/traffic shaped link.
-	 * Rule of thumb: with min_rtt of N msec, scanning 1000 ports
-	 * will take N seconds at absolute minimum */
+	/* min rtt of 5 ms may be too low if you are
+	 * scanning an Internet host behind saturated/traffic shaped link */
 	const char *opt_min_rtt = "5";          /* -T: default min rtt in msec */
-	const char *result_str;
-	len_and_sockaddr *lsap;
-	int s;
-	unsigned opt;
-	unsigned port, max_port, nports;
-	unsigned closed_ports = 0;
-	unsigned open_ports = 0;
-	/* all in usec */
-	unsigned timeout;
-	unsigned min_rtt;
-	unsigned rtt_4;
-	unsigned start, diff;
+	const char *opt_inflight = "1024";      /* -n */
+	const char *opt_retries = "1";          /* -r */
+	struct rlimit rl;
 
-	opt = getopt32(argv, "^"
-		"cbp:P:t:T:"
-		"\0" "=1", /* exactly one non-option */
-		&opt_min_port, &opt_max_port, &opt_timeout, &opt_min_rtt
+	INIT_G();
+
+	G.opt = getopt32(argv, "^"
+		"cbp:P:t:T:n:r:"
+		"\0" "-1", /* at least one non-option */
+		&opt_min_port, &opt_max_port, &opt_timeout, &opt_min_rtt,
+		&opt_inflight, &opt_retries
 	);
-	argv += optind;
-	max_port = xatou_range(opt_max_port, 1, 65535);
-	port = xatou_range(opt_min_port, 1, max_port);
-	nports = max_port - port + 1;
-	min_rtt = xatou_range(opt_min_rtt, 1, INT_MAX/1000 / 4) * 1000;
-	timeout = xatou_range(opt_timeout, 1, INT_MAX/1000 / 4) * 1000;
+	G.argv = argv + optind;
+	G.max_port = xatou_range(opt_max_port, 1, 65535);
+	G.min_port = xatou_range(opt_min_port, 1, G.max_port);
+	G.nports = G.max_port - G.min_port + 1;
+	G.min_rtt = xatou_range(opt_min_rtt, 1, INT_MAX/1000 / 4) * 1000;
+	G.timeout = xatou_range(opt_timeout, 1, INT_MAX/1000 / 4) * 1000;
+	G.max_inflight = xatou_range(opt_inflight, 1, 65535);
+	G.retries = xatou_range(opt_retries, 0, 9);
 	/* Initial rtt is BIG: */
-	rtt_4 = timeout;
-
-	DMSG("min_rtt %u timeout %u", min_rtt, timeout);
-
-	lsap = xhost2sockaddr(*argv, port);
-	printf("Scanning %s ports %u to %u\n Port\tProto\tState\tService\n",
-			*argv, port, max_port);
-
-	for (; port <= max_port; port++) {
-		DMSG("rtt %u", rtt_4);
-
-		/* The SOCK_STREAM socket type is implemented on the TCP/IP protocol. */
-		set_nport(&lsap->u.sa, htons(port));
-		s = xsocket(lsap->u.sa.sa_family, SOCK_STREAM, 0);
-		/* We need unblocking socket so we don't need to wait for ETIMEOUT. */
-		/* Nonblocking connect typically "fails" with errno == EINPROGRESS */
-		ndelay_on(s);
-
-		DMSG("connect to port %u", port);
-		result_str = NULL;
-		start = MONOTONIC_US();
-		if (connect(s, &lsap->u.sa, lsap->len) == 0) {
-			/* Unlikely, for me even localhost fails :) */
-			DMSG("connect succeeded");
-			goto open;
-		}
-		/* Check for untypical errors... */
-		if (errno != EAGAIN && errno != EINPROGRESS
-		 && errno != ECONNREFUSED
-		) {
-			bb_perror_nomsg_and_die();
-		}
+	G.rto = G.timeout;
 
-		diff = 0;
-		while (1) {
-			if (errno == ECONNREFUSED) {
-				if (opt & 1) /* -c: show closed too */
-					result_str = "closed";
-				closed_ports++;
-				break;
-			}
-			DERR("port %u errno %d @%u", port, errno, diff);
+	/* Every probe in flight is an fd */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur < 16 + 1)
+		rl.rlim_cur = 16 + 1;
+	if (G.max_inflight > rl.rlim_cur - 16)
+		G.max_inflight = rl.rlim_cur - 16;
+	G.cwnd = G.max_inflight < 64 ? G.max_inflight : 64;
+	G.ssthresh = G.max_inflight;
 
-			if (diff > rtt_4) {
-				if (opt & 2) /* -b: show blocked too */
-					result_str = "blocked";
+	DMSG("min_rtt %u timeout %u max_inflight %u", G.min_rtt, G.timeout, G.max_inflight);
+
+	/* Ring has room for holes left by resolved probes:
+	 * a stuck probe at the head must not stall starting new ones too soon */
+	G.ring_size = G.max_inflight * 2;
+	G.ring = xmalloc(G.ring_size * sizeof(G.ring[0]));
+	G.retry = xmalloc(G.ring_size * sizeof(G.retry[0]));
+
+	G.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (G.epfd < 0)
+		bb_simple_perror_msg_and_die("epoll_create1");
+
+	for (;;) {
+		struct epoll_event ready[64];
+		struct probe p;
+		int wait_us, n, i;
+
+		while (G.inflight < G.cwnd
+		 && G.ring_tail - G.ring_head < G.ring_size
+		 && next_probe(&p)
+		) {
+			if (!start_probe(&p)) {
+				queue_retry(&p);
+				cut_cwnd(MONOTONIC_US());
+				if (G.cwnd > G.inflight && G.inflight != 0) {
+					/* Wait for some probes to finish */
+					G.cwnd = G.inflight;
+				}
 				break;
 			}
-			/* Can sleep (much) longer than specified delay.
-			 * We check rtt BEFORE we usleep, otherwise
-			 * on localhost we'll have no writes done (!)
-			 * before we exceed (rather small) rtt */
-			usleep(rtt_4 / 8);
- open:
-			diff = MONOTONIC_US() - start;
-			DMSG("write to port %u @%u", port, diff - start);
-			if (write(s, " ", 1) >= 0) { /* We were able to write to the socket */
-				open_ports++;
-				result_str = "open";
-				break;
+		}
+		print_done_hosts();
+
+		wait_us = expire_probes();
+		if (wait_us < 0) {
+			if (G.inflight != 0) /* can't happen */
+				bb_simple_error_msg_and_die("BUG: lost probes");
+			if (!G.first_host)
+				break; /* all done */
+			if (G.retry_cnt == 0)
+				continue; /* next host */
+			/* Ran out of local resources with nothing in flight */
+			wait_us = G.min_rtt;
+		}
+
+		n = epoll_wait(G.epfd, ready, ARRAY_SIZE(ready), (wait_us + 999) / 1000);
+		if (n < 0 && errno != EINTR)
+			bb_simple_perror_msg_and_die("epoll_wait");
+		for (i = 0; i < n; i++) {
+			struct probe *pp = &G.ring[ready[i].data.u32];
+			int err = 0;
+			socklen_t len = sizeof(err);
+
+			getsockopt(pp->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err == 0) {
+				probe_answered(pp, ST_OPEN);
+			} else if (err == ECONNREFUSED) {
+				probe_answered(pp, ST_CLOSED);
+			} else {
+				/* ICMP unreachable and such */
+				DMSG("%s port %u: error %d", pp->host->name, pp->port, err);
+				probe_answered(pp, ST_BLOCKED);
 			}
 		}
-		DMSG("out of loop @%u", diff);
-		if (result_str)
-			printf("%5u" "\t" "tcp" "\t" "%s" "\t" "%s" "\n",
-					port, result_str, port_name(port));
-
-		/* Estimate new rtt - we don't want to wait entire timeout
-		 * for each port. *4 allows for rise in net delay.
-		 * We increase rtt quickly (rtt_4*4), decrease slowly
-		 * (diff is at least rtt_4/8, *4 == rtt_4/2)
-		 * because we don't want to accidentally miss ports. */
-		rtt_4 = diff * 4;
-		if (rtt_4 < min_rtt)
-			rtt_4 = min_rtt;
-		if (rtt_4 > timeout)
-			rtt_4 = timeout;
-		/* Clean up */
-		close(s);
 	}
-	if (ENABLE_FEATURE_CLEAN_UP) free(lsap);
 
-	printf("%u closed, %u open, %u timed out (or blocked) ports\n",
-					closed_ports,
-					open_ports,
-					nports - (closed_ports + open_ports));
+	if (ENABLE_FEATURE_CLEAN_UP) {
+		close(G.epfd);
+		free(G.ring);
+		free(G.retry);
+		free(G.subnet_lsa);
+	}
 	return EXIT_SUCCESS;
 }
@@ -7,7 +7,7 @@
 //config:	bool #No description makes it a hidden option
 //config:	default n
 //Note:
-//Config.src also defines FEATURE_TLS_SHA1 option
+//Config.src also defines FEATURE_TLS_SHA1 and FEATURE_TLS_HWACCEL options
 
 //kbuild:lib-$(CONFIG_TLS) += tls.o
 //kbuild:lib-$(CONFIG_TLS) += tls_pstm.o
@@ -16,6 +16,7 @@
 //kbuild:lib-$(CONFIG_TLS) += tls_pstm_sqr_comba.o
 //kbuild:lib-$(CONFIG_TLS) += tls_aes.o
 //kbuild:lib-$(CONFIG_TLS) += tls_aesgcm.o
+//kbuild:lib-$(CONFIG_TLS) += tls_aes_hwaccel_x86-64.o
 //kbuild:lib-$(CONFIG_TLS) += tls_rsa.o
 //kbuild:lib-$(CONFIG_TLS) += tls_fe.o
 //kbuild:lib-$(CONFIG_TLS) += tls_sp_c32.o
@@ -87,6 +87,19 @@ void xorbuf(void* buf, const void* mask, unsigned count) FAST_FUNC;
 #define ALIGNED_long ALIGNED(sizeof(long))
 void xorbuf_aligned_AES_BLOCK_SIZE(void* buf, const void* mask) FAST_FUNC;
 
+#if ENABLE_FEATURE_TLS_HWACCEL && defined(__GNUC__) && defined(__x86_64__)
+# define TLS_HWACCEL_X86_64 1
+/* cpuid(1): ecx bit 25 - AES-NI, bit 1 - PCLMULQDQ */
+static ALWAYS_INLINE unsigned tls_cpuid1_ecx(void)
+{
+	unsigned eax = 1, ebx, ecx = 0, edx;
+	asm ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	return ecx;
+}
+#else
+# define TLS_HWACCEL_X86_64 0
+#endif
+
 #define matrixCryptoGetPrngData(buf, len, userPtr) (tls_get_random(buf, len), PS_SUCCESS)
 
 #define psFree(p, pool)    free(p)
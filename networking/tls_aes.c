@@ -343,9 +343,37 @@ static void aes_encrypt_1(struct tls_aes *aes, unsigned astate[16])
 	AddRoundKey(astate, RoundKey);
 }
 
+#if TLS_HWACCEL_X86_64
+static smallint aesNI;
+static int get_aesNI(void)
+{
+	unsigned ecx = tls_cpuid1_ecx();
+	ecx = ((ecx >> 24) & 2) - 1; /* bit 25 -> 1 or -1 */
+	aesNI = (int)ecx;
+	return (int)ecx;
+}
+void FAST_FUNC aes_encrypt_one_block_aesNI(struct tls_aes *aes, const void *data, void *dst);
+void FAST_FUNC aes_cbc_encrypt_aesNI(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst);
+void FAST_FUNC aes_cbc_decrypt_aesNI(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst);
+struct ASM_expects_240_aesNI { char t[1 - 2*(offsetof(struct tls_aes, rounds) != 240)]; };
+#endif
+
 void FAST_FUNC aes_setkey(struct tls_aes *aes, const void *key, unsigned key_len)
 {
 	aes->rounds = KeyExpansion(aes->key, key, key_len);
+#if TLS_HWACCEL_X86_64
+	{
+		int ni = aesNI;
+		if (!ni)
+			ni = get_aesNI();
+		if (ni > 0) {
+			/* AES-NI wants round keys as byte strings */
+			unsigned i;
+			for (i = 0; i < (aes->rounds + 1) * 4; i++)
+				aes->key[i] = SWAP_BE32(aes->key[i]);
+		}
+	}
+#endif
 }
 
 void FAST_FUNC aes_encrypt_one_block(struct tls_aes *aes, const void *data, void *dst)
@@ -356,6 +384,12 @@ void FAST_FUNC aes_encrypt_one_block(struct tls_aes *aes, const void *data, void
 	const uint8_t *pt = data;
 	uint8_t *ct = dst;
 
+#if TLS_HWACCEL_X86_64
+	if (aesNI > 0) {
+		aes_encrypt_one_block_aesNI(aes, data, dst);
+		return;
+	}
+#endif
 	for (i = 0; i < 16; i++)
 		astate[i] = pt[i];
 	aes_encrypt_1(aes, astate);
@@ -370,6 +404,12 @@ void FAST_FUNC aes_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data,
 	const uint8_t *pt = data;
 	uint8_t *ct = dst;
 
+#if TLS_HWACCEL_X86_64
+	if (aesNI > 0) {
+		aes_cbc_encrypt_aesNI(aes, iv, data, len, dst);
+		return;
+	}
+#endif
 	memcpy(iv2, iv, 16);
 	while (len > 0) {
 		{
@@ -438,6 +478,12 @@ void FAST_FUNC aes_cbc_decrypt(struct tls_aes *aes, void *iv, const void *data,
 	const uint8_t *ct = data;
 	uint8_t *pt = dst;
 
+#if TLS_HWACCEL_X86_64
+	if (aesNI > 0) {
+		aes_cbc_decrypt_aesNI(aes, iv, data, len, dst);
+		return;
+	}
+#endif
 	ivbuf = memcpy(iv2, iv, 16);
 	while (len) {
 		ivnext = (ivbuf==iv2) ? iv3 : iv2;
@@ -100,7 +100,7 @@ static void RIGHTSHIFTX(byte* x)
 }
 
 // Caller guarantees X is aligned
-static void GMULT(byte* X, byte* Y)
+static void FAST_FUNC GMULT_generic(byte* X, byte* Y)
 {
     byte Z[AES_BLOCK_SIZE] ALIGNED_long;
     //byte V[AES_BLOCK_SIZE] ALIGNED_long;
@@ -123,6 +123,18 @@ static void GMULT(byte* X, byte* Y)
     XMEMCPY(X, Z, AES_BLOCK_SIZE);
 }
 
+#if TLS_HWACCEL_X86_64
+static smallint pclmul;
+static int get_pclmul(void)
+{
+	unsigned ecx = tls_cpuid1_ecx();
+	ecx = (ecx & 2) - 1; /* bit 1 -> 1 or -1 */
+	pclmul = (int)ecx;
+	return (int)ecx;
+}
+void FAST_FUNC aesgcm_GMULT_pclmul(byte* X, byte* Y);
+#endif
+
 //bbox:
 // for TLS AES-GCM, a (which is AAD) is always 13 bytes long, and bbox code provides
 // extra 3 zeroed bytes, making it a[16], or a[AES_BLOCK_SIZE].
@@ -141,6 +153,16 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
 //    byte scratch[AES_BLOCK_SIZE] ALIGNED_long;
     unsigned blocks, partial;
     //was: byte* h = aes->H;
+#if TLS_HWACCEL_X86_64
+    void FAST_FUNC (*GMULT)(byte* X, byte* Y) = GMULT_generic;
+    int p = pclmul;
+    if (!p)
+        p = get_pclmul();
+    if (p > 0)
+        GMULT = aesgcm_GMULT_pclmul;
+#else
+# define GMULT GMULT_generic
+#endif
 
     //XMEMSET(x, 0, AES_BLOCK_SIZE);
 
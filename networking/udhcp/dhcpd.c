@@ -53,7 +53,29 @@
 #endif
 
 /* globals */
-#define g_leases ((struct dyn_lease*)ptr_to_globals)
+struct globals {
+	struct dyn_lease *leases; /* [max_leases] */
+	unsigned write_leases_at; /* monotonic_sec() of pending rewrite, or 0 */
+#if ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+	/* Used entries of leases[] are in hash chains and in the heap,
+	 * empty ones are in free_slot[]. Hash chains link "lease index + 1",
+	 * 0 terminates them.
+	 */
+	unsigned hash_mask;
+	unsigned free_cnt;
+	unsigned heap_cnt;
+	uint32_t *mac_head;    /* [hash_mask+1] */
+	uint32_t *nip_head;    /* [hash_mask+1] */
+	uint32_t *mac_next;    /* [max_leases] */
+	uint32_t *nip_next;    /* [max_leases] */
+	uint32_t *free_slot;   /* [max_leases] */
+	uint32_t *heap;        /* [max_leases], min-heap by ->expires */
+	uint32_t *heap_pos;    /* [max_leases], where is the lease in heap[] */
+	unsigned long *leased; /* bit per start_ip..end_ip, NULL if range is huge */
+#endif
+} FIX_ALIASING;
+#define G (*ptr_to_globals)
+#define g_leases (G.leases)
 /* struct server_data_t server_data is in bb_common_bufsiz1 */
 
 struct static_lease {
@@ -132,6 +154,215 @@ static int is_nip_reserved_as_static(uint32_t nip)
 	return 0;
 }
 
+#if ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+enum { LBITS = sizeof(long) * 8 };
+
+static NOINLINE void init_lease_index(void)
+{
+	unsigned n = server_data.max_leases;
+	unsigned num_ips = server_data.end_ip - server_data.start_ip + 1;
+	unsigned hsize;
+	uint32_t *p;
+
+	hsize = 1;
+	while (hsize < n)
+		hsize <<= 1;
+	G.hash_mask = hsize - 1;
+
+	p = xzalloc((hsize * 2 + n * 5) * sizeof(p[0]));
+	G.mac_head = p; p += hsize;
+	G.nip_head = p; p += hsize;
+	G.mac_next = p; p += n;
+	G.nip_next = p; p += n;
+	G.free_slot = p; p += n;
+	G.heap = p; p += n;
+	G.heap_pos = p;
+
+	/* Hand out leases[0] first */
+	while (n != 0)
+		G.free_slot[G.free_cnt++] = --n;
+
+	/* 16M addresses need 2 Mbytes of bitmap, don't go above that.
+	 * (num_ips == 0 means "all 2^32 addresses") */
+	if (num_ips - 1 < (1 << 24))
+		G.leased = xzalloc((num_ips + LBITS - 1) / LBITS * sizeof(long));
+}
+
+static unsigned hash_mac(const uint8_t *mac)
+{
+	unsigned h = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = h * 31 + mac[i];
+	return h & G.hash_mask;
+}
+
+static unsigned hash_nip(uint32_t nip)
+{
+	/* pools are ranges of consecutive IPs: low bits are as good as it gets */
+	return ntohl(nip) & G.hash_mask;
+}
+
+static void heap_set(unsigned pos, unsigned i)
+{
+	G.heap[pos] = i;
+	G.heap_pos[i] = pos;
+}
+
+/* heap[pos] has a new ->expires, move it up or down */
+static void heap_fix(unsigned pos)
+{
+	unsigned i = G.heap[pos];
+	leasetime_t t = g_leases[i].expires;
+
+	while (pos != 0) {
+		unsigned parent = (pos - 1) / 2;
+		if (g_leases[G.heap[parent]].expires <= t)
+			break;
+		heap_set(pos, G.heap[parent]);
+		pos = parent;
+	}
+	for (;;) {
+		unsigned child = pos * 2 + 1;
+		if (child >= G.heap_cnt)
+			break;
+		if (child + 1 < G.heap_cnt
+		 && g_leases[G.heap[child + 1]].expires < g_leases[G.heap[child]].expires
+		) {
+			child++;
+		}
+		if (t <= g_leases[G.heap[child]].expires)
+			break;
+		heap_set(pos, G.heap[child]);
+		pos = child;
+	}
+	heap_set(pos, i);
+}
+
+static void mark_leased(uint32_t nip, int leased)
+{
+	unsigned ofs = ntohl(nip) - server_data.start_ip;
+	unsigned long bit = 1UL << (ofs % LBITS);
+
+	if (!G.leased || ofs > server_data.end_ip - server_data.start_ip)
+		return;
+	if (leased)
+		G.leased[ofs / LBITS] |= bit;
+	else
+		G.leased[ofs / LBITS] &= ~bit;
+}
+
+/* Add a filled leases[] entry to the index */
+static void link_lease(struct dyn_lease *lease)
+{
+	unsigned i = lease - g_leases;
+	unsigned h;
+
+	h = hash_mac(lease->lease_mac);
+	G.mac_next[i] = G.mac_head[h];
+	G.mac_head[h] = i + 1;
+	h = hash_nip(lease->lease_nip);
+	G.nip_next[i] = G.nip_head[h];
+	G.nip_head[h] = i + 1;
+	heap_set(G.heap_cnt, i);
+	heap_fix(G.heap_cnt++);
+	mark_leased(lease->lease_nip, 1);
+}
+
+static void unchain(uint32_t *head, uint32_t *next, unsigned i)
+{
+	while (*head != i + 1)
+		head = &next[*head - 1];
+	*head = next[i];
+}
+
+/* Remove leases[] entry from the index, before changing or freeing it */
+static void unlink_lease(struct dyn_lease *lease)
+{
+	unsigned i = lease - g_leases;
+	unsigned pos = G.heap_pos[i];
+
+	unchain(&G.mac_head[hash_mac(lease->lease_mac)], G.mac_next, i);
+	unchain(&G.nip_head[hash_nip(lease->lease_nip)], G.nip_next, i);
+	if (pos != --G.heap_cnt) {
+		heap_set(pos, G.heap[G.heap_cnt]);
+		heap_fix(pos);
+	}
+	mark_leased(lease->lease_nip, 0);
+}
+
+static void free_lease(struct dyn_lease *lease)
+{
+	unlink_lease(lease);
+	memset(lease, 0, sizeof(*lease));
+	G.free_slot[G.free_cnt++] = lease - g_leases;
+}
+
+/* Find the first lease that matches MAC, NULL if no match */
+static struct dyn_lease *find_lease_by_mac(const uint8_t *mac)
+{
+	unsigned i = G.mac_head[hash_mac(mac)];
+
+	while (i != 0) {
+		if (memcmp(g_leases[i - 1].lease_mac, mac, 6) == 0)
+			return &g_leases[i - 1];
+		i = G.mac_next[i - 1];
+	}
+	return NULL;
+}
+
+/* Find the first lease that matches IP, NULL is no match */
+static struct dyn_lease *find_lease_by_nip(uint32_t nip)
+{
+	unsigned i = G.nip_head[hash_nip(nip)];
+
+	while (i != 0) {
+		if (g_leases[i - 1].lease_nip == nip)
+			return &g_leases[i - 1];
+		i = G.nip_next[i - 1];
+	}
+	return NULL;
+}
+
+/* Get an empty entry, or take over the oldest expired lease.
+ * NULL if there is neither. */
+static struct dyn_lease *oldest_expired_lease(void)
+{
+	struct dyn_lease *lease;
+
+	if (G.free_cnt != 0)
+		return &g_leases[G.free_slot[--G.free_cnt]];
+	if (G.heap_cnt != 0) {
+		lease = &g_leases[G.heap[0]];
+		if (lease->expires < (leasetime_t) time(NULL)) {
+			unlink_lease(lease);
+			return lease;
+		}
+	}
+	return NULL;
+}
+
+/* Clear out all leases with matching nonzero chaddr OR yiaddr.
+ * If chaddr == NULL, this is a conflict lease.
+ */
+static void clear_leases(const uint8_t *chaddr, uint32_t yiaddr)
+{
+	struct dyn_lease *lease;
+
+	if (chaddr) {
+		while ((lease = find_lease_by_mac(chaddr)) != NULL)
+			free_lease(lease);
+	}
+	if (yiaddr) {
+		while ((lease = find_lease_by_nip(yiaddr)) != NULL)
+			free_lease(lease);
+	}
+}
+#else
+#define link_lease(lease)   ((void)0)
+#define unlink_lease(lease) ((void)0)
+
 /* Find the oldest expired lease, NULL if there are no expired leases */
 static struct dyn_lease *oldest_expired_lease(void)
 {
@@ -168,6 +399,31 @@ static void clear_leases(const uint8_t *chaddr, uint32_t yiaddr)
 	}
 }
 
+/* Find the first lease that matches MAC, NULL if no match */
+static struct dyn_lease *find_lease_by_mac(const uint8_t *mac)
+{
+	unsigned i;
+
+	for (i = 0; i < server_data.max_leases; i++)
+		if (memcmp(g_leases[i].lease_mac, mac, 6) == 0)
+			return &g_leases[i];
+
+	return NULL;
+}
+
+/* Find the first lease that matches IP, NULL is no match */
+static struct dyn_lease *find_lease_by_nip(uint32_t nip)
+{
+	unsigned i;
+
+	for (i = 0; i < server_data.max_leases; i++)
+		if (g_leases[i].lease_nip == nip)
+			return &g_leases[i];
+
+	return NULL;
+}
+#endif
+
 /* Add a lease into the table, clearing out any old ones.
  * If chaddr == NULL, this is a conflict lease.
  */
@@ -210,6 +466,7 @@ static struct dyn_lease *add_lease(
 			memcpy(oldest->lease_mac, chaddr, 6);
 		oldest->lease_nip = yiaddr;
 		oldest->expires = time(NULL) + leasetime;
+		link_lease(oldest);
 	}
 
 	return oldest;
@@ -221,30 +478,6 @@ static int is_expired_lease(struct dyn_lease *lease)
 	return (lease->expires < (leasetime_t) time(NULL));
 }
 
-/* Find the first lease that matches MAC, NULL if no match */
-static struct dyn_lease *find_lease_by_mac(const uint8_t *mac)
-{
-	unsigned i;
-
-	for (i = 0; i < server_data.max_leases; i++)
-		if (memcmp(g_leases[i].lease_mac, mac, 6) == 0)
-			return &g_leases[i];
-
-	return NULL;
-}
-
-/* Find the first lease that matches IP, NULL is no match */
-static struct dyn_lease *find_lease_by_nip(uint32_t nip)
-{
-	unsigned i;
-
-	for (i = 0; i < server_data.max_leases; i++)
-		if (g_leases[i].lease_nip == nip)
-			return &g_leases[i];
-
-	return NULL;
-}
-
 /* Check if the IP is taken; if it is, add it to the lease table */
 static int nobody_responds_to_arp(uint32_t nip, const uint8_t *safe_mac, unsigned arpping_ms)
 {
@@ -266,14 +499,41 @@ static int nobody_responds_to_arp(uint32_t nip, const uint8_t *safe_mac, unsigne
 	return 0;
 }
 
+#if ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+/* Oldest lease on an address which find_free_or_expired_nip() could hand out */
+static struct dyn_lease *oldest_pool_lease(void)
+{
+	struct dyn_lease *oldest = NULL;
+	unsigned i;
+
+	for (i = 0; i < G.heap_cnt; i++) {
+		struct dyn_lease *lease = &g_leases[G.heap[i]];
+		uint32_t addr = ntohl(lease->lease_nip);
+
+		if (addr < server_data.start_ip || addr > server_data.end_ip
+		 || lease->lease_nip == server_data.server_nip
+		 || is_nip_reserved_as_static(lease->lease_nip)
+		) {
+			/* (this is rare: only static clients have such leases) */
+			continue;
+		}
+		if (!oldest || lease->expires < oldest->expires)
+			oldest = lease;
+		if (i == 0)
+			break; /* top of the heap: nothing is older */
+	}
+	return oldest;
+}
+#endif
+
 /* Find a new usable (we think) address */
 static uint32_t find_free_or_expired_nip(const uint8_t *safe_mac, unsigned arpping_ms)
 {
 	uint32_t addr;
+	unsigned left;
 	struct dyn_lease *oldest_lease = NULL;
 
 #if ENABLE_FEATURE_UDHCPD_BASE_IP_ON_MAC
-	uint32_t stop;
 	unsigned i, hash;
 
 	/* hash hwaddr: use the SDBM hashing algorithm.  Seems to give good
@@ -286,15 +546,27 @@ static uint32_t find_free_or_expired_nip(const uint8_t *safe_mac, unsigned arppi
 	/* pick a seed based on hwaddr then iterate until we find a free address. */
 	addr = server_data.start_ip
 		+ (hash % (1 + server_data.end_ip - server_data.start_ip));
-	stop = addr;
 #else
 	addr = server_data.start_ip;
-#define stop (server_data.end_ip + 1)
 #endif
+	left = server_data.end_ip - server_data.start_ip + 1;
 	do {
 		uint32_t nip;
 		struct dyn_lease *lease;
 
+#if ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+		if (G.leased) {
+			unsigned ofs = addr - server_data.start_ip;
+			if (ofs % LBITS == 0 && left >= LBITS
+			 && G.leased[ofs / LBITS] == ~0UL
+			) {
+				/* LBITS leased addresses in a row, skip them */
+				addr += LBITS - 1;
+				left -= LBITS - 1;
+				goto next_addr;
+			}
+		}
+#endif
 		/* (Addresses ending in .0 or .255 can legitimately be allocated
 		 * in various situations, so _don't_ skip these.  The user needs
 		 * to choose start_ip and end_ip correctly for a particular
@@ -313,19 +585,23 @@ static uint32_t find_free_or_expired_nip(const uint8_t *safe_mac, unsigned arppi
 //TODO: DHCP servers do not always sit on the same subnet as clients: should *ping*, not arp-ping!
 			if (nobody_responds_to_arp(nip, safe_mac, arpping_ms))
 				return nip;
-		} else {
+		}
+#if !ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+		else {
 			if (!oldest_lease || lease->expires < oldest_lease->expires)
 				oldest_lease = lease;
 		}
+#endif
 
  next_addr:
 		addr++;
-#if ENABLE_FEATURE_UDHCPD_BASE_IP_ON_MAC
 		if (addr > server_data.end_ip)
 			addr = server_data.start_ip;
-#endif
-	} while (addr != stop);
+	} while (--left != 0);
 
+#if ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+	oldest_lease = oldest_pool_lease();
+#endif
 	if (oldest_lease
 	 && is_expired_lease(oldest_lease)
 	 && nobody_responds_to_arp(oldest_lease->lease_nip, safe_mac, arpping_ms)
@@ -457,11 +733,13 @@ static NOINLINE void read_config(const char *file)
 
 static void write_leases(void)
 {
+	struct dyn_lease buf[32];
 	int fd;
-	unsigned i;
+	unsigned i, n;
 	leasetime_t curr;
 	int64_t written_at;
 
+	G.write_leases_at = 0;
 	fd = open_or_warn(server_data.lease_file, O_WRONLY|O_CREAT|O_TRUNC);
 	if (fd < 0)
 		return;
@@ -471,27 +749,26 @@ static void write_leases(void)
 	written_at = SWAP_BE64(written_at);
 	full_write(fd, &written_at, sizeof(written_at));
 
+	/* No error checks. If the file gets truncated,
+	 * we lose some leases on restart. Oh well. */
+	n = 0;
 	for (i = 0; i < server_data.max_leases; i++) {
-		leasetime_t tmp_time;
-
 		if (g_leases[i].lease_nip == 0)
 			continue;
 
-		/* Screw with the time in the struct, for easier writing */
-		tmp_time = g_leases[i].expires;
-
-		g_leases[i].expires -= curr;
-		if ((signed_leasetime_t) g_leases[i].expires < 0)
-			g_leases[i].expires = 0;
-		g_leases[i].expires = htonl(g_leases[i].expires);
+		buf[n] = g_leases[i];
+		buf[n].expires -= curr;
+		if ((signed_leasetime_t) buf[n].expires < 0)
+			buf[n].expires = 0;
+		buf[n].expires = htonl(buf[n].expires);
 
-		/* No error check. If the file gets truncated,
-		 * we lose some leases on restart. Oh well. */
-		full_write(fd, &g_leases[i], sizeof(g_leases[i]));
-
-		/* Then restore it when done */
-		g_leases[i].expires = tmp_time;
+		/* Write in batches, not one syscall per lease */
+		if (++n == ARRAY_SIZE(buf)) {
+			full_write(fd, buf, sizeof(buf));
+			n = 0;
+		}
 	}
+	full_write(fd, buf, n * sizeof(buf[0]));
 	close(fd);
 
 	if (server_data.notify_file) {
@@ -844,8 +1121,12 @@ static NOINLINE void send_ACK(struct dhcp_packet *oldpacket, uint32_t yiaddr)
 		p_host_name ? (unsigned char)p_host_name[OPT_LEN - OPT_DATA] : 0
 	);
 	if (ENABLE_FEATURE_UDHCPD_WRITE_LEASES_EARLY) {
-		/* rewrite the file with leases at every new acceptance */
-		write_leases();
+		/* rewrite the file with leases soon after every new acceptance.
+		 * Not right away: when lots of clients come up at once,
+		 * rewriting it once a second is plenty.
+		 */
+		if (!G.write_leases_at)
+			G.write_leases_at = monotonic_sec() + 1;
 	}
 }
 
@@ -968,8 +1249,11 @@ int udhcpd_main(int argc UNUSED_PARAM, char **argv)
 		server_data.max_leases = num_ips;
 	}
 
-	/* this sets g_leases */
-	SET_PTR_TO_GLOBALS(xzalloc(server_data.max_leases * sizeof(g_leases[0])));
+	SET_PTR_TO_GLOBALS(xzalloc(sizeof(G)));
+	g_leases = xzalloc(server_data.max_leases * sizeof(g_leases[0]));
+#if ENABLE_FEATURE_UDHCPD_LEASE_INDEX
+	init_lease_index();
+#endif
 
 	read_leases(server_data.lease_file);
 
@@ -1004,6 +1288,11 @@ int udhcpd_main(int argc UNUSED_PARAM, char **argv)
 		udhcp_sp_fd_set(pfds, server_socket);
 
  new_tv:
+		if (G.write_leases_at
+		 && (int)(G.write_leases_at - monotonic_sec()) <= 0
+		) {
+			write_leases();
+		}
 		tv = -1;
 		if (server_data.auto_time) {
 			tv = timeout_end - monotonic_sec();
@@ -1014,6 +1303,8 @@ int udhcpd_main(int argc UNUSED_PARAM, char **argv)
 			}
 			tv *= 1000;
 		}
+		if (G.write_leases_at && (unsigned)tv > 1000)
+			tv = 1000;
 
 		/* Block here waiting for either signal or packet */
 		retval = poll(pfds, 2, tv);
@@ -1259,10 +1550,13 @@ o DHCPREQUEST generated during REBINDING state:
 			if (server_id_opt
 			 && requested_ip_opt
 			 && lease  /* chaddr matches this lease */
+			 && lease != &fake_lease
 			 && requested_nip == lease->lease_nip
 			) {
+				unlink_lease(lease);
 				memset(lease->lease_mac, 0, sizeof(lease->lease_mac));
 				lease->expires = time(NULL) + server_data.decline_time;
+				link_lease(lease);
 			}
 			break;
 
@@ -1278,9 +1572,12 @@ o DHCPREQUEST generated during REBINDING state:
 			log1("received %s", "RELEASE");
 			if (server_id_opt
 			 && lease  /* chaddr matches this lease */
+			 && lease != &fake_lease
 			 && packet.ciaddr == lease->lease_nip
 			) {
+				unlink_lease(lease);
 				lease->expires = time(NULL);
+				link_lease(lease);
 			}
 			break;
 
@@ -101,6 +101,16 @@
 //config:	FEATURE_WGET_OPENSSL does implement TLS verification
 //config:	using the certificates available to OpenSSL.
 //config:
+//config:config FEATURE_WGET_PARALLEL
+//config:	bool "Enable --parallel=N option"
+//config:	default y
+//config:	depends on FEATURE_WGET_LONG_OPTIONS
+//config:	help
+//config:	Download a file in N pieces over N connections at once,
+//config:	using Range requests, if server supports them.
+//config:	This helps when a single TCP connection is limited by
+//config:	latency rather than bandwidth. Not supported on NOMMU.
+//config:
 //config:config FEATURE_WGET_OPENSSL
 //config:	bool "Try to connect to HTTPS using openssl"
 //config:	default y
@@ -137,6 +147,9 @@
 //usage:	IF_FEATURE_WGET_LONG_OPTIONS(
 //usage:       "[-cqS] [--spider] [-O FILE] [-o LOGFILE] [--header STR]\n"
 //usage:       "	[--post-data STR | --post-file FILE] [-Y on/off]\n"
+//usage:	IF_FEATURE_WGET_PARALLEL(
+//usage:       "	[--parallel N]\n"
+//usage:	)
 /* Since we ignore these opts, we don't show them in --help */
 /* //usage:    "	[--no-cache] [--passive-ftp] [-t TRIES]" */
 /* //usage:    "	[-nv] [-nc] [-nH] [-np]" */
@@ -152,6 +165,9 @@
 //usage:     "\n	--header STR	Add STR (of form 'header: value') to headers"
 //usage:     "\n	--post-data STR	Send STR using POST method"
 //usage:     "\n	--post-file FILE	Send FILE using POST method"
+//usage:	IF_FEATURE_WGET_PARALLEL(
+//usage:     "\n	--parallel N	Download over N connections"
+//usage:	)
 //usage:	IF_FEATURE_WGET_OPENSSL(
 //usage:     "\n	--no-check-certificate	Don't validate the server's certificate"
 //usage:	)
@@ -184,6 +200,7 @@
 
 
 #define SSL_SUPPORTED (ENABLE_FEATURE_WGET_OPENSSL || ENABLE_FEATURE_WGET_HTTPS)
+#define PARALLEL_SUPPORTED (ENABLE_FEATURE_WGET_PARALLEL && BB_MMU)
 #define FTPS_SUPPORTED (ENABLE_FEATURE_WGET_FTP && ENABLE_FEATURE_WGET_HTTPS)
 
 struct host_info {
@@ -244,6 +261,7 @@ static const char wget_user_headers[] ALIGN1 =
 struct globals {
 	off_t content_len;        /* Content-length of the file */
 	off_t beg_range;          /* Range at which continue begins */
+	off_t end_range;          /* If not 0, request only up to this offset */
 #if ENABLE_FEATURE_WGET_STATUSBAR
 	off_t transferred;        /* Number of bytes transferred so far */
 	const char *curfile;      /* Name of current file being transferred */
@@ -254,6 +272,11 @@ struct globals {
 	char *post_data;
 	char *post_file;
 	char *extra_headers;
+# if ENABLE_FEATURE_WGET_PARALLEL
+	char *parallel_str;       /* --parallel N */
+	unsigned parallel;
+	off_t parallel_base;      /* output_fd offset of the first body byte */
+# endif
 	unsigned char user_headers; /* Headers mentioned by the user */
 #endif
 	char *fname_out;        /* where to direct output (-O) */
@@ -269,6 +292,11 @@ struct globals {
 #endif
 	smallint chunked;         /* chunked transfer encoding */
 	smallint got_clen;        /* got content-length: from server  */
+	smallint keepalive;       /* current connection will be reused */
+	smallint accept_ranges;   /* server said "Accept-Ranges: bytes" */
+	smallint more_urls;       /* current URL is not the last one */
+	FILE *ka_sfp;             /* idle connection kept for the next URL */
+	char *ka_server;          /* "proto://host:port" ka_sfp is connected to */
 	/* Local downloads do benefit from big buffer.
 	 * With 512 byte buffer, it was measured to be
 	 * an order of magnitude slower than with big one.
@@ -302,6 +330,7 @@ enum {
 	WGET_OPT_SPIDER     = (1 << 13) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
 	WGET_OPT_NO_CHECK_CERT = (1 << 14) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
 	WGET_OPT_POST_FILE  = (1 << 15) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
+	WGET_OPT_PARALLEL   = (1 << 16) * ENABLE_FEATURE_WGET_PARALLEL,
 	/* hijack this bit for other than opts purposes: */
 	WGET_NO_FTRUNCATE   = (1 << 31)
 };
@@ -665,6 +694,40 @@ static char *get_sanitized_hdr(FILE *fp)
 	return hdrval;
 }
 
+/* HTTP/1.1 keep-alive: if the next URL is for the same server,
+ * send the request over the connection left open by the previous one.
+ */
+static char *server_key(struct host_info *server)
+{
+	return xasprintf("%s://%s:%u", server->protocol, server->host, server->port);
+}
+
+static FILE *reuse_connection(const char *key)
+{
+	FILE *fp = G.ka_sfp;
+
+	if (!fp)
+		return NULL;
+	G.ka_sfp = NULL;
+	if (strcmp(key, G.ka_server) == 0) {
+		struct pollfd pfd;
+		/* The server has nothing to say to us now.
+		 * If the connection is readable, it is EOF:
+		 * the server (or TLS helper) closed it while idle.
+		 */
+		pfd.fd = fileno(fp);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 0)
+			goto ret;
+	}
+	fclose(fp);
+	fp = NULL;
+ ret:
+	free(G.ka_server);
+	G.ka_server = NULL;
+	return fp;
+}
+
 static void reset_beg_range_to_zero(void)
 {
 	bb_simple_error_msg("restart failed");
@@ -1049,8 +1112,15 @@ static void NOINLINE retrieve_file_data(FILE *dfp)
 		 */
 		if (G.content_len < 0 || errno)
 			bb_error_msg_and_die("bad chunk length '%s'", G.wget_buf);
-		if (G.content_len == 0)
+		if (G.content_len == 0) {
+			/* Connection will be reused: eat trailer and final "\r\n" */
+			if (G.keepalive) {
+				do
+					fgets_trim_sanitize(dfp, NULL);
+				while (G.wget_buf[0] != '\0');
+			}
 			break; /* all done! */
+		}
 		G.got_clen = 1;
 		/*
 		 * Note that fgets may result in some data being buffered in dfp.
@@ -1094,6 +1164,341 @@ static void NOINLINE retrieve_file_data(FILE *dfp)
 	}
 }
 
+static FILE *open_http_socket(struct host_info *server, len_and_sockaddr *lsa, int ka_conn)
+{
+	FILE *sfp;
+
+	/* Open socket to http(s) server */
+#if ENABLE_FEATURE_WGET_OPENSSL
+	/* openssl (and maybe internal TLS) support is configured */
+	if (server->protocol == P_HTTPS) {
+		/* openssl-based helper
+		 * Inconvenient API since we can't give it an open fd
+		 */
+		int fd = spawn_https_helper_openssl(server->host, server->port);
+# if ENABLE_FEATURE_WGET_HTTPS
+		if (fd < 0) { /* no openssl? try internal */
+			sfp = open_socket(lsa);
+			spawn_ssl_client(server->host, fileno(sfp),
+				ka_conn ? TLSLOOP_EXIT_ON_LOCAL_EOF : 0);
+			return sfp;
+		}
+# else
+		/* We don't check for exec("openssl") failure in this case */
+# endif
+		sfp = fdopen(fd, "r+");
+		if (!sfp)
+			bb_die_memory_exhausted();
+		return sfp;
+	}
+	sfp = open_socket(lsa);
+#elif ENABLE_FEATURE_WGET_HTTPS
+	/* Only internal TLS support is configured */
+	sfp = open_socket(lsa);
+	if (server->protocol == P_HTTPS)
+		/* With keep-alive, make helper exit when we close the connection */
+		spawn_ssl_client(server->host, fileno(sfp),
+			ka_conn ? TLSLOOP_EXIT_ON_LOCAL_EOF : 0);
+#else
+	/* ssl (https) support is not configured */
+	sfp = open_socket(lsa);
+#endif
+	return sfp;
+}
+
+static void send_http_request(FILE *sfp, struct host_info *server, struct host_info *target,
+		int use_proxy, int ka_conn)
+{
+	/* Send HTTP request */
+	if (use_proxy) {
+		SENDFMT(sfp, "GET %s://%s/%s HTTP/1.1\r\n",
+			target->protocol, target->host,
+			target->path);
+	} else {
+		SENDFMT(sfp, "%s /%s HTTP/1.1\r\n",
+			(option_mask32 & WGET_OPT_POST) ? "POST" : "GET",
+			target->path);
+	}
+	if (!USR_HEADER_HOST)
+		SENDFMT(sfp, "Host: %s\r\n", target->host);
+	if (!USR_HEADER_USER_AGENT)
+		SENDFMT(sfp, "User-Agent: %s\r\n", G.user_agent);
+
+	/* Ask server to close the connection as soon as we are done
+	 * (IOW: we do not intend to send more requests).
+	 * HTTP/1.1 connections are persistent by default.
+	 */
+	if (!G.more_urls)
+		SENDFMT(sfp, "Connection: close\r\n");
+
+#if ENABLE_FEATURE_WGET_AUTHENTICATION
+	if (target->user && !USR_HEADER_AUTH) {
+		SENDFMT(sfp, "Proxy-Authorization: Basic %s\r\n"+6,
+			base64enc(target->user));
+	}
+	if (use_proxy && server->user && !USR_HEADER_PROXY_AUTH) {
+		SENDFMT(sfp, "Proxy-Authorization: Basic %s\r\n",
+			base64enc(server->user));
+	}
+#endif
+
+	if ((G.beg_range != 0 || G.end_range != 0) && !USR_HEADER_RANGE) {
+		SENDFMT(sfp, "Range: bytes=%"OFF_FMT"u-", G.beg_range);
+		if (G.end_range != 0)
+			SENDFMT(sfp, "%"OFF_FMT"u", G.end_range - 1);
+		SENDFMT(sfp, "\r\n");
+	}
+
+#if ENABLE_FEATURE_WGET_LONG_OPTIONS
+	if (G.extra_headers) {
+		log_io(G.extra_headers);
+		fputs(G.extra_headers, sfp);
+	}
+
+	if (option_mask32 & WGET_OPT_POST_FILE) {
+		int fd = xopen_stdin(G.post_file);
+		G.post_data = xmalloc_read(fd, NULL);
+		close(fd);
+	}
+
+	if (G.post_data) {
+		/* If user did not override it... */
+		if (!USR_HEADER_CONTENT_TYPE) {
+			SENDFMT(sfp,
+				"Content-Type: application/x-www-form-urlencoded\r\n"
+			);
+		}
+		SENDFMT(sfp,
+			"Content-Length: %u\r\n"
+			"\r\n"
+			"%s",
+			(int) strlen(G.post_data), G.post_data
+		);
+	} else
+#endif
+	{
+		SENDFMT(sfp, "\r\n");
+	}
+
+	fflush(sfp);
+
+/* Tried doing this unconditionally.
+ * Cloudflare and nginx/1.11.5 are shocked to see SHUT_WR on non-HTTPS.
+ */
+#if SSL_SUPPORTED
+	if (target->protocol == P_HTTPS && !ka_conn) {
+		/* If we use SSL helper, keeping our end of the socket open for writing
+		 * makes our end (i.e. the same fd!) readable (EAGAIN instead of EOF)
+		 * even after child closes its copy of the fd.
+		 * This helps:
+		 * (not for connections which may be kept: internal TLS helper
+		 * would exit on it. It exits on server's EOF anyway.)
+		 */
+		shutdown(fileno(sfp), SHUT_WR);
+	}
+#endif
+}
+
+#if PARALLEL_SUPPORTED
+/* --parallel N: when the response says the server accepts ranges,
+ * fetch the body in N pieces, each in its own child process
+ * over its own connection, and pwrite() them in place.
+ * The first piece is read from the connection the response came on.
+ * A piece which fails is restarted (over a new connection)
+ * from the byte where it stopped, unless it keeps failing
+ * without making any progress.
+ */
+struct segment {
+	off_t beg;
+	off_t pos;      /* next byte to fetch, advanced by the child */
+	off_t end;
+	off_t started;  /* pos when the child was started */
+	pid_t pid;
+	unsigned fails; /* restarts in a row which made no progress */
+};
+enum {
+	MIN_SEGMENT = 256 * 1024,
+	MAX_SEGMENT_FAILS = 5,
+};
+
+static void NORETURN fetch_segment(struct segment *seg, FILE *sfp,
+		struct host_info *server, struct host_info *target,
+		len_and_sockaddr *lsa, int use_proxy)
+{
+	if (!sfp) {
+		char range[sizeof("bytes %llu-") + sizeof(long long)*3];
+		char *str;
+
+		G.beg_range = seg->pos;
+		G.end_range = seg->end;
+		G.more_urls = 0;
+		sfp = open_http_socket(server, lsa, /*ka_conn:*/ 0);
+		send_http_request(sfp, server, target, use_proxy, /*ka_conn:*/ 0);
+
+		fgets_trim_sanitize(sfp, NULL);
+		str = skip_whitespace(skip_non_whitespace(G.wget_buf));
+		if (atoi(str) != 206)
+			bb_error_msg_and_die("server returned error: %s", G.wget_buf);
+		/* Make sure we got the range we asked for */
+		sprintf(range, "bytes %"OFF_FMT"u-", seg->pos);
+		str = NULL;
+		while (get_sanitized_hdr(sfp) != NULL) {
+			if (strcmp(G.wget_buf, "content-range") == 0
+			 && is_prefixed_with(skip_whitespace(G.wget_buf + sizeof("content-range")), range)
+			) {
+				str = range;
+			}
+		}
+		if (!str)
+			bb_simple_error_msg_and_die("bad range in response");
+	}
+
+	while (seg->pos < seg->end) {
+		unsigned rdsz = sizeof(G.wget_buf);
+		int n;
+
+		if (seg->end - seg->pos < (off_t)rdsz)
+			rdsz = seg->end - seg->pos;
+		set_alarm();
+		n = fread(G.wget_buf, 1, rdsz, sfp);
+		clear_alarm();
+		if (n <= 0)
+			bb_simple_error_msg_and_die("connection closed prematurely");
+		if (pwrite(G.output_fd, G.wget_buf, n, G.parallel_base + seg->pos) != n)
+			bb_simple_perror_msg_and_die(bb_msg_write_error);
+		seg->pos += n;
+	}
+	exit(0);
+}
+
+static void start_segment(struct segment *seg, FILE *sfp,
+		struct host_info *server, struct host_info *target,
+		len_and_sockaddr *lsa, int use_proxy)
+{
+	pid_t pid;
+
+	seg->started = seg->pos;
+	fflush_all();
+	pid = xfork();
+	if (pid == 0) {
+		/* Child */
+		signal(SIGCHLD, SIG_DFL);
+		fetch_segment(seg, sfp, server, target, lsa, use_proxy);
+	}
+	/* Not in the child: *seg is shared */
+	seg->pid = pid;
+}
+
+static void retrieve_parallel(FILE *sfp, unsigned n,
+		struct host_info *server, struct host_info *target,
+		len_and_sockaddr *lsa, int use_proxy)
+{
+	struct segment *segs;
+	off_t total = G.content_len;
+	unsigned i, running;
+
+	segs = mmap(NULL, n * sizeof(segs[0]),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			/* ignored: */ -1, 0);
+	if (segs == MAP_FAILED)
+		bb_die_memory_exhausted();
+	for (i = 0; i < n; i++) {
+		segs[i].beg = segs[i].pos = total / n * i;
+		segs[i].end = total / n * (i + 1);
+		segs[i].fails = 0;
+	}
+	segs[n - 1].end = total;
+
+	if (!(option_mask32 & WGET_OPT_QUIET))
+		fprintf(stderr, "saving to '%s' over %u connections\n", G.fname_out, n);
+	progress_meter(PROGRESS_START);
+
+	/* Make poll() below return early when a child exits */
+	signal_no_SA_RESTART_empty_mask(SIGCHLD, record_signo);
+	for (i = 0; i < n; i++)
+		start_segment(&segs[i], i == 0 ? sfp : NULL, server, target, lsa, use_proxy);
+
+	running = n;
+	while (running) {
+		off_t done;
+		pid_t pid;
+		int status;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			struct segment *seg;
+
+			/* Not all children are ours: TLS helper can be */
+			for (seg = segs; seg < segs + n; seg++)
+				if (seg->pid == pid)
+					goto found;
+			continue;
+ found:
+			seg->pid = 0;
+			running--;
+			if (seg->pos == seg->end)
+				continue;
+			if (seg->pos != seg->started)
+				seg->fails = 0;
+			if (++seg->fails >= MAX_SEGMENT_FAILS) {
+				for (seg = segs; seg < segs + n; seg++)
+					if (seg->pid)
+						kill(seg->pid, SIGTERM);
+				progress_meter(PROGRESS_END);
+				bb_simple_error_msg_and_die("download failed");
+			}
+			start_segment(seg, NULL, server, target, lsa, use_proxy);
+			running++;
+		}
+
+		done = 0;
+		for (i = 0; i < n; i++)
+			done += segs[i].pos - segs[i].beg;
+#if ENABLE_FEATURE_WGET_STATUSBAR
+		G.transferred = done;
+#endif
+		G.content_len = total - done;
+		progress_meter(PROGRESS_BUMP);
+		if (running)
+			poll(NULL, 0, 1000);
+	}
+	signal(SIGCHLD, SIG_DFL);
+	munmap(segs, n * sizeof(segs[0]));
+	/* pwrite() did not move it: next URL of -O FILE goes after us */
+	xlseek(G.output_fd, G.parallel_base + total, SEEK_SET);
+
+	G.got_clen = 1;
+	progress_meter(PROGRESS_END);
+	if (!(option_mask32 & WGET_OPT_QUIET))
+		fprintf(stderr, "'%s' saved\n", G.fname_out);
+}
+
+/* Returns number of connections to use, or 0 */
+static unsigned parallel_segments(void)
+{
+	struct stat st;
+	off_t max;
+
+	if (G.parallel < 2 || !G.accept_ranges
+	 || !G.got_clen || G.chunked || G.beg_range != 0
+	 || USR_HEADER_RANGE /* pieces would not be the range user asked for */
+	 || (option_mask32 & WGET_OPT_POST)
+	) {
+		return 0;
+	}
+	/* pwrite() needs a regular file */
+	if (fstat(G.output_fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+	/* -O FILE with several URLs: append after the previous ones */
+	G.parallel_base = lseek(G.output_fd, 0, SEEK_CUR);
+	if (G.parallel_base < 0)
+		return 0;
+	max = G.content_len / MIN_SEGMENT;
+	if (max < 2)
+		return 0;
+	return (max < G.parallel) ? (unsigned)max : G.parallel;
+}
+#endif
+
 static void download_one_url(const char *url)
 {
 	bool use_proxy;                 /* Use proxies if env vars are set  */
@@ -1103,6 +1508,9 @@ static void download_one_url(const char *url)
 	FILE *dfp;                      /* socket to ftp server (data)      */
 	char *fname_out_alloc;
 	char *redirected_path = NULL;
+	char *ka_key = NULL;            /* server_key() of server           */
+	smallint ka_conn;               /* connection opened to be kept     */
+	smallint reused;                /* connection left from previous URL */
 	struct host_info server;
 	struct host_info target;
 
@@ -1168,16 +1576,35 @@ static void download_one_url(const char *url)
 
 	redir_limit = 16;
  resolve_lsa:
+	free(ka_key);
+	ka_key = server_key(&server);
+	sfp = reuse_connection(ka_key);
+	if (sfp) {
+		if (!(option_mask32 & WGET_OPT_QUIET))
+			fprintf(stderr, "Reusing connection to %s\n", server.host);
+		lsa = NULL;
+		reused = ka_conn = 1;
+		goto establish_session;
+	}
 	lsa = xhost2sockaddr(server.host, server.port);
 	if (!(option_mask32 & WGET_OPT_QUIET)) {
 		char *s = xmalloc_sockaddr2dotted(&lsa->u.sa);
 		fprintf(stderr, "Connecting to %s (%s)\n", server.host, s);
 		free(s);
 	}
+ connect:
+	if (!lsa) /* reused connection did not need it */
+		lsa = xhost2sockaddr(server.host, server.port);
+	sfp = NULL;
+	reused = 0;
+	/* If more URLs follow, open the connection so that it can be kept */
+	ka_conn = G.more_urls;
  establish_session:
 	/*G.content_len = 0; - redundant, got_clen = 0 is enough */
 	G.got_clen = 0;
 	G.chunked = 0;
+	G.keepalive = 0;
+	G.accept_ranges = 0;
 	if (use_proxy || target.protocol[0] != 'f' /*not ftp[s]*/) {
 		/*
 		 *  HTTP session
@@ -1185,125 +1612,33 @@ static void download_one_url(const char *url)
 		char *str;
 		int status;
 
-		/* Open socket to http(s) server */
-#if ENABLE_FEATURE_WGET_OPENSSL
-		/* openssl (and maybe internal TLS) support is configured */
-		if (server.protocol == P_HTTPS) {
-			/* openssl-based helper
-			 * Inconvenient API since we can't give it an open fd
-			 */
-			int fd = spawn_https_helper_openssl(server.host, server.port);
-# if ENABLE_FEATURE_WGET_HTTPS
-			if (fd < 0) { /* no openssl? try internal */
-				sfp = open_socket(lsa);
-				spawn_ssl_client(server.host, fileno(sfp), /*flags*/ 0);
-				goto socket_opened;
-			}
-# else
-			/* We don't check for exec("openssl") failure in this case */
-# endif
-			sfp = fdopen(fd, "r+");
-			if (!sfp)
-				bb_die_memory_exhausted();
-			goto socket_opened;
-		}
-		sfp = open_socket(lsa);
- socket_opened:
-#elif ENABLE_FEATURE_WGET_HTTPS
-		/* Only internal TLS support is configured */
-		sfp = open_socket(lsa);
-		if (server.protocol == P_HTTPS)
-			spawn_ssl_client(server.host, fileno(sfp), /*flags*/ 0);
-#else
-		/* ssl (https) support is not configured */
-		sfp = open_socket(lsa);
-#endif
-		/* Send HTTP request */
-		if (use_proxy) {
-			SENDFMT(sfp, "GET %s://%s/%s HTTP/1.1\r\n",
-				target.protocol, target.host,
-				target.path);
-		} else {
-			SENDFMT(sfp, "%s /%s HTTP/1.1\r\n",
-				(option_mask32 & WGET_OPT_POST) ? "POST" : "GET",
-				target.path);
-		}
-		if (!USR_HEADER_HOST)
-			SENDFMT(sfp, "Host: %s\r\n", target.host);
-		if (!USR_HEADER_USER_AGENT)
-			SENDFMT(sfp, "User-Agent: %s\r\n", G.user_agent);
-
-		/* Ask server to close the connection as soon as we are done
-		 * (IOW: we do not intend to send more requests)
-		 */
-		SENDFMT(sfp, "Connection: close\r\n");
-
-#if ENABLE_FEATURE_WGET_AUTHENTICATION
-		if (target.user && !USR_HEADER_AUTH) {
-			SENDFMT(sfp, "Proxy-Authorization: Basic %s\r\n"+6,
-				base64enc(target.user));
-		}
-		if (use_proxy && server.user && !USR_HEADER_PROXY_AUTH) {
-			SENDFMT(sfp, "Proxy-Authorization: Basic %s\r\n",
-				base64enc(server.user));
-		}
-#endif
-
-		if (G.beg_range != 0 && !USR_HEADER_RANGE)
-			SENDFMT(sfp, "Range: bytes=%"OFF_FMT"u-\r\n", G.beg_range);
-
-#if ENABLE_FEATURE_WGET_LONG_OPTIONS
-		if (G.extra_headers) {
-			log_io(G.extra_headers);
-			fputs(G.extra_headers, sfp);
-		}
-
-		if (option_mask32 & WGET_OPT_POST_FILE) {
-			int fd = xopen_stdin(G.post_file);
-			G.post_data = xmalloc_read(fd, NULL);
-			close(fd);
-		}
-
-		if (G.post_data) {
-			/* If user did not override it... */
-			if (!USR_HEADER_CONTENT_TYPE) {
-				SENDFMT(sfp,
-					"Content-Type: application/x-www-form-urlencoded\r\n"
-				);
-			}
-			SENDFMT(sfp,
-				"Content-Length: %u\r\n"
-				"\r\n"
-				"%s",
-				(int) strlen(G.post_data), G.post_data
-			);
-		} else
-#endif
-		{
-			SENDFMT(sfp, "\r\n");
-		}
-
-		fflush(sfp);
-
-/* Tried doing this unconditionally.
- * Cloudflare and nginx/1.11.5 are shocked to see SHUT_WR on non-HTTPS.
- */
-#if SSL_SUPPORTED
-		if (target.protocol == P_HTTPS) {
-			/* If we use SSL helper, keeping our end of the socket open for writing
-			 * makes our end (i.e. the same fd!) readable (EAGAIN instead of EOF)
-			 * even after child closes its copy of the fd.
-			 * This helps:
-			 */
-			shutdown(fileno(sfp), SHUT_WR);
-		}
-#endif
+		if (!sfp)
+			sfp = open_http_socket(&server, lsa, ka_conn);
+		send_http_request(sfp, &server, &target, use_proxy, ka_conn);
 
 		/*
 		 * Retrieve HTTP response line and check for "200" status code.
 		 */
+		if (reused) {
+			/* Server may have closed idle connection just as we reused it.
+			 * If we get EOF before any response, retry on a new connection.
+			 */
+			int c;
+			set_alarm();
+			c = getc(sfp);
+			clear_alarm();
+			if (c == EOF) {
+				fclose(sfp);
+				goto connect;
+			}
+			ungetc(c, sfp);
+		}
  read_response:
 		fgets_trim_sanitize(sfp, "  %s\n");
+		/* Keep connection only if HTTP/1.1 server did not ask to close it
+		 * and we can find where the response ends
+		 */
+		G.keepalive = G.more_urls && is_prefixed_with(G.wget_buf, "HTTP/1.1 ");
 
 		str = G.wget_buf;
 		str = skip_non_whitespace(str);
@@ -1388,9 +1723,11 @@ However, in real world it was observed that some web servers
 		 */
 		while ((str = get_sanitized_hdr(sfp)) != NULL) {
 			static const char keywords[] ALIGN1 =
-				"content-length\0""transfer-encoding\0""location\0";
+				"content-length\0""transfer-encoding\0""location\0""connection\0"
+				IF_FEATURE_WGET_PARALLEL("accept-ranges\0");
 			enum {
-				KEY_content_length = 1, KEY_transfer_encoding, KEY_location
+				KEY_content_length = 1, KEY_transfer_encoding, KEY_location, KEY_connection,
+				KEY_accept_ranges
 			};
 			smalluint key;
 
@@ -1416,6 +1753,12 @@ However, in real world it was observed that some web servers
 					bb_error_msg_and_die("transfer encoding '%s' is not supported", str);
 				G.chunked = 1;
 			}
+			if (key == KEY_connection) {
+				if (strcasestr(str, "close"))
+					G.keepalive = 0;
+			}
+			if (key == KEY_accept_ranges)
+				G.accept_ranges = (strcmp(str, "bytes") == 0);
 			if (key == KEY_location && status >= 300) {
 				if (--redir_limit == 0)
 					bb_simple_error_msg_and_die("too many redirections");
@@ -1439,12 +1782,17 @@ However, in real world it was observed that some web servers
 						goto resolve_lsa;
 					} /* else: lsa stays the same: we use proxy */
 				}
-				goto establish_session;
+				goto connect;
 			}
 		}
 //		if (status >= 300)
 //			bb_error_msg_and_die("bad redirection (no Location: header from server)");
 
+		if (!G.got_clen && !G.chunked)
+			G.keepalive = 0; /* response ends at EOF */
+		if (option_mask32 & WGET_OPT_SPIDER)
+			G.keepalive = 0; /* we don't read the body */
+
 		/* For HTTP, data is pumped over the same connection */
 		dfp = sfp;
 	} else {
@@ -1456,11 +1804,22 @@ However, in real world it was observed that some web servers
 #endif
 	}
 
-	free(lsa);
-
 	if (!(option_mask32 & WGET_OPT_SPIDER)) {
+#if PARALLEL_SUPPORTED
+		unsigned n;
+#endif
 		if (G.output_fd < 0)
 			G.output_fd = xopen(G.fname_out, G.o_flags);
+#if PARALLEL_SUPPORTED
+		n = (dfp == sfp) ? parallel_segments() : 0;
+		if (n) {
+			if (!lsa) /* reused connection did not need it */
+				lsa = xhost2sockaddr(server.host, server.port);
+			retrieve_parallel(sfp, n, &server, &target, lsa, use_proxy);
+			/* First piece took this connection */
+			G.keepalive = 0;
+		} else
+#endif
 		retrieve_file_data(dfp);
 		if (!(option_mask32 & WGET_OPT_OUTNAME)) {
 			xclose(G.output_fd);
@@ -1480,8 +1839,16 @@ However, in real world it was observed that some web servers
 		/* ftpcmd("QUIT", NULL, sfp); - why bother? */
 	}
 #endif
-	fclose(sfp);
+	if (G.keepalive) {
+		G.ka_sfp = sfp;
+		G.ka_server = ka_key;
+		ka_key = NULL;
+	} else {
+		fclose(sfp);
+	}
+	free(lsa);
 
+	free(ka_key);
 	free(server.allocated);
 	free(target.allocated);
 	free(server.user);
@@ -1513,6 +1880,8 @@ IF_DESKTOP(	"tries\0"            Required_argument "t")
 		"spider\0"           No_argument       "\xfd"
 		"no-check-certificate\0" No_argument   "\xfc"
 		"post-file\0"        Required_argument "\xfb"
+IF_FEATURE_WGET_PARALLEL(
+		"parallel\0"         Required_argument "\xfa")
 		/* Ignored (we always use PASV): */
 IF_DESKTOP(	"passive-ftp\0"      No_argument       "\xf0")
 		/* Ignored (we don't support caching) */
@@ -1569,6 +1938,7 @@ IF_DESKTOP(	"no-parent\0"        No_argument       "\xf0")
 		IF_FEATURE_WGET_LONG_OPTIONS(, &headers_llist)
 		IF_FEATURE_WGET_LONG_OPTIONS(, &G.post_data)
 		IF_FEATURE_WGET_LONG_OPTIONS(, &G.post_file)
+		IF_FEATURE_WGET_PARALLEL(, &G.parallel_str)
 	);
 #if 0 /* option bits debug */
 	if (option_mask32 & WGET_OPT_RETRIES) bb_error_msg("-t NUM");
@@ -1582,6 +1952,10 @@ IF_DESKTOP(	"no-parent\0"        No_argument       "\xf0")
 #endif
 	argv += optind;
 
+#if ENABLE_FEATURE_WGET_PARALLEL
+	if (option_mask32 & WGET_OPT_PARALLEL)
+		G.parallel = xatou_range(G.parallel_str, 1, 64);
+#endif
 #if ENABLE_FEATURE_WGET_LONG_OPTIONS
 	if (headers_llist) {
 		int size = 0;
@@ -1635,8 +2009,10 @@ IF_DESKTOP(	"no-parent\0"        No_argument       "\xf0")
 		}
 	}
 
-	while (*argv)
+	while (*argv) {
+		G.more_urls = (argv[1] != NULL);
 		download_one_url(*argv++);
+	}
 
 	if (G.output_fd >= 0)
 		xclose(G.output_fd);
@@ -59,10 +59,12 @@
 //usage:#if ENABLE_DESKTOP
 //usage:
 //usage:#define ps_trivial_usage
-//usage:       "[-o COL1,COL2=HEADER]" IF_FEATURE_SHOW_THREADS(" [-T]")
+//usage:       "[-o COL1,COL2=HEADER] [-W[W]]" IF_FEATURE_SHOW_THREADS(" [-T]")
 //usage:#define ps_full_usage "\n\n"
 //usage:       "Show list of processes\n"
 //usage:     "\n	-o COL1,COL2=HEADER	Select columns for display"
+//usage:     "\n	-W			Separate columns with tab, no padding or truncation"
+//usage:     "\n	-WW			Separate columns with NUL"
 //usage:	IF_FEATURE_SHOW_THREADS(
 //usage:     "\n	-T			Show threads"
 //usage:	)
@@ -181,6 +183,9 @@ struct globals {
 	int need_flags;
 	char *buffer;
 	unsigned terminal_width;
+	/* -W: columns are separated by machine_sep, not padded */
+	smallint machine;
+	char machine_sep;
 #if ENABLE_FEATURE_PS_TIME
 # if ENABLE_FEATURE_PS_UNUSUAL_SYSTEMS || !defined(__linux__)
 	unsigned kernel_HZ;
@@ -247,30 +252,48 @@ static void func_args(char *buf, int size, const procps_status_t *ps)
 	read_cmdline(buf, size+1, ps->pid, ps->comm);
 }
 
+/* Same as sprintf(buf, "%*u"), but much faster. With -W, not padded */
+static void put_u(char *buf, int size, unsigned u)
+{
+	char *end = utoa_to_buf(u, buf, sizeof(u)*3 + 1);
+	int len = end - buf;
+
+	*end = '\0';
+	if (len < size && !G.machine) {
+		memmove(buf + size - len, buf, len + 1);
+		memset(buf, ' ', size - len);
+	}
+}
+
 static void func_pid(char *buf, int size, const procps_status_t *ps)
 {
-	sprintf(buf, "%*u", size, ps->pid);
+	put_u(buf, size, ps->pid);
 }
 
 static void func_ppid(char *buf, int size, const procps_status_t *ps)
 {
-	sprintf(buf, "%*u", size, ps->ppid);
+	put_u(buf, size, ps->ppid);
 }
 
 static void func_pgid(char *buf, int size, const procps_status_t *ps)
 {
-	sprintf(buf, "%*u", size, ps->pgid);
+	put_u(buf, size, ps->pgid);
 }
 
 static void func_sid(char *buf, int size, const procps_status_t *ps)
 {
-	sprintf(buf, "%*u", size, ps->sid);
+	put_u(buf, size, ps->sid);
 }
 
 static void put_lu(char *buf, int size, unsigned long u)
 {
 	char buf4[5];
 
+	if (G.machine) {
+		/* -W: exact number of kbytes, no "m"/"g" suffixes */
+		sprintf(buf, "%lu", u);
+		return;
+	}
 	/* see http://en.wikipedia.org/wiki/Tera */
 	smart_ulltoa4(u, buf4, " mgtpezy")[0] = '\0';
 	sprintf(buf, "%.*s", size, buf4);
@@ -305,7 +328,14 @@ static void func_ruser(char *buf, int size, const procps_status_t *ps)
 }
 static void func_nice(char *buf, int size, const procps_status_t *ps)
 {
-	sprintf(buf, "%*d", size, ps->niceness);
+	if (ps->niceness >= 0) {
+		put_u(buf, size, ps->niceness);
+		return;
+	}
+	put_u(buf + 1, size - 1, - ps->niceness);
+	/* put '-' right before the digits */
+	buf[0] = ' ';
+	buf[strspn(buf + 1, " ")] = '-';
 }
 #endif
 
@@ -314,6 +344,12 @@ static void format_time(char *buf, int size, unsigned long tt)
 {
 	unsigned ff;
 
+	if (G.machine) {
+		/* -W: plain number of seconds */
+		sprintf(buf, "%lu", tt);
+		return;
+	}
+
 	/* Used to show "14453:50" if tt is large. Ugly.
 	 * procps-ng 3.3.10 uses "[[dd-]hh:]mm:ss" format.
 	 * TODO: switch to that?
@@ -480,6 +516,12 @@ static void alloc_line_buffer(void)
 		if (out[i].header[0]) {
 			print_header = 1;
 		}
+		if (G.machine) {
+			/* No truncation, and no terminal width limit */
+			out[i].width = MAX_WIDTH;
+			width += MAX_WIDTH + 1;
+			continue;
+		}
 		width += out[i].width + 1; /* "FIELD " */
 		if ((int)(width - terminal_width) > 0) {
 			/* The rest does not fit on the screen */
@@ -505,6 +547,15 @@ static void format_header(void)
 		return;
 	p = buffer;
 	i = 0;
+	if (G.machine) {
+		for (i = 0; i < out_cnt; i++) {
+			p = stpcpy(p, out[i].header);
+			*p++ = G.machine_sep;
+		}
+		p[-1] = '\n';
+		fwrite(buffer, 1, p - buffer, stdout);
+		return;
+	}
 	if (out_cnt) {
 		while (1) {
 			op = &out[i];
@@ -533,12 +584,23 @@ static void format_process(const procps_status_t *ps)
 		}
 		len = strlen(p);
 		p += len;
-		len = out[i].width - len + 1;
 		if (++i == out_cnt) /* do not pad last field */
 			break;
-		p += sprintf(p, "%*s", len, " "); /* " ", not "", to ensure separation of fields */
+		if (G.machine) {
+			*p++ = G.machine_sep;
+			continue;
+		}
+		len = out[i-1].width - len + 1;
+		if (len <= 0)
+			len = 1; /* ensure separation of fields */
+		memset(p, ' ', len);
+		p += len;
 	}
-	printf("%.*s\n", terminal_width, buffer);
+	len = p - buffer;
+	if (!G.machine && len > terminal_width)
+		len = terminal_width;
+	buffer[len] = '\n';
+	fwrite(buffer, 1, len + 1, stdout);
 }
 
 #if ENABLE_SELINUX
@@ -566,8 +628,10 @@ int ps_main(int argc UNUSED_PARAM, char **argv)
 		OPT_e = (1 << 5),
 		OPT_f = (1 << 6),
 		OPT_l = (1 << 7),
-		OPT_T = (1 << 8) * ENABLE_FEATURE_SHOW_THREADS,
+		OPT_W = (1 << 8),
+		OPT_T = (1 << 9) * ENABLE_FEATURE_SHOW_THREADS,
 	};
+	unsigned W_count = 0;
 
 	INIT_G();
 #if ENABLE_FEATURE_PS_TIME
@@ -595,7 +659,12 @@ int ps_main(int argc UNUSED_PARAM, char **argv)
 #if ENABLE_SELINUX || ENABLE_FEATURE_SHOW_THREADS
 	opt =
 #endif
-		getopt32(argv, "Zo:*aAdefl"IF_FEATURE_SHOW_THREADS("T"), &opt_o);
+		getopt32(argv, "^" "Zo:*aAdeflW"IF_FEATURE_SHOW_THREADS("T") "\0" "WW",
+				&opt_o, &W_count);
+	if (W_count) {
+		G.machine = 1;
+		G.machine_sep = (W_count == 1) ? '\t' : '\0';
+	}
 
 	if (opt_o) {
 		do {
@@ -76,6 +76,14 @@ Ua.b.c.d[:port]
 pprefix
     tells svlogd to prefix each line to be written to the log directory,
     to standard error, or through UDP, with prefix.
+isize
+    (busybox extension) tells svlogd to record the time and offset
+    of a line start every size bytes in current.idx. On rotation
+    the index is finalized and renamed along with current,
+    to @timestamp.idx. svlogd -q uses these indexes to extract
+    the lines logged between two points in time without reading
+    the whole log. Files compressed by the processor are decompressed
+    on the fly, if busybox is built with seamless decompression.
 
 If a line starts with a -, +, e, or E, svlogd matches the first len characters
 of each log message against pattern and acts accordingly:
@@ -130,6 +138,16 @@ log message, you can use a pattern like this instead
 //config:	svlogd continuously reads log data from its standard input, optionally
 //config:	filters log messages, and writes the data to one or more automatically
 //config:	rotated logs.
+//config:
+//config:config FEATURE_SVLOGD_INDEX
+//config:	bool "Time index for log files (-q DIR FROM TO)"
+//config:	default y
+//config:	depends on SVLOGD
+//config:	help
+//config:	"iSIZE" line in DIR/config makes svlogd record the time
+//config:	of a line every SIZE bytes into an index which is kept
+//config:	next to each rotated log file. "svlogd -q DIR FROM TO"
+//config:	uses it to print the lines logged between FROM and TO.
 
 //applet:IF_SVLOGD(APPLET(svlogd, BB_DIR_USR_SBIN, BB_SUID_DROP))
 
@@ -137,6 +155,9 @@ log message, you can use a pattern like this instead
 
 //usage:#define svlogd_trivial_usage
 //usage:       "[-tttv] [-r C] [-R CHARS] [-l MATCHLEN] [-b BUFLEN] DIR..."
+//usage:	IF_FEATURE_SVLOGD_INDEX("\n"
+//usage:       "or: svlogd -q DIR FROM TO"
+//usage:	)
 //usage:#define svlogd_full_usage "\n\n"
 //usage:       "Read log data from stdin and write to rotated log files in DIRs"
 //usage:   "\n"
@@ -146,6 +167,9 @@ log message, you can use a pattern like this instead
 //usage:   "\n""	-tt	Timestamp with yyyy-mm-dd_hh:mm:ss.sssss"
 //usage:   "\n""	-ttt	Timestamp with yyyy-mm-ddThh:mm:ss.sssss"
 //usage:   "\n""	-v	Verbose"
+//usage:	IF_FEATURE_SVLOGD_INDEX(
+//usage:   "\n""	-q	Print lines logged from FROM to TO (UTC) using DIR's index"
+//usage:	)
 //usage:   "\n"
 //usage:   "\n""DIR/config file modifies behavior:"
 //usage:   "\n""sSIZE - when to rotate logs (default 1000000, 0 disables)"
@@ -153,6 +177,9 @@ log message, you can use a pattern like this instead
 ///////:   "\n""NNUM - min number files to retain" - confusing
 ///////:   "\n""tSEC - rotate file if it get SEC seconds old" - confusing
 //usage:   "\n""!PROG - process rotated log with PROG"
+//usage:	IF_FEATURE_SVLOGD_INDEX(
+//usage:   "\n""iSIZE - index time every SIZE bytes, for -q"
+//usage:	)
 ///////:   "\n""uIPADDR - send log over UDP" - unsupported
 ///////:   "\n""UIPADDR - send log over UDP and DONT log" - unsupported
 ///////:   "\n""pPFX - prefix each line with PFX" - unsupported
@@ -172,6 +199,12 @@ struct logdir {
 	////char *btmp;
 	/* pattern list to match, in "aa\0bb\0\cc\0\0" form */
 	char *inst;
+	/* same patterns, last one first (NULL terminated):
+	 * the last matching pattern wins, so we can stop at the first hit */
+	char **pat;
+	unsigned inst_len;
+	/* earlier logdir with identical patterns (its result is reused), or -1 */
+	int same_as;
 	char *processor;
 	char *name;
 	unsigned size;
@@ -185,11 +218,29 @@ struct logdir {
 	FILE* filecur; ////
 	int fdlock;
 	unsigned next_rotate;
+#if ENABLE_FEATURE_SVLOGD_INDEX
+	unsigned idx_every;
+	unsigned idx_next;
+	int fdidx;
+	smallint idx_bol; /* next write starts a line */
+#endif
 	char fnsave[FMT_PTIME];
 	char match;
 	char matcherr;
 };
 
+#if ENABLE_FEATURE_SVLOGD_INDEX
+/* Index record: lines starting at offset or later
+ * were written at sec or later. Big-endian, same as tai64n.
+ * The final record of a rotated log is (time of rotation, size).
+ */
+struct svlogd_idx {
+	uint32_t sec;
+	uint32_t offset;
+};
+#define IDX_SUFFIX ".idx"
+#endif
+
 
 struct globals {
 	struct logdir *dir;
@@ -205,6 +256,8 @@ struct globals {
 
 	void* (*memRchr)(const void *, int, size_t);
 	char *shell;
+	/* bitmap of chars -r/-R replace */
+	uint8_t repl_map[256 / 8];
 
 	smallint exitasap;
 	smallint rotateasap;
@@ -505,6 +558,72 @@ static unsigned processorstop(struct logdir *ld)
 	return 1;
 }
 
+#if ENABLE_FEATURE_SVLOGD_INDEX
+/* Both of these run with cwd == log directory */
+static void index_open(struct logdir *ld)
+{
+	ld->fdidx = -1;
+	if (!ld->idx_every) {
+		/* indexing was turned off: do not keep a stale one */
+		unlink("current"IDX_SUFFIX);
+		return;
+	}
+	ld->fdidx = open("current"IDX_SUFFIX, O_WRONLY|O_NDELAY|O_APPEND|O_CREAT, 0644);
+	if (ld->fdidx == -1) {
+		warn2("can't open current"IDX_SUFFIX, ld->name);
+		return;
+	}
+	close_on_exec_on(ld->fdidx);
+	ld->idx_next = ld->size;
+	ld->idx_bol = 1;
+}
+
+/* Rename current.idx to match the name of a just rotated log */
+static void index_rename(const char *fnsave)
+{
+	char f[FMT_PTIME];
+
+	memcpy(f, fnsave, 25);
+	strcpy(f + 25, IDX_SUFFIX);
+	if (rename("current"IDX_SUFFIX, f) == -1 && errno != ENOENT)
+		warn2("can't rename index to", f);
+}
+
+static void index_add(struct logdir *ld)
+{
+	struct svlogd_idx rec;
+
+	rec.sec = htonl(time(NULL));
+	rec.offset = htonl(ld->size);
+	if (full_write(ld->fdidx, &rec, sizeof(rec)) != sizeof(rec))
+		warn2("can't write index", ld->name);
+	ld->idx_next = ld->size + ld->idx_every;
+}
+
+static void index_close(struct logdir *ld)
+{
+	if (ld->fdidx >= 0) {
+		close(ld->fdidx);
+		ld->fdidx = -1;
+	}
+}
+
+/* Remove the index of logfile fn (may be missing) */
+static void index_unlink(const char *fn)
+{
+	char f[FMT_PTIME];
+
+	memcpy(f, fn, 25);
+	strcpy(f + 25, IDX_SUFFIX);
+	unlink(f);
+}
+#else
+# define index_open(ld)       ((void)0)
+# define index_rename(fn)     ((void)0)
+# define index_close(ld)      ((void)0)
+# define index_unlink(fn)     ((void)0)
+#endif
+
 static void rmoldest(struct logdir *ld)
 {
 	DIR *d;
@@ -536,8 +655,11 @@ static void rmoldest(struct logdir *ld)
 	if (ld->nmax && (n > ld->nmax)) {
 		if (verbose)
 			bb_error_msg(INFO"delete: %s/%s", ld->name, oldest);
-		if ((*oldest == '@') && (unlink(oldest) == -1))
-			warn2("can't unlink oldest logfile", ld->name);
+		if (*oldest == '@') {
+			if (unlink(oldest) == -1)
+				warn2("can't unlink oldest logfile", ld->name);
+			index_unlink(oldest);
+		}
 	}
 }
 
@@ -590,6 +712,13 @@ static unsigned rotate(struct logdir *ld)
 		}
 		while (rename("current", ld->fnsave) == -1)
 			pause2cannot("rename current", ld->name);
+#if ENABLE_FEATURE_SVLOGD_INDEX
+		if (ld->fdidx >= 0) {
+			index_add(ld); /* final record: end time, size */
+			index_close(ld);
+			index_rename(ld->fnsave);
+		}
+#endif
 		while ((ld->fdcur = open("current", O_WRONLY|O_NDELAY|O_APPEND|O_CREAT, 0600)) == -1)
 			pause2cannot("create new current", ld->name);
 		while ((ld->filecur = fdopen(ld->fdcur, "a")) == NULL) ////
@@ -599,6 +728,7 @@ static unsigned rotate(struct logdir *ld)
 		ld->size = 0;
 		while (fchmod(ld->fdcur, 0644) == -1)
 			pause2cannot("set mode of current", ld->name);
+		index_open(ld);
 
 		rmoldest(ld);
 		processorstart(ld);
@@ -620,6 +750,10 @@ static int buffer_pwrite(int n, char *s, unsigned len)
 		if (len > (ld->sizemax - ld->size))
 			len = ld->sizemax - ld->size;
 	}
+#if ENABLE_FEATURE_SVLOGD_INDEX
+	if (ld->fdidx >= 0 && ld->idx_bol && ld->size >= ld->idx_next)
+		index_add(ld);
+#endif
 	while (1) {
 		////i = full_write(ld->fdcur, s, len);
 		////if (i != -1) break;
@@ -660,6 +794,7 @@ static int buffer_pwrite(int n, char *s, unsigned len)
 						warn2("can't unlink oldest logfile", ld->name);
 						errno = ENOSPC;
 					}
+					index_unlink(oldest);
 					while (fchdir(fdwdir) == -1)
 						pause1cannot("change to initial working directory");
 				}
@@ -670,6 +805,9 @@ static int buffer_pwrite(int n, char *s, unsigned len)
 	}
 
 	ld->size += i;
+#if ENABLE_FEATURE_SVLOGD_INDEX
+	ld->idx_bol = (s[i-1] == '\n');
+#endif
 	if (ld->sizemax)
 		if (s[i-1] == '\n')
 			if (ld->size >= (ld->sizemax - linemax))
@@ -694,6 +832,7 @@ static void logdir_close(struct logdir *ld)
 	////close(ld->fdcur);
 	fclose(ld->filecur);
 	ld->fdcur = -1;
+	index_close(ld);
 	if (ld->fdlock == -1)
 		return; /* impossible */
 	close(ld->fdlock);
@@ -739,10 +878,12 @@ static NOINLINE unsigned logdir_open(struct logdir *ld, const char *fn)
 	ld->sizemax = 1000000;
 	ld->nmax = ld->nmin = 10;
 	ld->rotate_period = 0;
+	IF_FEATURE_SVLOGD_INDEX(ld->idx_every = 0;)
 	ld->name = (char*)fn;
 	ld->ppid = 0;
 	ld->match = '+';
 	free(ld->inst); ld->inst = NULL;
+	free(ld->pat); ld->pat = NULL;
 	free(ld->processor); ld->processor = NULL;
 
 	/* read config */
@@ -784,6 +925,11 @@ static NOINLINE unsigned logdir_open(struct logdir *ld, const char *fn)
 			case 'n':
 				ld->nmax = xatoi_positive(&s[1]);
 				break;
+#if ENABLE_FEATURE_SVLOGD_INDEX
+			case 'i':
+				ld->idx_every = xatou_sfx(&s[1], km_suffixes);
+				break;
+#endif
 			case 'N':
 				ld->nmin = xatoi_positive(&s[1]);
 				break;
@@ -813,13 +959,28 @@ static NOINLINE unsigned logdir_open(struct logdir *ld, const char *fn)
 			s = np;
 		}
 		/* Convert "aa\nbb\ncc\n\0" to "aa\0bb\0cc\0\0" */
+		i = 0;
 		s = ld->inst;
 		while (s) {
 			np = strchr(s, '\n');
-			if (np)
+			if (np) {
 				*np++ = '\0';
+				i++;
+			}
 			s = np;
 		}
+		if (ld->inst) {
+			/* Make reversed pattern vector */
+			while (!(ld->pat = malloc((i + 1) * sizeof(ld->pat[0]))))
+				pause_nomem();
+			ld->pat[i] = NULL;
+			s = ld->inst;
+			while (*s) {
+				ld->pat[--i] = s;
+				s += strlen(s) + 1;
+			}
+			ld->inst_len = s - ld->inst;
+		}
 	}
 
 	/* open current */
@@ -836,6 +997,8 @@ static NOINLINE unsigned logdir_open(struct logdir *ld, const char *fn)
 			} while (errno != ENOENT);
 			while (rename("current", ld->fnsave) == -1)
 				pause2cannot("rename current", ld->name);
+			/* it has no final record, but is still usable */
+			index_rename(ld->fnsave);
 			rmoldest(ld);
 			i = -1;
 		} else {
@@ -862,6 +1025,7 @@ static NOINLINE unsigned logdir_open(struct logdir *ld, const char *fn)
 	close_on_exec_on(ld->fdcur);
 	while (fchmod(ld->fdcur, 0644) == -1)
 		pause2cannot("set mode of current", ld->name);
+	index_open(ld);
 
 	if (verbose) {
 		if (i == 0) bb_error_msg(INFO"append: %s/current", ld->name);
@@ -886,6 +1050,25 @@ static void logdirs_reopen(void)
 	}
 	if (!ok)
 		fatalx("no functional log directories");
+
+	/* Often many logdirs share the same filter: match only once */
+	for (l = 0; l < dirn; ++l) {
+		struct logdir *ld = &dir[l];
+		int j;
+
+		ld->same_as = -1;
+		if (ld->fddir == -1 || !ld->inst)
+			continue;
+		for (j = 0; j < l; ++j) {
+			if (dir[j].fddir != -1 && dir[j].inst
+			 && dir[j].inst_len == ld->inst_len
+			 && memcmp(dir[j].inst, ld->inst, ld->inst_len) == 0
+			) {
+				ld->same_as = dir[j].same_as >= 0 ? dir[j].same_as : j;
+				break;
+			}
+		}
+	}
 }
 
 /* Will look good in libbb one day */
@@ -964,20 +1147,9 @@ static int buffer_pread(/*int fd, */char *s, unsigned len)
 
 		cnt = i;
 		while (--cnt >= 0) {
-			char ch = *s;
-			if (ch != '\n') {
-				if (ch < 32 || ch > 126)
-					*s = repl;
-				else {
-					int j;
-					for (j = 0; replace[j]; ++j) {
-						if (ch == replace[j]) {
-							*s = repl;
-							break;
-						}
-					}
-				}
-			}
+			unsigned char ch = *s;
+			if (G.repl_map[ch >> 3] & (1 << (ch & 7)))
+				*s = repl;
 			s++;
 		}
 	}
@@ -1025,27 +1197,184 @@ static void sig_hangup_handler(int sig_no UNUSED_PARAM)
 
 static void logmatch(struct logdir *ld, char* lineptr, int lineptr_len)
 {
-	char *s;
+	char **pp;
+	char match = 0;
+	char matcherr = 0;
 
-	ld->match = '+';
-	ld->matcherr = 'E';
-	s = ld->inst;
-	while (s && s[0]) {
+	/* Patterns are in reverse order: first hit of each kind is final */
+	for (pp = ld->pat; *pp; pp++) {
+		char *s = *pp;
 		switch (s[0]) {
 		case '+':
 		case '-':
-			if (pmatch(s+1, lineptr, lineptr_len))
-				ld->match = s[0];
+			if (!match && pmatch(s+1, lineptr, lineptr_len))
+				match = s[0];
 			break;
 		case 'e':
 		case 'E':
-			if (pmatch(s+1, lineptr, lineptr_len))
-				ld->matcherr = s[0];
+			if (!matcherr && pmatch(s+1, lineptr, lineptr_len))
+				matcherr = s[0];
+			break;
+		}
+		if (match && matcherr)
 			break;
+	}
+	ld->match = match ? match : '+';
+	ld->matcherr = matcherr ? matcherr : 'E';
+}
+
+#if ENABLE_FEATURE_SVLOGD_INDEX
+static uint32_t parse_query_time(const char *str)
+{
+	struct tm tm;
+	time_t t;
+
+	time(&t);
+	localtime_r(&t, &tm);
+	if (parse_datestr(str, &tm))
+		tm.tm_isdst = -1;
+	return validate_tm_time(str, &tm);
+}
+
+/* Time of the first record, or 0 if index is empty */
+static uint32_t index_first_time(const char *fn)
+{
+	struct svlogd_idx rec;
+
+	if (open_read_close(fn, &rec, sizeof(rec)) != sizeof(rec))
+		return 0;
+	return ntohl(rec.sec);
+}
+
+/* Index of the first record with sec >= t, n if none */
+static unsigned index_search(const struct svlogd_idx *idx, unsigned n, uint32_t t)
+{
+	unsigned lo = 0;
+
+	while (lo < n) {
+		unsigned mid = (lo + n) / 2;
+		if (ntohl(idx[mid].sec) < t)
+			lo = mid + 1;
+		else
+			n = mid;
+	}
+	return lo;
+}
+
+static int cmpstringp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/* Print part of log (file fn) which is between offsets start and end.
+ * end == -1: to EOF */
+static void print_log_part(const char *fn, off_t start, off_t end)
+{
+	int fd;
+
+	/* Processor could have compressed it: if so,
+	 * we get a pipe from decompressor and can't seek */
+	fd = open_zipped(fn, /*fail_if_not_compressed:*/ 0);
+	if (fd < 0) {
+		bb_perror_msg(WARNING"%s", fn);
+		return;
+	}
+	if (start && lseek(fd, start, SEEK_SET) != start)
+		bb_copyfd_size(fd, -1, start);
+	if (end < 0)
+		bb_copyfd_eof(fd, STDOUT_FILENO);
+	else
+		bb_copyfd_size(fd, STDOUT_FILENO, end - start);
+	close(fd);
+}
+
+/* svlogd -q DIR FROM TO */
+static int svlogd_query(char **argv)
+{
+	DIR *d;
+	struct dirent *f;
+	char **seg = NULL;
+	unsigned segn = 0;
+	unsigned lo, hi;
+	uint32_t from, to;
+
+	/* svlogd timestamps (-tt) are in UTC, use the same for FROM/TO */
+	putenv((char*)"TZ=UTC0");
+	tzset();
+	from = parse_query_time(argv[1]);
+	to = parse_query_time(argv[2]);
+	xchdir(argv[0]);
+
+	/* Collect indexes, they sort chronologically by name */
+	d = xopendir(".");
+	while ((f = readdir(d)) != NULL) {
+		if (f->d_name[0] == '@'
+		 && strlen(f->d_name) == 25 + sizeof(IDX_SUFFIX)-1
+		 && strcmp(f->d_name + 25, IDX_SUFFIX) == 0
+		) {
+			seg = xrealloc_vector(seg, 4, segn);
+			seg[segn++] = xstrdup(f->d_name);
 		}
-		s += strlen(s) + 1;
 	}
+	closedir(d);
+	qsort(seg, segn, sizeof(seg[0]), cmpstringp);
+	seg = xrealloc_vector(seg, 4, segn);
+	seg[segn++] = (char*)"current"IDX_SUFFIX;
+
+	/* Find the last log which has its first record before FROM:
+	 * earlier ones can't have anything we need */
+	lo = 0;
+	hi = segn;
+	while (hi - lo > 1) {
+		unsigned mid = (lo + hi) / 2;
+		uint32_t t = index_first_time(seg[mid]);
+		if (t == 0 || t >= from) /* empty index: be conservative */
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	for (; lo < segn; lo++) {
+		struct svlogd_idx *idx;
+		size_t size = INT_MAX;
+		unsigned n, i;
+		off_t start, end;
+		char *fn;
+
+		idx = xmalloc_open_read_close(seg[lo], &size);
+		if (!idx)
+			continue; /* no current.idx */
+		n = size / sizeof(idx[0]);
+		if (n == 0 || ntohl(idx[0].sec) > to) {
+			free(idx);
+			if (n == 0)
+				continue;
+			break; /* this and all later logs are too new */
+		}
+		/* lines before the last record with sec < FROM are older */
+		i = index_search(idx, n, from);
+		start = i ? ntohl(idx[i-1].offset) : 0;
+		/* lines after the first record with sec > TO are newer */
+		i = index_search(idx, n, to + 1);
+		end = i < n ? ntohl(idx[i].offset) : -1;
+		free(idx);
+		if (end >= 0 && end <= start)
+			continue;
+
+		if (seg[lo][0] == '@') {
+			fn = xstrdup(seg[lo]);
+			strcpy(fn + 25, ".s");
+			if (access(fn, F_OK) != 0)
+				fn[26] = 'u'; /* processor did not finish yet */
+		} else {
+			fn = xstrdup("current");
+		}
+		print_log_part(fn, start, end);
+		free(fn);
+	}
+	return EXIT_SUCCESS;
 }
+#endif
 
 int svlogd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int svlogd_main(int argc, char **argv)
@@ -1059,15 +1388,32 @@ int svlogd_main(int argc, char **argv)
 	INIT_G();
 
 	opt = getopt32(argv, "^"
-			"r:R:l:b:tv" "\0" "tt:vv",
+			"r:R:l:b:tv" IF_FEATURE_SVLOGD_INDEX("q") "\0" "tt:vv",
 			&r, &replace, &l, &b, &timestamp, &verbose
 	);
+#if ENABLE_FEATURE_SVLOGD_INDEX
+	if (opt & 0x40) { // -q
+		if (argc - optind != 3)
+			bb_show_usage();
+		return svlogd_query(argv + optind);
+	}
+#endif
 	if (opt & 1) { // -r
 		repl = r[0];
 		if (!repl || r[1])
 			bb_show_usage();
 	}
 	if (opt & 2) if (!repl) repl = '_'; // -R
+	if (repl) {
+		const char *p;
+		/* Non-printables and -R CHARS, but never '\n' */
+		for (i = 0; i < 256; i++)
+			if (i < 32 || i > 126)
+				G.repl_map[i >> 3] |= 1 << (i & 7);
+		for (p = replace; *p; p++)
+			G.repl_map[(unsigned char)*p >> 3] |= 1 << ((unsigned char)*p & 7);
+		G.repl_map['\n' >> 3] &= ~(1 << ('\n' & 7));
+	}
 	if (opt & 4) { // -l
 		linemax = xatou_range(l, 0, COMMON_BUFSIZE-26);
 		if (linemax == 0)
@@ -1095,6 +1441,7 @@ int svlogd_main(int argc, char **argv)
 	for (i = 0; i < dirn; ++i) {
 		dir[i].fddir = -1;
 		dir[i].fdcur = -1;
+		IF_FEATURE_SVLOGD_INDEX(dir[i].fdidx = -1;)
 		////dir[i].btmp = xmalloc(buflen);
 		/*dir[i].ppid = 0;*/
 	}
@@ -1194,6 +1541,10 @@ int svlogd_main(int argc, char **argv)
 			struct logdir *ld = &dir[i];
 			if (ld->fddir == -1)
 				continue;
+			if (ld->same_as >= 0) {
+				ld->match = dir[ld->same_as].match;
+				ld->matcherr = dir[ld->same_as].matcherr;
+			} else
 			if (ld->inst)
 				logmatch(ld, lineptr, linelen);
 			if (ld->matcherr == 'e') {
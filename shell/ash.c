@@ -151,6 +151,42 @@
 // * sleep_main() must not allocate anything as ^C in ash longjmp's.
 //   (currently, allocations are only on error paths, in message printing).
 //
+//config:config ASH_BACKQ_NOFORK
+//config:	bool "Run simple $(cmd) without forking"
+//config:	default y
+//config:	depends on SHELL_ASH
+//config:	help
+//config:	Command substitutions which consist of a single builtin
+//config:	which does not change shell state (echo, printf, test, pwd...)
+//config:	or, with FEATURE_SH_NOFORK, a NOFORK applet (basename, cat...)
+//config:	are run in the shell itself, their output is collected
+//config:	in a memory file (memfd). Saves a fork+wait per $(cmd).
+//config:
+//config:config ASH_VFORK_EXEC
+//config:	bool "Start external commands with vfork()"
+//config:	default y
+//config:	depends on SHELL_ASH
+//config:	help
+//config:	When the shell is not interactive, has no traps set and
+//config:	job control is off, external commands are started with
+//config:	vfork()+execve() instead of fork(). fork() has to copy
+//config:	the page tables of the shell, which gets slow when the shell
+//config:	has grown large (big scripts, many functions and variables).
+//config:
+//config:config ASH_PARSE_CACHE
+//config:	bool "Cache parse trees of scripts ($ASH_PARSE_CACHE)"
+//config:	default n
+//config:	depends on SHELL_ASH
+//config:	help
+//config:	If $ASH_PARSE_CACHE is set to a directory, the parse trees of
+//config:	a script (or a file read with ".", or a profile) are saved
+//config:	there once the file has been read to the end. When the same
+//config:	file is read again, the trees are loaded from the cache
+//config:	instead of parsing the file. Cache entries are keyed by
+//config:	device, inode, size and mtime of the file and by the shell
+//config:	version, and are only used if owned by the current user.
+//config:	Speeds up startup when large function libraries are sourced.
+//config:
 //config:config ASH_HELP
 //config:	bool "help builtin"
 //config:	default y
@@ -177,7 +213,7 @@
 //applet:IF_SH_IS_ASH(  APPLET_ODDNAME(sh,   ash, BB_DIR_BIN, BB_SUID_DROP, ash))
 //applet:IF_BASH_IS_ASH(APPLET_ODDNAME(bash, ash, BB_DIR_BIN, BB_SUID_DROP, ash))
 
-//kbuild:lib-$(CONFIG_SHELL_ASH) += ash.o ash_ptr_hack.o shell_common.o
+//kbuild:lib-$(CONFIG_SHELL_ASH) += ash.o ash_ptr_hack.o match.o shell_common.o
 //kbuild:lib-$(CONFIG_ASH_RANDOM_SUPPORT) += random.o
 
 /*
@@ -200,6 +236,9 @@
 #include <fnmatch.h>
 #include <sys/times.h>
 #include <sys/utsname.h> /* for setting $HOSTNAME */
+#if ENABLE_ASH_BACKQ_NOFORK
+# include <sys/syscall.h> /* for __NR_memfd_create */
+#endif
 #include "busybox.h" /* for applet_names */
 #if ENABLE_FEATURE_SH_EMBEDDED_SCRIPTS
 # include "embedded_scripts.h"
@@ -278,6 +317,7 @@
 
 #include "unicode.h"
 #include "shell_common.h"
+#include "match.h"
 #if ENABLE_FEATURE_SH_MATH
 # include "math.h"
 #else
@@ -322,9 +362,22 @@ typedef long arith_t;
 
 /* ============ Hash table sizes. Configurable. */
 
-#define VTABSIZE 39
+/* Variable and command tables start this big (must be power of 2)
+ * and double when they hold more entries than buckets */
+#define VTABSIZE 64
 #define ATABSIZE 39
-#define CMDTABLESIZE 31         /* should be prime */
+#define CMDTABLESIZE 32
+
+/* FNV-1a. Stops at '=': "NAME=value" hashes the same as "NAME" */
+static unsigned
+hash_name(const char *p)
+{
+	unsigned hashval = 2166136261;
+
+	while (*p && *p != '=')
+		hashval = (hashval ^ (unsigned char)*p++) * 16777619;
+	return hashval;
+}
 
 
 /* ============ Shell options */
@@ -629,6 +682,10 @@ struct parsefile {
 
 	/* Number of outstanding calls to pungetc. */
 	int unget;
+#if ENABLE_ASH_PARSE_CACHE
+	struct pcache *pcache;         /* commands loaded from the cache */
+	struct pcache_new *pcache_new; /* commands to be saved to the cache */
+#endif
 };
 
 static struct parsefile basepf;        /* top level input file */
@@ -907,12 +964,31 @@ static const char dolatstr[] ALIGN1 = {
 
 union node;
 
+/* Result of find_command() */
+struct cmdentry {
+	smallint cmdtype;       /* CMDxxx */
+	union param {
+		int index;
+		/* index >= 0 for commands without path (slashes) */
+		/* (TODO: what exactly does the value mean? PATH position?) */
+		/* index == -1 for commands with slashes */
+		/* index == (-2 - applet_no) for NOFORK applets */
+		const struct builtincmd *cmd;
+		struct funcnode *func;
+	} u;
+};
+
 struct ncmd {
 	smallint type; /* Nxxxx */
 	int linno;
 	union node *assign;
 	union node *args;
 	union node *redirect;
+	/* If the command name is a plain word, evalcommand() remembers
+	 * what it resolved to. Valid while cmdgen == cmdtable_gen */
+	unsigned cmdgen;
+	struct cmdentry cmdfirst;
+	struct cmdentry cmdentry;
 };
 
 struct npipe {
@@ -972,6 +1048,7 @@ struct ndefun {
 
 struct narg {
 	smallint type;
+	smallint literal; /* 0: not checked yet, 1: plain text, -1: not */
 	union node *next;
 	char *text;
 	struct nodelist *backquote;
@@ -2188,7 +2265,9 @@ struct globals_var {
 	struct shparam shellparam;      /* $@ current positional parameters */
 	struct redirtab *redirlist;
 	int preverrout_fd;   /* stderr fd: usually 2, unless redirect moved it */
-	struct var *vartab[VTABSIZE];
+	struct var **vartab;
+	unsigned vartab_mask;           /* size - 1 */
+	unsigned nvars;
 	struct var varinit[ARRAY_SIZE(varinit_data)];
 	int lineno;
 	char linenovar[sizeof("LINENO=") + sizeof(int)*3];
@@ -2203,6 +2282,8 @@ extern struct globals_var *BB_GLOBAL_CONST ash_ptr_to_globals_var;
 //#define redirlist     (G_var.redirlist    )
 #define preverrout_fd (G_var.preverrout_fd)
 #define vartab        (G_var.vartab       )
+#define vartab_mask   (G_var.vartab_mask  )
+#define nvars         (G_var.nvars        )
 #define varinit       (G_var.varinit      )
 #define lineno        (G_var.lineno       )
 #define linenovar     (G_var.linenovar    )
@@ -2237,6 +2318,8 @@ extern struct globals_var *BB_GLOBAL_CONST ash_ptr_to_globals_var;
 #define INIT_G_var() do { \
 	unsigned i; \
 	XZALLOC_CONST_PTR(&ash_ptr_to_globals_var, sizeof(G_var)); \
+	vartab = xzalloc(VTABSIZE * sizeof(vartab[0])); \
+	vartab_mask = VTABSIZE - 1; \
 	for (i = 0; i < ARRAY_SIZE(varinit_data); i++) { \
 		varinit[i].flags    = varinit_data[i].flags; \
 		varinit[i].var_text = varinit_data[i].var_text; \
@@ -2285,12 +2368,39 @@ getoptsreset(const char *value)
 static struct var **
 hashvar(const char *p)
 {
-	unsigned hashval;
+	return &vartab[hash_name(p) & vartab_mask];
+}
 
-	hashval = ((unsigned char) *p) << 4;
-	while (*p && *p != '=')
-		hashval += (unsigned char) *p++;
-	return &vartab[hashval % VTABSIZE];
+/*
+ * Add a new variable. Keeps chains short by doubling the table
+ * when there are more variables than buckets.
+ * Called with interrupts off.
+ */
+static void
+addvar(struct var *vp)
+{
+	struct var **vpp;
+
+	if (++nvars > vartab_mask) {
+		struct var **old = vartab;
+		unsigned i, oldsize = vartab_mask + 1;
+
+		vartab_mask = oldsize * 2 - 1;
+		vartab = ckzalloc(oldsize * 2 * sizeof(vartab[0]));
+		for (i = 0; i < oldsize; i++) {
+			struct var *v, *next;
+			for (v = old[i]; v; v = next) {
+				next = v->next;
+				vpp = hashvar(v->var_text);
+				v->next = *vpp;
+				*vpp = v;
+			}
+		}
+		free(old);
+	}
+	vpp = hashvar(vp->var_text);
+	vp->next = *vpp;
+	*vpp = vp;
 }
 
 static int
@@ -2307,7 +2417,6 @@ initvar(void)
 {
 	struct var *vp;
 	struct var *end;
-	struct var **vpp;
 
 	/*
 	 * PS1 depends on uid
@@ -2321,9 +2430,7 @@ initvar(void)
 	vp = varinit;
 	end = vp + ARRAY_SIZE(varinit);
 	do {
-		vpp = hashvar(vp->var_text);
-		vp->next = *vpp;
-		*vpp = vp;
+		addvar(vp);
 	} while (++vp < end);
 }
 
@@ -2440,6 +2547,7 @@ setvareq(char *s, int flags)
 		if (((flags & (VEXPORT|VREADONLY|VSTRFIXED|VUNSET)) | (vp->flags & VSTRFIXED)) == VUNSET) {
 			*vpp = vp->next;
 			free(vp);
+			nvars--;
  out_free:
 			if ((flags & (VTEXTFIXED|VSTACK|VNOSAVE)) == VNOSAVE)
 				free(s);
@@ -2458,9 +2566,13 @@ setvareq(char *s, int flags)
 		if ((flags & (VEXPORT|VREADONLY|VSTRFIXED|VUNSET)) == VUNSET)
 			goto out_free;
 		vp = ckzalloc(sizeof(*vp));
-		vp->next = *vpp;
 		/*vp->func = NULL; - ckzalloc did it */
-		*vpp = vp;
+		if (!(flags & (VTEXTFIXED|VSTACK|VNOSAVE)))
+			s = ckstrdup(s);
+		vp->var_text = s;
+		vp->flags = flags;
+		addvar(vp);
+		goto out;
 	}
 	if (!(flags & (VTEXTFIXED|VSTACK|VNOSAVE)))
 		s = ckstrdup(s);
@@ -2568,7 +2680,7 @@ listvars(int on, int off, struct strlist *lp, char ***end)
 #endif
 			}
 		}
-	} while (++vpp < vartab + VTABSIZE);
+	} while (++vpp <= vartab + vartab_mask);
 
 #if ENABLE_FEATURE_SH_NOFORK
 	while (lp) {
@@ -5349,6 +5461,82 @@ forkshell(struct job *jp, union node *n, int mode)
 	return pid;
 }
 
+#if ENABLE_ASH_VFORK_EXEC
+/* Start an external command with vfork()+execve(). The child shares
+ * our memory and does nothing but reset signal dispositions and exec.
+ * Returns 0 if this is not possible (job control, traps...)
+ * or if exec failed: then the caller falls back to forkshell(),
+ * which does full child setup, runs ENOEXEC scripts and reports errors.
+ */
+static NOINLINE int
+vforkexec(struct job *jp, union node *n, char **argv, const char *path, int idx)
+{
+	static int exec_errno;
+	const char *cmdname;
+	char **envp;
+	sigset_t all, old;
+	int pid;
+
+	if (jp->jobctl || iflag || mflag || may_have_traps)
+		return 0;
+#if ENABLE_FEATURE_SH_STANDALONE
+	if (find_applet_by_name(argv[0]) >= 0)
+		return 0;
+#endif
+	envp = listvars(VEXPORT, VUNSET, /*strlist:*/ NULL, /*end:*/ NULL);
+	cmdname = argv[0];
+	if (!strchr(cmdname, '/')) {
+		/* Same search as in shellexec() */
+		if (idx < 0)
+			return 0;
+		do {
+			if (padvance(&path, argv[0]) < 0)
+				return 0;
+		} while (--idx >= 0);
+		if (pathopt)
+			return 0;
+		cmdname = stackblock();
+	}
+
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &old);
+	exec_errno = 0;
+	pid = vfork();
+	if (pid == 0) {
+		/* Child */
+		int sig;
+
+		/* What forkchild() would do: caught signals and those
+		 * we ignore ourself (SIGQUIT...) go to default,
+		 * but trap '' SIG must be inherited as ignored.
+		 */
+		for (sig = 1; sig < NSIG; sig++) {
+			if (sigmode[sig - 1] == S_CATCH
+			 || (sigmode[sig - 1] == S_IGN
+			    && !(trap[sig] && !trap[sig][0]))
+			) {
+				signal(sig, SIG_DFL);
+			}
+		}
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		execve(cmdname, argv, envp);
+		exec_errno = errno;
+		_exit(127);
+	}
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	if (pid < 0)
+		return 0;
+	if (exec_errno) {
+		waitpid(pid, NULL, 0);
+		return 0;
+	}
+	forkparent(jp, n, FORK_FG, pid);
+	return pid;
+}
+#else
+# define vforkexec(jp, n, argv, path, idx) 0
+#endif
+
 /*
  * Wait for job to finish.
  *
@@ -6233,17 +6421,6 @@ ifsfree(void)
 	ifslastp = NULL;
 }
 
-static size_t
-esclen(const char *start, const char *p)
-{
-	size_t esc = 0;
-
-	while (p > start && (unsigned char)*--p == CTLESC) {
-		esc++;
-	}
-	return esc;
-}
-
 /*
  * Remove any CTLESC characters from a string.
  */
@@ -6358,7 +6535,7 @@ rmescapes(char *str, int flag, int *slash_position)
 	}
 	return r;
 }
-#define pmatch(a, b) !fnmatch((a), (b), 0)
+#define pmatch(a, b) !shell_fnmatch((a), (b))
 
 /*
  * Prepare a pattern for a expmeta (internal glob(3)) call.
@@ -6573,6 +6750,12 @@ evaltreenr(union node *n, int flags)
 	/* NOTREACHED */
 }
 
+#if ENABLE_ASH_BACKQ_NOFORK
+static int evalbackcmd_nofork(union node *n, struct backcmd *result);
+#else
+# define evalbackcmd_nofork(n, result) 0
+#endif
+
 static void FAST_FUNC
 evalbackcmd(union node *n, struct backcmd *result
 				IF_BASH_PROCESS_SUBST(, int ctl))
@@ -6596,6 +6779,8 @@ evalbackcmd(union node *n, struct backcmd *result
 	if (n == NULL) {
 		goto out;
 	}
+	if (ctl == CTLBACKQ && evalbackcmd_nofork(n, result))
+		goto out;
 
 	if (pipe(pip) < 0)
 		ash_msg_and_raise_perror("can't create pipe");
@@ -6905,107 +7090,30 @@ argstr(char *p, int flag)
 	return p - 1;
 }
 
+/*
+ * Match the pattern compiled into prog against rmesc (startp with
+ * escapes removed) and return the corresponding position in startp.
+ */
 static char *
-scanleft(char *startp, char *rmesc, char *rmescend UNUSED_PARAM,
-		char *pattern, int quotes, int zero)
+scanmatch(char *startp, char *rmesc, const struct match_prog *prog, int quotes)
 {
 	char *loc, *loc2;
-	char c;
+	size_t n;
 
+	loc2 = match_scan(prog, rmesc);
+	if (!loc2)
+		return NULL;
+	n = loc2 - rmesc;
 	loc = startp;
-	loc2 = rmesc;
-	do {
-		int match;
-		const char *s = loc2;
-
-		c = *loc2;
-		if (zero) {
-			*loc2 = '\0';
-			s = rmesc;
-		}
-		match = pmatch(pattern, s);
-
-		*loc2 = c;
-		if (match)
-			return loc;
-		if (quotes && (unsigned char)*loc == CTLESC)
+	if (!quotes)
+		return loc + n;
+	while (n != 0) {
+		if ((unsigned char)*loc == CTLESC)
 			loc++;
 		loc++;
-		loc2++;
-	} while (c);
-	return NULL;
-}
-
-static char *
-scanright(char *startp, char *rmesc, char *rmescend,
-		char *pattern, int quotes, int match_at_start)
-{
-#if !ENABLE_ASH_OPTIMIZE_FOR_SIZE
-	int try2optimize = match_at_start;
-#endif
-	int esc = 0;
-	char *loc;
-	char *loc2;
-
-	/* If we called by "${v/pattern/repl}" or "${v//pattern/repl}":
-	 * startp="escaped_value_of_v" rmesc="raw_value_of_v"
-	 * rmescend=""(ptr to NUL in rmesc) pattern="pattern" quotes=match_at_start=1
-	 * Logic:
-	 * loc starts at NUL at the end of startp, loc2 starts at the end of rmesc,
-	 * and on each iteration they go back two/one char until they reach the beginning.
-	 * We try to match "raw_value_of_v", "raw_value_of_", "raw_value_of" etc.
-	 * If one of these matches, return pointer past last matched char in startp.
-	 */
-	/* TODO: document in what other circumstances we are called. */
-
-	for (loc = pattern - 1, loc2 = rmescend; loc >= startp; loc2--) {
-		int match;
-		char c = *loc2;
-		const char *s = loc2;
-		if (match_at_start) {
-			*loc2 = '\0';
-			s = rmesc;
-		}
-		match = pmatch(pattern, s);
-		//bb_error_msg("pmatch(pattern:'%s',s:'%s'):%d", pattern, s, match);
-		*loc2 = c;
-		if (match)
-			return loc;
-#if !ENABLE_ASH_OPTIMIZE_FOR_SIZE
-		if (try2optimize) {
-			/* Maybe we can optimize this:
-			 * if pattern ends with unescaped *, we can avoid checking
-			 * shorter strings: if "foo*" doesn't match "raw_value_of_v",
-			 * it won't match truncated "raw_value_of_" strings too.
-			 */
-			unsigned plen = strlen(pattern);
-			/* Does it end with "*"? */
-			if (plen != 0 && pattern[--plen] == '*') {
-				/* "xxxx*" is not escaped */
-				/* "xxx\*" is escaped */
-				/* "xx\\*" is not escaped */
-				/* "x\\\*" is escaped */
-				int slashes = 0;
-				while (plen != 0 && pattern[--plen] == '\\')
-					slashes++;
-				if (!(slashes & 1))
-					break; /* ends with unescaped "*" */
-			}
-			try2optimize = 0;
-		}
-#endif
-		loc--;
-		if (quotes) {
-			if (--esc < 0) {
-				esc = esclen(startp, loc);
-			}
-			if (esc % 2) {
-				esc--;
-				loc--;
-			}
-		}
+		n--;
 	}
-	return NULL;
+	return loc;
 }
 
 static void varunset(const char *, const char *, const char *, int) NORETURN;
@@ -7037,7 +7145,7 @@ subevalvar(char *start, char *str, int strloc,
 	int quotes = flag & QUOTES_ESC;
 	char *startp;
 	char *loc;
-	char *rmesc, *rmescend;
+	char *rmesc;
 	long amount;
 	int resetloc;
 	int argstr_flags;
@@ -7045,7 +7153,7 @@ subevalvar(char *start, char *str, int strloc,
 	IF_BASH_PATTERN_SUBST(int slash_pos;)
 	IF_BASH_PATTERN_SUBST(char *repl;)
 	int zero;
-	char *(*scan)(char*, char*, char*, char*, int, int);
+	struct match_prog prog;
 	char *p;
 
 	//bb_error_msg("subevalvar(start:'%s',str:'%s',strloc:%d,startloc:%d,varflags:%x,quotes:%d)",
@@ -7235,17 +7343,12 @@ subevalvar(char *start, char *str, int strloc,
 	startp = (char *)stackblock() + startloc;
 
 	rmesc = startp;
-	rmescend = (char *)stackblock() + strloc;
-	//bb_error_msg("str7:'%s'", rmescend);
 	if (quotes) {
 //TODO: how to handle slash_pos here if string changes (shortens?)
 		rmesc = rmescapes(startp, RMESCAPE_ALLOC | RMESCAPE_GROW, NULL);
-		if (rmesc != startp) {
-			rmescend = expdest;
+		if (rmesc != startp)
 			startp = (char *)stackblock() + startloc;
-		}
 	}
-	rmescend--;
 	str = (char *)stackblock() + strloc;
 	/*
 	 * Example: v='a\bc'; echo ${v/\\b/_\\_\z_}
@@ -7287,6 +7390,8 @@ subevalvar(char *start, char *str, int strloc,
 		 * by just using str + 1).
 		 */
 		no_meta_len = strpbrk(str + first_escaped * 2, "*?[\\") ? 0 : strlen(str);
+		if (no_meta_len == 0)
+			match_compile(&prog, str, SCAN_MOVE_FROM_RIGHT + SCAN_MATCH_LEFT_HALF);
 		len = 0;
 		idx = startp;
 		end = str - 1;
@@ -7294,7 +7399,7 @@ subevalvar(char *start, char *str, int strloc,
  try_to_match:
 			if (no_meta_len == 0) {
 				/* pattern has meta chars, have to glob */
-				loc = scanright(idx, rmesc, rmescend, str, quotes, /*match_at_start:*/ 1);
+				loc = scanmatch(idx, rmesc, &prog, quotes);
 			} else {
 				/* Testcase for very slow replace (performs about 22k replaces):
 				 * x=::::::::::::::::::::::
@@ -7316,7 +7421,7 @@ subevalvar(char *start, char *str, int strloc,
 					} while (--n != 0);
 				}
 			}
-			//bb_error_msg("scanright('%s'):'%s'", str, loc);
+			//bb_error_msg("scanmatch('%s'):'%s'", str, loc);
 			if (!loc) {
 				char *restart_detect;
  no_match:
@@ -7414,10 +7519,13 @@ subevalvar(char *start, char *str, int strloc,
 #endif
 	/* zero = (subtype == VSTRIMLEFT || subtype == VSTRIMLEFTMAX) */
 	zero = subtype >> 1;
-	/* VSTRIMLEFT/VSTRIMRIGHTMAX -> scanleft */
-	scan = (subtype & 1) ^ zero ? scanleft : scanright;
+	/* VSTRIMLEFT/VSTRIMRIGHTMAX -> shortest match from the left */
+	match_compile(&prog, str,
+		(zero ? SCAN_MATCH_LEFT_HALF : SCAN_MATCH_RIGHT_HALF)
+		+ ((subtype & 1) ^ zero ? SCAN_MOVE_FROM_LEFT : SCAN_MOVE_FROM_RIGHT)
+	);
 
-	loc = scan(startp, rmesc, rmescend, str, quotes, zero);
+	loc = scanmatch(startp, rmesc, &prog, quotes);
 	if (loc) {
 		if (zero) {
 			memmove(startp, loc, str - loc);
@@ -8095,6 +8203,40 @@ expandmeta(struct strlist *str /*, int flag*/)
 }
 #endif /* ENABLE_ASH_INTERNAL_GLOB */
 
+/*
+ * Most words in scripts are plain text: command names, options, case
+ * labels. They have no expansions, quoting or glob chars, and expand
+ * to themselves, no need to run them through argstr(), field splitting
+ * and globbing. Loop and function bodies are expanded over and over,
+ * remember the answer in the node.
+ */
+static int
+is_literal_word(union node *arg)
+{
+	const char *p;
+
+	if (arg->narg.literal != 0)
+		return arg->narg.literal > 0;
+	arg->narg.literal = -1;
+	p = arg->narg.text;
+	if (*p == '~')
+		return 0;
+	for (;;) {
+		unsigned char c = *p++;
+		if (c == '\0')
+			break;
+		if ((c >= CTL_FIRST && c <= CTL_LAST)
+		 || c == '*' || c == '?'
+		 /* "[" without "]" does not glob, "[ a = b ]" is common */
+		 || (c == '[' && strchr(p, ']'))
+		) {
+			return 0;
+		}
+	}
+	arg->narg.literal = 1;
+	return 1;
+}
+
 /*
  * Perform variable substitution and command substitution on an argument,
  * placing the resulting list of arguments in arglist.  If EXP_FULL is true,
@@ -8107,6 +8249,17 @@ expandarg(union node *arg, struct arglist *arglist, int flag)
 	struct strlist *sp;
 	char *p;
 
+	if (arglist
+	 && !(flag & ~(EXP_FULL | EXP_TILDE))
+	 && is_literal_word(arg)
+	) {
+		sp = stzalloc(sizeof(*sp));
+		sp->text = sstrdup(arg->narg.text);
+		*arglist->lastp = sp;
+		arglist->lastp = &sp->next;
+		return;
+	}
+
 	argbackq = arg->narg.backquote;
 	STARTSTACKSTR(expdest);
 	TRACE(("expandarg: argstr('%s',flags:%x)\n", arg->narg.text, flag));
@@ -8195,19 +8348,9 @@ struct builtincmd {
  * regardless of PATH=....%builtin... position */
 #define IS_BUILTIN_REGULAR(b) ((b)->name[0] & 2)
 #define IS_BUILTIN_ASSIGN(b)  ((b)->name[0] & 4)
+/* builtin does not change shell state, can be run in $(cmd) without forking */
+#define IS_BUILTIN_PURE(b)    ((b)->name[0] & 8)
 
-struct cmdentry {
-	smallint cmdtype;       /* CMDxxx */
-	union param {
-		int index;
-		/* index >= 0 for commands without path (slashes) */
-		/* (TODO: what exactly does the value mean? PATH position?) */
-		/* index == -1 for commands with slashes */
-		/* index == (-2 - applet_no) for NOFORK applets */
-		const struct builtincmd *cmd;
-		struct funcnode *func;
-	} u;
-};
 /* values of cmdtype */
 #define CMDUNKNOWN      -1      /* no entry in table for command */
 #define CMDNORMAL       0       /* command is an executable program */
@@ -8244,8 +8387,18 @@ struct tblentry {
 };
 
 static struct tblentry **cmdtable;
+static unsigned cmdtable_mask;  /* size - 1 */
+static unsigned ncmds;
+/* Changes whenever a lookup could give a different answer */
+static unsigned cmdtable_gen;
+#define cmdtable_changed() do { \
+	if (++cmdtable_gen == 0) \
+		cmdtable_gen = 1; \
+} while (0)
 #define INIT_G_cmdtable() do { \
 	cmdtable = xzalloc(CMDTABLESIZE * sizeof(cmdtable[0])); \
+	cmdtable_mask = CMDTABLESIZE - 1; \
+	cmdtable_gen = 1; \
 } while (0)
 
 static int builtinloc = -1;     /* index in path of %builtin, or -1 */
@@ -8395,7 +8548,8 @@ clearcmdentry(void)
 	struct tblentry *cmdp;
 
 	INT_OFF;
-	for (tblp = cmdtable; tblp < &cmdtable[CMDTABLESIZE]; tblp++) {
+	cmdtable_changed();
+	for (tblp = cmdtable; tblp <= &cmdtable[cmdtable_mask]; tblp++) {
 		pp = tblp;
 		while ((cmdp = *pp) != NULL) {
 			if (cmdp->cmdtype == CMDNORMAL
@@ -8406,6 +8560,7 @@ clearcmdentry(void)
 			) {
 				*pp = cmdp->next;
 				free(cmdp);
+				ncmds--;
 			} else {
 				pp = &cmdp->next;
 			}
@@ -8425,31 +8580,53 @@ clearcmdentry(void)
  */
 static struct tblentry **lastcmdentry;
 
+/* Double the table when there are more entries than buckets */
+static void
+growcmdtable(void)
+{
+	struct tblentry **old = cmdtable;
+	unsigned i, oldsize = cmdtable_mask + 1;
+
+	cmdtable_mask = oldsize * 2 - 1;
+	cmdtable = ckzalloc(oldsize * 2 * sizeof(cmdtable[0]));
+	for (i = 0; i < oldsize; i++) {
+		struct tblentry *cmdp, *next;
+		for (cmdp = old[i]; cmdp; cmdp = next) {
+			struct tblentry **pp;
+			next = cmdp->next;
+			pp = &cmdtable[hash_name(cmdp->cmdname) & cmdtable_mask];
+			cmdp->next = *pp;
+			*pp = cmdp;
+		}
+	}
+	free(old);
+}
+
 static struct tblentry *
 cmdlookup(const char *name, int add)
 {
-	unsigned int hashval;
-	const char *p;
 	struct tblentry *cmdp;
 	struct tblentry **pp;
 
-	p = name;
-	hashval = (unsigned char)*p << 4;
-	while (*p)
-		hashval += (unsigned char)*p++;
-	hashval &= 0x7FFF;
-	pp = &cmdtable[hashval % CMDTABLESIZE];
+	pp = &cmdtable[hash_name(name) & cmdtable_mask];
 	for (cmdp = *pp; cmdp; cmdp = cmdp->next) {
 		if (strcmp(cmdp->cmdname, name) == 0)
 			break;
 		pp = &cmdp->next;
 	}
+	if (add) /* caller is going to change it */
+		cmdtable_changed();
 	if (add && cmdp == NULL) {
-		cmdp = *pp = ckzalloc(sizeof(struct tblentry)
+		if (++ncmds > cmdtable_mask) {
+			growcmdtable();
+			pp = &cmdtable[hash_name(name) & cmdtable_mask];
+		}
+		cmdp = ckzalloc(sizeof(struct tblentry)
 				+ strlen(name)
 				/* + 1 - already done because
 				 * tblentry::cmdname is char[1] */);
-		/*cmdp->next = NULL; - ckzalloc did it */
+		cmdp->next = *pp;
+		*pp = cmdp;
 		cmdp->cmdtype = CMDUNKNOWN;
 		strcpy(cmdp->cmdname, name);
 	}
@@ -8466,11 +8643,13 @@ delete_cmd_entry(void)
 	struct tblentry *cmdp;
 
 	INT_OFF;
+	cmdtable_changed();
 	cmdp = *lastcmdentry;
 	*lastcmdentry = cmdp->next;
 	if (cmdp->cmdtype == CMDFUNCTION)
 		freefunc(cmdp->param.func);
 	free(cmdp);
+	ncmds--;
 	INT_ON;
 }
 
@@ -8507,7 +8686,7 @@ hashcmd(int argc UNUSED_PARAM, char **argv UNUSED_PARAM)
 	}
 
 	if (*argptr == NULL) {
-		for (pp = cmdtable; pp < &cmdtable[CMDTABLESIZE]; pp++) {
+		for (pp = cmdtable; pp <= &cmdtable[cmdtable_mask]; pp++) {
 			for (cmdp = *pp; cmdp; cmdp = cmdp->next) {
 				if (cmdp->cmdtype == CMDNORMAL)
 					printentry(cmdp);
@@ -8547,7 +8726,8 @@ hashcd(void)
 	struct tblentry **pp;
 	struct tblentry *cmdp;
 
-	for (pp = cmdtable; pp < &cmdtable[CMDTABLESIZE]; pp++) {
+	cmdtable_changed();
+	for (pp = cmdtable; pp <= &cmdtable[cmdtable_mask]; pp++) {
 		for (cmdp = *pp; cmdp; cmdp = cmdp->next) {
 			if (cmdp->cmdtype == CMDNORMAL
 			 || (cmdp->cmdtype == CMDBUILTIN
@@ -9095,6 +9275,7 @@ copynode(union node *n)
 		new->ncmd.args = copynode(n->ncmd.args);
 		new->ncmd.assign = copynode(n->ncmd.assign);
 		new->ncmd.linno = n->ncmd.linno;
+		/* new->ncmd.cmdgen = 0; - caller zeroed the block */
 		break;
 	case NPIPE:
 		new->npipe.cmdlist = copynodelist(n->npipe.cmdlist);
@@ -9145,6 +9326,7 @@ copynode(union node *n)
 		new->narg.backquote = copynodelist(n->narg.backquote);
 		new->narg.text = nodeckstrdup(n->narg.text);
 		new->narg.next = copynode(n->narg.next);
+		new->narg.literal = n->narg.literal;
 		break;
 	case NTO:
 #if BASH_REDIR_OUTPUT
@@ -10151,6 +10333,8 @@ static int ulimitcmd(int, char **) FAST_FUNC;
 #define BUILTIN_SPEC_ASSG       "5"
 #define BUILTIN_REG_ASSG        "6"
 #define BUILTIN_SPEC_REG_ASSG   "7"
+#define BUILTIN_REG_PURE        ":"
+#define BUILTIN_SPEC_REG_PURE   ";"
 
 /* Stubs for calling non-FAST_FUNC's */
 #if ENABLE_ASH_ECHO
@@ -10169,12 +10353,12 @@ static int FAST_FUNC sleepcmd(int argc, char **argv)  { return sleep_main(argc,
 /* Keep these in proper order since it is searched via bsearch() */
 static const struct builtincmd builtintab[] = {
 	{ BUILTIN_SPEC_REG      "."       , dotcmd     },
-	{ BUILTIN_SPEC_REG      ":"       , truecmd    },
+	{ BUILTIN_SPEC_REG_PURE ":"       , truecmd    },
 #if ENABLE_ASH_TEST
-	{ BUILTIN_REGULAR       "["       , testcmd    },
+	{ BUILTIN_REG_PURE      "["       , testcmd    },
 #endif
 #if BASH_TEST2
-	{ BUILTIN_REGULAR       "[["      , testcmd    },
+	{ BUILTIN_REG_PURE      "[["      , testcmd    },
 #endif
 #if ENABLE_ASH_ALIAS
 	{ BUILTIN_REG_ASSG      "alias"   , aliascmd   },
@@ -10190,13 +10374,13 @@ static const struct builtincmd builtintab[] = {
 #endif
 	{ BUILTIN_SPEC_REG      "continue", breakcmd   },
 #if ENABLE_ASH_ECHO
-	{ BUILTIN_REGULAR       "echo"    , echocmd    },
+	{ BUILTIN_REG_PURE      "echo"    , echocmd    },
 #endif
 	{ BUILTIN_SPEC_REG      "eval"    , NULL       }, /*evalcmd() has a differing prototype*/
 	{ BUILTIN_SPEC_REG      "exec"    , execcmd    },
 	{ BUILTIN_SPEC_REG      "exit"    , exitcmd    },
 	{ BUILTIN_SPEC_REG_ASSG "export"  , exportcmd  },
-	{ BUILTIN_REGULAR       "false"   , falsecmd   },
+	{ BUILTIN_REG_PURE      "false"   , falsecmd   },
 #if JOBS
 	{ BUILTIN_REGULAR       "fg"      , fg_bgcmd   },
 #endif
@@ -10219,9 +10403,9 @@ static const struct builtincmd builtintab[] = {
 #endif
 	{ BUILTIN_SPEC_REG_ASSG "local"   , localcmd   },
 #if ENABLE_ASH_PRINTF
-	{ BUILTIN_REGULAR       "printf"  , printfcmd  },
+	{ BUILTIN_REG_PURE      "printf"  , printfcmd  },
 #endif
-	{ BUILTIN_REGULAR       "pwd"     , pwdcmd     },
+	{ BUILTIN_REG_PURE      "pwd"     , pwdcmd     },
 	{ BUILTIN_REGULAR       "read"    , readcmd    },
 	{ BUILTIN_SPEC_REG_ASSG "readonly", exportcmd  },
 	{ BUILTIN_SPEC_REG      "return"  , returncmd  },
@@ -10234,11 +10418,11 @@ static const struct builtincmd builtintab[] = {
 	{ BUILTIN_SPEC_REG      "source"  , dotcmd     },
 #endif
 #if ENABLE_ASH_TEST
-	{ BUILTIN_REGULAR       "test"    , testcmd    },
+	{ BUILTIN_REG_PURE      "test"    , testcmd    },
 #endif
 	{ BUILTIN_SPEC_REG      "times"   , timescmd   },
 	{ BUILTIN_SPEC_REG      "trap"    , trapcmd    },
-	{ BUILTIN_REGULAR       "true"    , truecmd    },
+	{ BUILTIN_REG_PURE      "true"    , truecmd    },
 	{ BUILTIN_REGULAR       "type"    , typecmd    },
 	{ BUILTIN_REGULAR       "ulimit"  , ulimitcmd  },
 	{ BUILTIN_REGULAR       "umask"   , umaskcmd   },
@@ -10295,7 +10479,7 @@ ash_command_name(int i)
 		return builtintab[i].name + 1;
 	i -= ARRAY_SIZE(builtintab);
 
-	for (n = 0; n < CMDTABLESIZE; n++) {
+	for (n = 0; n <= cmdtable_mask; n++) {
 		struct tblentry *cmdp;
 		for (cmdp = cmdtable[n]; cmdp; cmdp = cmdp->next) {
 			if (cmdp->cmdtype == CMDFUNCTION && --i < 0)
@@ -10363,6 +10547,8 @@ evalcommand(union node *cmd, int flags)
 	smallint cmd_is_exec;
 	int vflags;
 	int vlocal;
+	int cache;
+	unsigned gen;
 
 	errlinno = lineno = cmd->ncmd.linno;
 
@@ -10390,13 +10576,23 @@ evalcommand(union node *cmd, int flags)
 
 	argc = 0;
 	argp = cmd->ncmd.args;
+	/* Plain command name: lookups below give the same answers
+	 * every time, until something changes cmdtable */
+	cache = argp && is_literal_word(argp);
+	gen = cmdtable_gen;
 	osp = fill_arglist(&arglist, &argp);
 	if (osp) {
 		int pseudovarflag = 0;
 
 		for (;;) {
-			find_command(arglist.list->text, &cmdentry,
-					cmd_flag | DO_REGBLTIN, pathval());
+			if (cache && cmd->ncmd.cmdgen == gen) {
+				cmdentry = cmd->ncmd.cmdfirst;
+			} else {
+				find_command(arglist.list->text, &cmdentry,
+						cmd_flag | DO_REGBLTIN, pathval());
+				if (cache)
+					cmd->ncmd.cmdfirst = cmdentry;
+			}
 
 			vlocal++;
 
@@ -10414,6 +10610,8 @@ evalcommand(union node *cmd, int flags)
 			if (cmdentry.u.cmd != COMMANDCMD)
 				break;
 
+			/* "command NAME": not the first word which is looked up */
+			cache = 0;
 			cmd_flag = parse_command_args(&arglist, &argp, &path);
 			if (!cmd_flag)
 #endif
@@ -10532,7 +10730,19 @@ evalcommand(union node *cmd, int flags)
 	 || !(IS_BUILTIN_REGULAR(cmdentry.u.cmd))
 	) {
 		path = path ? path : pathval();
-		find_command(argv[0], &cmdentry, cmd_flag | DO_ERR, path);
+		if (cache && cmd->ncmd.cmdgen == cmdtable_gen)
+			cmdentry = cmd->ncmd.cmdentry;
+		else
+			find_command(argv[0], &cmdentry, cmd_flag | DO_ERR, path);
+	}
+	/* Not found: look again next time, the error message is needed.
+	 * Assignments (PATH=... cmd) could have changed cmdtable:
+	 * the first lookup then was done with the old one */
+	if (cache && cmd->ncmd.cmdgen != gen
+	 && cmdtable_gen == gen && cmdentry.cmdtype != CMDUNKNOWN
+	) {
+		cmd->ncmd.cmdentry = cmdentry;
+		cmd->ncmd.cmdgen = gen;
 	}
 
 	jp = NULL;
@@ -10594,7 +10804,9 @@ evalcommand(union node *cmd, int flags)
 			INT_OFF;
 			get_tty_state();
 			jp = makejob(/*cmd,*/ 1);
-			if (forkshell(jp, cmd, FORK_FG) != 0) {
+			if (vforkexec(jp, cmd, argv, path, cmdentry.u.index) != 0
+			 || forkshell(jp, cmd, FORK_FG) != 0
+			) {
 				/* parent */
 				break;
 			}
@@ -10697,6 +10909,182 @@ prehash(union node *n)
 		find_command(n->ncmd.args->narg.text, &entry, 0, pathval());
 }
 
+#if ENABLE_ASH_BACKQ_NOFORK
+/*
+ * Can expanding this word change shell state or raise an error?
+ * ${v=x}, ${v:N:M} and $((...)) can assign variables,
+ * ${v?msg} aborts. In a forked $(cmd) neither would affect us.
+ * Nested $(cmd)s are fine: they are evaluated on their own.
+ */
+static int
+word_expands_purely(const char *p)
+{
+	for (;;) {
+		unsigned char c = *p++;
+
+		if (c == '\0')
+			return 1;
+		if (c == CTLESC) {
+			p++;
+			continue;
+		}
+		if (c == CTLARI)
+			return 0;
+		if (c == CTLVAR) {
+			int subtype = *p & VSTYPE;
+			if (subtype == VSQUESTION
+			 || subtype == VSASSIGN
+			 || subtype == VSSUBSTR
+			) {
+				return 0;
+			}
+		}
+	}
+}
+
+/*
+ * Run $(cmd) in the shell itself if cmd is a builtin which does not
+ * change shell state, or a NOFORK applet: its stdout is a memfd,
+ * which is read into result->buf afterwards.
+ * Returns 0 if this is not possible, caller should fork.
+ */
+static int
+evalbackcmd_nofork(union node *n, struct backcmd *result)
+{
+	struct arglist arglist;
+	struct cmdentry entry;
+	union node *argp;
+	struct strlist *sp;
+	char **argv;
+	int argc;
+	int mfd, saved_fd1;
+	int status, sv_exitstatus;
+	int raise;
+	struct stat st;
+	char *sv_expdest;
+	struct nodelist *sv_argbackq;
+	struct ifsregion sv_ifsfirst, *sv_ifslastp;
+	struct arglist sv_exparg;
+
+	if (n->type != NCMD || n->ncmd.assign || n->ncmd.redirect
+	 || !n->ncmd.args
+	 /* These make even plain expansions and builtins observable */
+	 || xflag || uflag
+	) {
+		return 0;
+	}
+	if (!goodname(n->ncmd.args->narg.text))
+		return 0;
+	for (argp = n->ncmd.args->narg.next; argp; argp = argp->narg.next)
+		if (!word_expands_purely(argp->narg.text))
+			return 0;
+
+	find_command(n->ncmd.args->narg.text, &entry, 0, pathval());
+	if (entry.cmdtype == CMDBUILTIN) {
+		if (!IS_BUILTIN_PURE(entry.u.cmd))
+			return 0;
+	} else
+#if ENABLE_FEATURE_SH_STANDALONE \
+ && ENABLE_FEATURE_SH_NOFORK \
+ && NUM_APPLETS > 1
+	/* find_command() encodes applet_no as (-2 - applet_no) */
+	if (entry.cmdtype != CMDNORMAL
+	 || entry.u.index > -2
+	 || !APPLET_IS_NOFORK(- entry.u.index - 2)
+	)
+#endif
+	{
+		return 0;
+	}
+
+#ifdef __NR_memfd_create
+	mfd = syscall(__NR_memfd_create, "backq", 1 /* MFD_CLOEXEC */);
+#else
+	mfd = -1;
+#endif
+	if (mfd < 0)
+		return 0;
+
+	/* We are called from the middle of expanding a word,
+	 * expandarg() must not trash its state */
+	sv_expdest = expdest;
+	sv_argbackq = argbackq;
+	sv_ifsfirst = ifsfirst;
+	sv_ifslastp = ifslastp;
+	sv_exparg = exparg;
+	ifsfirst.next = NULL;
+	ifslastp = NULL;
+	arglist.lastp = &arglist.list;
+	for (argp = n->ncmd.args; argp; argp = argp->narg.next)
+		expandarg(argp, &arglist, EXP_FULL | EXP_TILDE);
+	*arglist.lastp = NULL;
+	expdest = sv_expdest;
+	argbackq = sv_argbackq;
+	ifsfirst = sv_ifsfirst;
+	ifslastp = sv_ifslastp;
+	exparg = sv_exparg;
+	argc = 0;
+	for (sp = arglist.list; sp; sp = sp->next)
+		argc++;
+	argv = stalloc(sizeof(char *) * (argc + 1));
+	argc = 0;
+	for (sp = arglist.list; sp; sp = sp->next)
+		argv[argc++] = sp->text;
+	argv[argc] = NULL;
+
+	TRACE(("evalbackcmd_nofork: %s\n", argv[0]));
+	flush_stdout_stderr();
+	saved_fd1 = fcntl(1, F_DUPFD_CLOEXEC, 10);
+	dup2_or_raise(mfd, 1);
+
+	sv_exitstatus = exitstatus;
+	raise = 0;
+	if (entry.cmdtype == CMDBUILTIN) {
+		raise = evalbltin(entry.u.cmd, argc, argv, 0);
+		status = exitstatus;
+	}
+#if ENABLE_FEATURE_SH_STANDALONE \
+ && ENABLE_FEATURE_SH_NOFORK \
+ && NUM_APPLETS > 1
+	else {
+		/* Same as in evalcommand() */
+		char **sv_environ = environ;
+		environ = listvars(VEXPORT, VUNSET, /*lp:*/ NULL, /*end:*/ NULL);
+		status = run_nofork_applet(- entry.u.index - 2, argv);
+		environ = sv_environ;
+	}
+#endif
+	/* $(cmd) does not change $? (only its back_exitstatus does) */
+	exitstatus = sv_exitstatus;
+	back_exitstatus = status;
+
+	fflush_all();
+	if (saved_fd1 >= 0) {
+		dup2_or_raise(saved_fd1, 1);
+		close(saved_fd1);
+	} else {
+		close(1);
+	}
+
+	/* Same as in evalcommand(): ^C and the like are not ours to eat */
+	if (raise
+	 && !(exception_type == EXERROR && !IS_BUILTIN_SPECIAL(entry.u.cmd))
+	) {
+		close(mfd);
+		longjmp(exception_handler->loc, 1);
+	}
+
+	if (fstat(mfd, &st) == 0 && st.st_size > 0) {
+		ssize_t sz = st.st_size < INT_MAX ? st.st_size : INT_MAX;
+		result->buf = xmalloc(sz);
+		sz = pread(mfd, result->buf, sz, 0);
+		result->nleft = sz > 0 ? sz : 0;
+	}
+	close(mfd);
+	return 1;
+}
+#endif
+
 
 /* ============ Builtin commands
  *
@@ -11138,6 +11526,361 @@ synstack_pop(struct synstack **stack)
 	*stack = (*stack)->next;
 }
 
+#if ENABLE_ASH_PARSE_CACHE
+/*
+ * Parse cache.  If $ASH_PARSE_CACHE names a directory, the parse trees
+ * of a file read by setinputfile() are recorded while it is executed,
+ * and saved to that directory once the end of the file is reached.
+ * When the file is read again, the trees are loaded from the cache and
+ * run one by one instead of parsing the file.  As soon as parsing could
+ * give a different result (aliases are defined, "set -v" is on), we seek
+ * to where the next command starts in the file and parse it as usual.
+ */
+struct pcache_cmd {
+	union node *n;
+	off_t off;      /* where the command starts in the file */
+	int linno;      /* and its line number */
+};
+
+struct pcache {
+	unsigned cnt;
+	unsigned next;
+	struct pcache_cmd cmd[]; /* cnt + 1 entries, the last one is EOF */
+	/* parse trees follow */
+};
+
+struct pcache_rec {
+	struct pcache_rec *next;
+	struct pcache_cmd c;
+	/* copy of c.n follows */
+};
+
+/* Cache file header.  Everything up to "base" is the cache key */
+struct pcache_hdr {
+	char magic[48];
+	unsigned layout;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	char *base;     /* address of cmd[0] when the file was written */
+	size_t len;     /* size of cmd[] and the trees */
+	unsigned cnt;
+};
+
+struct pcache_new {
+	struct pcache_hdr hdr;
+	char *name;     /* cache file to write */
+	unsigned cnt;
+	int size;       /* sum of calcsize() of all trees */
+	struct pcache_rec *first;
+	struct pcache_rec **last;
+};
+
+static void
+pcache_hdr_init(struct pcache_hdr *h, const struct stat *st)
+{
+	memset(h, 0, sizeof(*h));
+	snprintf(h->magic, sizeof(h->magic), "ash parse cache\n%s\n", bb_banner);
+	h->layout = (N_NUMBER << 16) + (sizeof(union node) << 8) + sizeof(struct pcache_cmd);
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime = st->st_mtime;
+	h->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int
+aliases_defined(void)
+{
+#if ENABLE_ASH_ALIAS
+	int i;
+
+	for (i = 0; i < ATABSIZE; i++)
+		if (atab[i])
+			return 1;
+#endif
+	return 0;
+}
+
+#define PCACHE_RELOC(p, delta) ((p) = (void *)((char *)(p) + (delta)))
+
+static void relocnode(union node **np, ptrdiff_t delta);
+
+static void
+relocnodelist(struct nodelist **lpp, ptrdiff_t delta)
+{
+	while (*lpp) {
+		PCACHE_RELOC(*lpp, delta);
+		relocnode(&(*lpp)->n, delta);
+		lpp = &(*lpp)->next;
+	}
+}
+
+/*
+ * Adjust the pointers of a tree made by copynode() which was moved
+ * by delta bytes.  Mirrors copynode().
+ */
+static void
+relocnode(union node **np, ptrdiff_t delta)
+{
+	union node *n;
+
+	if (*np == NULL)
+		return;
+	n = PCACHE_RELOC(*np, delta);
+
+	switch (n->type) {
+	case NCMD:
+		relocnode(&n->ncmd.redirect, delta);
+		relocnode(&n->ncmd.args, delta);
+		relocnode(&n->ncmd.assign, delta);
+		/* Pointers of another process */
+		n->ncmd.cmdgen = 0;
+		break;
+	case NPIPE:
+		relocnodelist(&n->npipe.cmdlist, delta);
+		break;
+	case NREDIR:
+	case NBACKGND:
+	case NSUBSHELL:
+		relocnode(&n->nredir.redirect, delta);
+		relocnode(&n->nredir.n, delta);
+		break;
+	case NAND:
+	case NOR:
+	case NSEMI:
+	case NWHILE:
+	case NUNTIL:
+		relocnode(&n->nbinary.ch2, delta);
+		relocnode(&n->nbinary.ch1, delta);
+		break;
+	case NIF:
+		relocnode(&n->nif.elsepart, delta);
+		relocnode(&n->nif.ifpart, delta);
+		relocnode(&n->nif.test, delta);
+		break;
+	case NFOR:
+		PCACHE_RELOC(n->nfor.var, delta);
+		relocnode(&n->nfor.body, delta);
+		relocnode(&n->nfor.args, delta);
+		break;
+	case NCASE:
+		relocnode(&n->ncase.cases, delta);
+		relocnode(&n->ncase.expr, delta);
+		break;
+	case NCLIST:
+		relocnode(&n->nclist.body, delta);
+		relocnode(&n->nclist.pattern, delta);
+		relocnode(&n->nclist.next, delta);
+		break;
+	case NDEFUN:
+		relocnode(&n->ndefun.body, delta);
+		PCACHE_RELOC(n->ndefun.text, delta);
+		break;
+	case NARG:
+		relocnodelist(&n->narg.backquote, delta);
+		PCACHE_RELOC(n->narg.text, delta);
+		relocnode(&n->narg.next, delta);
+		break;
+	case NTO:
+#if BASH_REDIR_OUTPUT
+	case NTO2:
+#endif
+	case NCLOBBER:
+	case NFROM:
+	case NFROMTO:
+	case NAPPEND:
+		relocnode(&n->nfile.fname, delta);
+		relocnode(&n->nfile.next, delta);
+		break;
+	case NTOFD:
+	case NFROMFD:
+		relocnode(&n->ndup.vname, delta);
+		relocnode(&n->ndup.next, delta);
+		break;
+	case NHERE:
+	case NXHERE:
+		relocnode(&n->nhere.doc, delta);
+		relocnode(&n->nhere.next, delta);
+		break;
+	case NNOT:
+		relocnode(&n->nnot.com, delta);
+		break;
+	};
+}
+
+static struct pcache *
+pcache_load(const char *name, const struct pcache_hdr *key)
+{
+	struct pcache_hdr h;
+	struct pcache *pc;
+	struct stat st;
+	ptrdiff_t delta;
+	unsigned i;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	pc = NULL;
+	/* Someone else could have put arbitrary commands into it */
+	if (fstat(fd, &st) != 0
+	 || st.st_uid != geteuid()
+	 || (st.st_mode & (S_IWGRP | S_IWOTH))
+	 || full_read(fd, &h, sizeof(h)) != sizeof(h)
+	 || memcmp(&h, key, offsetof(struct pcache_hdr, base)) != 0
+	 || h.len != st.st_size - sizeof(h)
+	 || h.len < (h.cnt + 1) * sizeof(pc->cmd[0])
+	) {
+		goto out;
+	}
+	pc = ckmalloc(sizeof(*pc) + h.len);
+	if (full_read(fd, pc->cmd, h.len) != (ssize_t)h.len) {
+		free(pc);
+		pc = NULL;
+		goto out;
+	}
+	pc->cnt = h.cnt;
+	pc->next = 0;
+	delta = (char *)pc->cmd - h.base;
+	for (i = 0; i < pc->cnt; i++)
+		relocnode(&pc->cmd[i].n, delta);
+ out:
+	close(fd);
+	return pc;
+}
+
+static void
+pcache_open(const char *fname, int fd)
+{
+	struct pcache_new *pn;
+	const char *dir;
+	struct stat st;
+	char *name;
+
+	dir = lookupvar("ASH_PARSE_CACHE");
+	if (!dir || !dir[0] || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+	name = xasprintf("%s/%s.%llx.%llx", dir, bb_basename(fname),
+			(unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+	pn = ckzalloc(sizeof(*pn));
+	pcache_hdr_init(&pn->hdr, &st);
+	g_parsefile->pcache = pcache_load(name, &pn->hdr);
+	if (g_parsefile->pcache) {
+		free(name);
+		free(pn);
+		return;
+	}
+	pn->name = name;
+	pn->last = &pn->first;
+	g_parsefile->pcache_new = pn;
+}
+
+static void
+pcache_drop(struct parsefile *pf)
+{
+	struct pcache_new *pn = pf->pcache_new;
+
+	if (!pn)
+		return;
+	while (pn->first) {
+		struct pcache_rec *r = pn->first;
+		pn->first = r->next;
+		free(r);
+	}
+	free(pn->name);
+	free(pn);
+	pf->pcache_new = NULL;
+}
+
+/* Offset in the file of the next character pgetc() returns */
+static off_t
+pcache_offset(struct parsefile *pf)
+{
+	return lseek(pf->pf_fd, 0, SEEK_CUR)
+		- (pf->left_in_line > 0 ? pf->left_in_line : 0)
+		- (pf->left_in_buffer > 0 ? pf->left_in_buffer : 0)
+		- pf->unget;
+}
+
+static void
+pcache_record(struct pcache_new *pn, union node *n, off_t off, int linno)
+{
+	struct pcache_rec *r;
+	int size;
+
+	size = calcsize(0, n);
+	r = ckzalloc(sizeof(*r) + size);
+	funcblock = r + 1;
+	funcstring_end = (char *)(r + 1) + size;
+	r->c.n = copynode(n);
+	r->c.off = off;
+	r->c.linno = linno;
+	*pn->last = r;
+	pn->last = &r->next;
+	pn->cnt++;
+	pn->size += size;
+}
+
+static void
+pcache_save(struct pcache_new *pn, off_t eof_off, int eof_linno)
+{
+	struct pcache_hdr h;
+	struct pcache_cmd *img;
+	struct pcache_rec *r;
+	struct stat st;
+	char *tmp;
+	size_t len;
+	unsigned i;
+	int fd;
+
+	/* The file might have been changed while we were reading it */
+	if (fstat(g_parsefile->pf_fd, &st) != 0)
+		return;
+	pcache_hdr_init(&h, &st);
+	if (memcmp(&h, &pn->hdr, offsetof(struct pcache_hdr, base)) != 0)
+		return;
+
+	len = (pn->cnt + 1) * sizeof(img[0]) + pn->size;
+	img = ckzalloc(len);
+	funcblock = img + pn->cnt + 1;
+	funcstring_end = (char *)img + len;
+	for (i = 0, r = pn->first; r; r = r->next, i++) {
+		img[i] = r->c;
+		img[i].n = copynode(r->c.n);
+	}
+	img[i].off = eof_off;
+	img[i].linno = eof_linno;
+	h.base = (char *)img;
+	h.len = len;
+	h.cnt = pn->cnt;
+
+	tmp = xasprintf("%s.XXXXXX", pn->name);
+	fd = mkstemp(tmp);
+	if (fd >= 0) {
+		int ok = full_write(fd, &h, sizeof(h)) == sizeof(h)
+			&& full_write(fd, img, len) == (ssize_t)len;
+		if (close(fd) != 0 || !ok || rename(tmp, pn->name) != 0)
+			unlink(tmp);
+	}
+	free(tmp);
+	free(img);
+}
+
+/* Continue by parsing the file, starting at command c */
+static void
+pcache_resume(struct parsefile *pf, struct pcache_cmd *c)
+{
+	lseek(pf->pf_fd, c->off, SEEK_SET);
+	pf->left_in_line = 0;
+	pf->left_in_buffer = 0;
+	pf->unget = 0;
+	pf->linno = c->linno;
+}
+#endif
+
 /*
  * To handle the "." command, a stack of input files is used.  Pushfile
  * adds a new entry to the stack and popfile restores the previous level.
@@ -11175,6 +11918,10 @@ popfile(void)
 		popstring();
 		freestrings(g_parsefile->spfree);
 	}
+#if ENABLE_ASH_PARSE_CACHE
+	free(pf->pcache);
+	pcache_drop(pf);
+#endif
 	g_parsefile = pf->prev;
 	free(pf);
 	INT_ON;
@@ -11203,6 +11950,13 @@ popallfiles(void)
 static void
 closescript(void)
 {
+#if ENABLE_ASH_PARSE_CACHE
+	struct parsefile *pf;
+
+	/* We may be running a tree from the cache, do not free them */
+	for (pf = g_parsefile; pf; pf = pf->prev)
+		pf->pcache = NULL;
+#endif
 	popallfiles();
 	if (g_parsefile->pf_fd > 0) {
 		close(g_parsefile->pf_fd);
@@ -11252,6 +12006,9 @@ setinputfile(const char *fname, int flags)
 		close_on_exec_on(fd);
 
 	setinputfd(fd, flags & INPUT_PUSH_FILE);
+#if ENABLE_ASH_PARSE_CACHE
+	pcache_open(fname, fd);
+#endif
  out:
 	INT_ON;
 	return fd;
@@ -13459,6 +14216,7 @@ expandstr(const char *ps, int syntax_type)
 	readtoken1(pgetc_eatbnl(), syntax_type, FAKEEOFMARK, 0);
 
 	n.narg.type = NARG;
+	n.narg.literal = 0;
 	n.narg.next = NULL;
 	n.narg.text = wordtext;
 	n.narg.backquote = backquotelist;
@@ -13571,6 +14329,57 @@ evalcmd(int argc UNUSED_PARAM, char **argv, int flags)
 	return 0;
 }
 
+#if ENABLE_ASH_PARSE_CACHE
+/*
+ * parsecmd() for cmdloop(): take the next command from the parse cache,
+ * or parse it and record it for the cache.
+ */
+static union node *
+pcache_parsecmd(int inter)
+{
+	struct parsefile *pf = g_parsefile;
+	struct pcache_new *pn;
+	union node *n;
+	off_t off;
+	int linno;
+
+	if (pf->pcache) {
+		struct pcache *pc = pf->pcache;
+
+		if (pc->next < pc->cnt && !inter && !vflag && !aliases_defined())
+			return pc->cmd[pc->next++].n;
+		INT_OFF;
+		pcache_resume(pf, &pc->cmd[pc->next]);
+		pf->pcache = NULL;
+		free(pc);
+		INT_ON;
+		return parsecmd(inter);
+	}
+
+	pn = pf->pcache_new;
+	if (!pn)
+		return parsecmd(inter);
+	if (inter || vflag || aliases_defined()) {
+		INT_OFF;
+		pcache_drop(pf);
+		INT_ON;
+		return parsecmd(inter);
+	}
+	off = pcache_offset(pf);
+	linno = pf->linno;
+	n = parsecmd(inter);
+	INT_OFF;
+	if (n != NODE_EOF) {
+		pcache_record(pn, n, off, linno);
+	} else {
+		pcache_save(pn, pcache_offset(pf), pf->linno);
+		pcache_drop(pf);
+	}
+	INT_ON;
+	return n;
+}
+#endif
+
 /*
  * Read and execute commands.
  * "Top" is nonzero for the top level command loop;
@@ -13599,7 +14408,11 @@ cmdloop(int top)
 			inter++;
 			chkmail();
 		}
+#if ENABLE_ASH_PARSE_CACHE
+		n = pcache_parsecmd(inter);
+#else
 		n = parsecmd(inter);
+#endif
 #if DEBUG
 		if (DEBUG > 2 && debug && (n != NODE_EOF))
 			showtree(n);
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Microbenchmark for shell variable and command (function) lookup.
+# Not a test, run-all does not run it.
+#
+# Usage: bench-vars.sh [SHELL [N]]
+# SHELL defaults to ./ash, N (number of variables/functions) to 20000.
+# Prints elapsed milliseconds for each phase.
+
+SH=${1:-./ash}
+N=${2:-20000}
+
+now_ms()
+{
+	t=$(date +%s%N)
+	echo $((t / 1000000))
+}
+
+run()
+{
+	name=$1
+	shift
+	t0=$(now_ms)
+	"$SH" -c "$*" || echo "$name: failed (exit $?)"
+	t1=$(now_ms)
+	printf '%-8s %6u ms\n' "$name" $((t1 - t0))
+}
+
+SET_VARS='i=0; while [ $i -lt '$N' ]; do eval "cfg_$i=v$i"; i=$((i+1)); done'
+
+run set    "$SET_VARS"
+run get    "$SET_VARS"'
+	j=0; while [ $j -lt 5 ]; do
+		i=0; while [ $i -lt '$N' ]; do eval "x=\$cfg_$i"; i=$((i+1)); done
+		j=$((j+1))
+	done'
+run unset  "$SET_VARS"'
+	i=0; while [ $i -lt '$N' ]; do unset cfg_$i; i=$((i+1)); done'
+run export "$SET_VARS"'
+	export -p >/dev/null; set >/dev/null'
+run func   'i=0; while [ $i -lt '$N' ]; do eval "fn_$i() { :; }"; i=$((i+1)); done
+	i=0; while [ $i -lt '$N' ]; do fn_$i; i=$((i+1)); done'
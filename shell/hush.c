@@ -774,6 +774,8 @@ enum {
 #define setenv(...) setenv_is_leaky_dont_use()
 struct variable {
 	struct variable *next;
+	struct variable **pprev; /* link which points to us in G.top_var list */
+	struct variable *hnext;  /* next in G.var_hash[] chain */
 	char *varstr;        /* points to "name=" portion */
 	int max_len;         /* if > 0, name is part of initial env; else name is malloced */
 	uint16_t var_nest_level;
@@ -964,7 +966,13 @@ struct globals {
 	const char *ifs;
 	char *ifs_whitespace; /* = G.ifs or malloced */
 	const char *cwd;
+	/* Variables are in G.top_var list (in order of creation,
+	 * for "set" and such) and are also hashed by name */
 	struct variable *top_var;
+	struct variable **last_var_pp;
+	struct variable **var_hash;
+	unsigned var_hash_mask;
+	unsigned var_cnt;
 	char **expanded_assignments;
 	struct variable **shadowed_vars_pp;
 	unsigned var_nest_level;
@@ -2255,23 +2263,91 @@ static const char *get_cwd(int force)
 /*
  * Shell and environment variable support
  */
-static struct variable **get_ptr_to_local_var(const char *name)
+enum { VAR_HASH_SIZE = 64 }; /* initial, must be power of 2 */
+
+/* FNV-1a. Stops at '=': "NAME=value" hashes the same as "NAME" */
+static unsigned hash_varname(const char *p)
+{
+	unsigned hashval = 2166136261;
+
+	while (*p && *p != '=')
+		hashval = (hashval ^ (unsigned char)*p++) * 16777619;
+	return hashval;
+}
+
+static struct variable **var_hash_slot(const char *name)
+{
+	return &G.var_hash[hash_varname(name) & G.var_hash_mask];
+}
+
+/* Insert var into G.top_var list at *pp, and into the hash */
+static void link_var(struct variable **pp, struct variable *var)
+{
+	struct variable **hpp;
+
+	var->next = *pp;
+	if (var->next)
+		var->next->pprev = &var->next;
+	else
+		G.last_var_pp = &var->next;
+	var->pprev = pp;
+	*pp = var;
+
+	/* Double the hash when there are more variables than buckets */
+	if (++G.var_cnt > G.var_hash_mask) {
+		struct variable **old = G.var_hash;
+		unsigned i, oldsize = G.var_hash_mask + 1;
+
+		G.var_hash_mask = oldsize * 2 - 1;
+		G.var_hash = xzalloc(oldsize * 2 * sizeof(G.var_hash[0]));
+		for (i = 0; i < oldsize; i++) {
+			struct variable *cur, *next;
+			for (cur = old[i]; cur; cur = next) {
+				next = cur->hnext;
+				hpp = var_hash_slot(cur->varstr);
+				cur->hnext = *hpp;
+				*hpp = cur;
+			}
+		}
+		free(old);
+	}
+	hpp = var_hash_slot(var->varstr);
+	var->hnext = *hpp;
+	*hpp = var;
+}
+
+/* Remove var from G.top_var list and from the hash */
+static void unlink_var(struct variable *var)
+{
+	struct variable **hpp;
+
+	*var->pprev = var->next;
+	if (var->next)
+		var->next->pprev = var->pprev;
+	else
+		G.last_var_pp = var->pprev;
+
+	hpp = var_hash_slot(var->varstr);
+	while (*hpp != var)
+		hpp = &(*hpp)->hnext;
+	*hpp = var->hnext;
+	G.var_cnt--;
+}
+
+static struct variable *get_local_var(const char *name)
 {
-	struct variable **pp;
 	struct variable *cur;
 
-	pp = &G.top_var;
-	while ((cur = *pp) != NULL) {
+	for (cur = *var_hash_slot(name); cur; cur = cur->hnext) {
 		if (varcmp(cur->varstr, name) == 0)
-			return pp;
-		pp = &cur->next;
+			return cur;
 	}
 	return NULL;
 }
 
 static const char* FAST_FUNC get_local_var_value(const char *name)
 {
-	struct variable **vpp;
+	struct variable *var;
 
 	if (G.expanded_assignments) {
 		char **cpp = G.expanded_assignments;
@@ -2283,9 +2359,9 @@ static const char* FAST_FUNC get_local_var_value(const char *name)
 		}
 	}
 
-	vpp = get_ptr_to_local_var(name);
-	if (vpp)
-		return strchr((*vpp)->varstr, '=') + 1;
+	var = get_local_var(name);
+	if (var)
+		return strchr(var->varstr, '=') + 1;
 
 	if (strcmp(name, "PPID") == 0)
 		return utoa(G.root_ppid);
@@ -2352,13 +2428,9 @@ static int set_local_var(char *str, unsigned flags)
 		bb_simple_error_msg_and_die("BUG in setvar");
 
 	name_len = eq_sign - str + 1; /* including '=' */
-	cur_pp = &G.top_var;
-	while ((cur = *cur_pp) != NULL) {
-		if (strncmp(cur->varstr, str, name_len) != 0) {
-			cur_pp = &cur->next;
-			continue;
-		}
-
+	cur_pp = G.last_var_pp; /* new variable goes to the end */
+	cur = get_local_var(str);
+	if (cur) {
 		/* We found an existing var with this name */
 		if (cur->flg_read_only) {
 			bb_error_msg("%s: readonly variable", str);
@@ -2388,9 +2460,11 @@ static int set_local_var(char *str, unsigned flags)
 			 * "VAR=VAL cmd")
 			 * and existing one is global, or local
 			 * on a lower level that new one.
-			 * Remove it from global variable list:
+			 * Remove it from global variable list
+			 * (new one takes its place):
 			 */
-			*cur_pp = cur->next;
+			cur_pp = cur->pprev;
+			unlink_var(cur);
 			if (G.shadowed_vars_pp) {
 				/* Save in "shadowed" list */
 				debug_printf_env("shadowing %s'%s'/%u by '%s'/%u\n",
@@ -2409,7 +2483,7 @@ static int set_local_var(char *str, unsigned flags)
 					free_me = cur->varstr; /* then free it later */
 				free(cur);
 			}
-			break;
+			goto new_var;
 		}
 
 		if (strcmp(cur->varstr + name_len, eq_sign + 1) == 0) {
@@ -2442,11 +2516,13 @@ static int set_local_var(char *str, unsigned flags)
 	}
 
 	/* Not found or shadowed - create new variable struct */
+ new_var:
 	debug_printf_env("%s: alloc new var '%s'/%u\n", __func__, str, local_lvl);
 	cur = xzalloc(sizeof(*cur));
 	cur->var_nest_level = local_lvl;
-	cur->next = *cur_pp;
-	*cur_pp = cur;
+	cur->varstr = str;
+	link_var(cur_pp, cur);
+	goto exp;
 
  set_str_and_exp:
 	cur->varstr = str;
@@ -2499,26 +2575,20 @@ static void set_pwd_var(unsigned flag)
 static int unset_local_var(const char *name)
 {
 	struct variable *cur;
-	struct variable **cur_pp;
-
-	cur_pp = &G.top_var;
-	while ((cur = *cur_pp) != NULL) {
-		if (varcmp(cur->varstr, name) == 0) {
-			if (cur->flg_read_only) {
-				bb_error_msg("%s: readonly variable", name);
-				return EXIT_FAILURE;
-			}
-
-			*cur_pp = cur->next;
-			debug_printf_env("%s: unsetenv '%s'\n", __func__, cur->varstr);
-			bb_unsetenv(cur->varstr);
-			if (!cur->max_len)
-				free(cur->varstr);
-			free(cur);
 
-			break;
+	cur = get_local_var(name);
+	if (cur) {
+		if (cur->flg_read_only) {
+			bb_error_msg("%s: readonly variable", name);
+			return EXIT_FAILURE;
 		}
-		cur_pp = &cur->next;
+
+		unlink_var(cur);
+		debug_printf_env("%s: unsetenv '%s'\n", __func__, cur->varstr);
+		bb_unsetenv(cur->varstr);
+		if (!cur->max_len)
+			free(cur->varstr);
+		free(cur);
 	}
 
 	/* Handle "unset LINENO" et al even if did not find the variable to unset */
@@ -2538,8 +2608,7 @@ static void add_vars(struct variable *var)
 
 	while (var) {
 		next = var->next;
-		var->next = G.top_var;
-		G.top_var = var;
+		link_var(&G.top_var, var);
 		if (var->flg_export) {
 			debug_printf_env("%s: restoring exported '%s'/%u\n", __func__, var->varstr, var->var_nest_level);
 			putenv(var->varstr);
@@ -2565,15 +2634,13 @@ static void set_vars_and_save_old(char **strings)
 	s = strings;
 	while (*s) {
 		struct variable *var_p;
-		struct variable **var_pp;
 		char *eq;
 
 		eq = strchr(*s, '=');
 		if (HUSH_DEBUG && !eq)
 			bb_simple_error_msg_and_die("BUG in varexp4");
-		var_pp = get_ptr_to_local_var(*s);
-		if (var_pp) {
-			var_p = *var_pp;
+		var_p = get_local_var(*s);
+		if (var_p) {
 			if (var_p->flg_read_only) {
 				char **p;
 				bb_error_msg("%s: readonly variable", *s);
@@ -6530,6 +6597,7 @@ static arith_t expand_and_evaluate_arith(const char *arg, const char **errmsg_p)
 /* ${var/[/]pattern[/repl]} helpers */
 static char *strstr_pattern(char *val, const char *pattern, int *size)
 {
+	struct match_prog prog;
 	int first_escaped = (pattern[0] == '\\' && pattern[1]);
 	/* "first_escaped" trick allows to treat e.g. "\*no_glob_chars"
 	 * as literal too (as it is semi-common, and easy to accomodate
@@ -6547,8 +6615,9 @@ static char *strstr_pattern(char *val, const char *pattern, int *size)
 		return strstr(val, pattern + first_escaped);
 	}
 
+	match_compile(&prog, pattern, SCAN_MOVE_FROM_RIGHT + SCAN_MATCH_LEFT_HALF);
 	while (1) {
-		char *end = scan_and_match(val, pattern, SCAN_MOVE_FROM_RIGHT + SCAN_MATCH_LEFT_HALF);
+		char *end = match_scan(&prog, val);
 		debug_printf_varexp("val:'%s' pattern:'%s' end:'%s'\n", val, pattern, end);
 		if (end) {
 			*size = end - val;
@@ -8261,21 +8330,19 @@ static const char * FAST_FUNC hush_command_name(int i)
 static void remove_nested_vars(void)
 {
 	struct variable *cur;
-	struct variable **cur_pp;
+	struct variable *next;
 
-	cur_pp = &G.top_var;
-	while ((cur = *cur_pp) != NULL) {
-		if (cur->var_nest_level <= G.var_nest_level) {
-			cur_pp = &cur->next;
+	for (cur = G.top_var; cur; cur = next) {
+		next = cur->next;
+		if (cur->var_nest_level <= G.var_nest_level)
 			continue;
-		}
 		/* Unexport */
 		if (cur->flg_export) {
 			debug_printf_env("unexporting nested '%s'/%u\n", cur->varstr, cur->var_nest_level);
 			bb_unsetenv(cur->varstr);
 		}
 		/* Remove from global list */
-		*cur_pp = cur->next;
+		unlink_var(cur);
 		/* Free */
 		if (!cur->max_len) {
 			debug_printf_env("freeing nested '%s'/%u\n", cur->varstr, cur->var_nest_level);
@@ -9959,9 +10026,8 @@ static int run_list(struct pipe *pi)
 						EXP_FLAG_ESC_GLOB_CHARS,
 						/*unbackslash:*/ 0
 				);
-				/* TODO: which FNM_xxx flags to use? */
-				cond_code = (fnmatch(pattern, case_word, /*flags:*/ 0) != 0);
-				debug_printf_exec("cond_code=fnmatch(pattern:'%s',str:'%s'):%d\n",
+				cond_code = (shell_fnmatch(pattern, case_word) != 0);
+				debug_printf_exec("cond_code=shell_fnmatch(pattern:'%s',str:'%s'):%d\n",
 						pattern, case_word, cond_code);
 				free(pattern);
 				if (cond_code == 0) {
@@ -10347,17 +10413,21 @@ int hush_main(int argc, char **argv)
 
 	/* Create shell local variables from the values
 	 * currently living in the environment */
-	G.top_var = shell_ver;
-	cur_var = G.top_var;
+	G.var_hash = xzalloc(VAR_HASH_SIZE * sizeof(G.var_hash[0]));
+	G.var_hash_mask = VAR_HASH_SIZE - 1;
+	G.last_var_pp = &G.top_var;
+	link_var(G.last_var_pp, shell_ver);
 	e = environ;
 	if (e) while (*e) {
 		char *value = strchr(*e, '=');
-		if (value) { /* paranoia */
-			cur_var->next = xzalloc(sizeof(*cur_var));
-			cur_var = cur_var->next;
+		if (value /* paranoia */
+		 && !get_local_var(*e) /* first of duplicates wins */
+		) {
+			cur_var = xzalloc(sizeof(*cur_var));
 			cur_var->varstr = *e;
 			cur_var->max_len = strlen(*e);
 			cur_var->flg_export = 1;
+			link_var(G.last_var_pp, cur_var);
 		}
 		e++;
 	}
@@ -11215,10 +11285,9 @@ static int helper_export_local(char **argv, unsigned flags)
 		const char *name_end = endofname(name);
 
 		if (*name_end == '\0') {
-			struct variable *var, **vpp;
+			struct variable *var;
 
-			vpp = get_ptr_to_local_var(name);
-			var = vpp ? *vpp : NULL;
+			var = get_local_var(name);
 
 			if (flags & SETFLAG_UNEXPORT) {
 				/* export -n NAME (without =VALUE) */
@@ -13,7 +13,9 @@
  * was re-ported from NetBSD and debianized.
  */
 #ifdef STANDALONE
+# include <ctype.h>
 # include <stdbool.h>
+# include <stdint.h>
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
@@ -21,13 +23,25 @@
 # define FAST_FUNC /* nothing */
 # define PUSH_AND_SET_FUNCTION_VISIBILITY_TO_HIDDEN /* nothing */
 # define POP_SAVED_FUNCTION_VISIBILITY /* nothing */
+# define ALIGN1 /* nothing */
+typedef signed char smallint;
+# define isgraph_asciionly(a) isgraph(a)
+# define isprint_asciionly(a) isprint(a)
+static const char *nth_string(const char *strings, int n)
+{
+	while (n) {
+		n--;
+		strings += strlen(strings) + 1;
+	}
+	return strings;
+}
 #else
 # include "libbb.h"
 #endif
 #include <fnmatch.h>
 #include "match.h"
 
-char* FAST_FUNC scan_and_match(char *string, const char *pattern, unsigned flags)
+static char *scan_with_fnmatch(char *string, const char *pattern, unsigned flags)
 {
 	char *loc;
 	char *end;
@@ -94,6 +108,264 @@ char* FAST_FUNC scan_and_match(char *string, const char *pattern, unsigned flags
 	return NULL;
 }
 
+
+/* Glob patterns are compiled to a position automaton: bit N of the state
+ * word is set if the first N atoms of the pattern have matched so far.
+ * A "*" atom keeps its bit on any input char, other atoms move their bit
+ * one position up if the char belongs to their set (shift-and).
+ * This scans a string once, no matter how many stars the pattern has.
+ *
+ * fnmatch() is still used for what we can't reproduce exactly
+ * byte-by-byte: non-ASCII patterns, [=x=] and [.x.] brackets,
+ * malformed patterns and "?"/"[...]" applied to non-ASCII strings
+ * (where libc matches whole multibyte chars).
+ */
+static int bracket_class(uint64_t set[2], const char *name, int len)
+{
+	static const char classes[] ALIGN1 =
+		"alnum\0""alpha\0""blank\0""cntrl\0""digit\0""graph\0"
+		"lower\0""print\0""punct\0""space\0""upper\0""xdigit\0";
+	int idx, c;
+
+	idx = 0;
+	for (;;) {
+		const char *n = nth_string(classes, idx);
+		if (!*n)
+			return 0;
+		if (strncmp(n, name, len) == 0 && n[len] == '\0')
+			break;
+		idx++;
+	}
+	for (c = 1; c < 128; c++) {
+		int r;
+		switch (idx) {
+		case 0: r = isalnum(c); break;
+		case 1: r = isalpha(c); break;
+		case 2: r = (c == ' ' || c == '\t'); break;
+		case 3: r = iscntrl(c); break;
+		case 4: r = isdigit(c); break;
+		case 5: r = isgraph_asciionly(c); break;
+		case 6: r = islower(c); break;
+		case 7: r = isprint_asciionly(c); break;
+		case 8: r = ispunct(c); break;
+		case 9: r = isspace(c); break;
+		case 10: r = isupper(c); break;
+		default: r = isxdigit(c); break;
+		}
+		if (r)
+			set[c >> 6] |= 1ULL << (c & 63);
+	}
+	return 1;
+}
+
+/* Parses "[...]" at p (pointing past '['), returns ptr past ']' or NULL */
+static const char *parse_bracket(uint64_t set[2], const char *p)
+{
+	int negate = 0;
+	const char *start;
+
+	if (*p == '!' || *p == '^') {
+		negate = 1;
+		p++;
+	}
+	start = p;
+	set[0] = set[1] = 0;
+	for (;;) {
+		unsigned lo, hi;
+
+		lo = (unsigned char)*p;
+		if (lo == ']' && p != start)
+			break;
+		if (lo == '[' && (p[1] == '=' || p[1] == '.'))
+			return NULL;
+		if (lo == '[' && p[1] == ':') {
+			const char *e = strstr(p + 2, ":]");
+			if (!e || !bracket_class(set, p + 2, e - (p + 2)))
+				return NULL;
+			p = e + 2;
+			continue;
+		}
+		if (lo == '\\')
+			lo = (unsigned char)*++p;
+		if (lo == '\0' || lo >= 0x80)
+			return NULL;
+		p++;
+		hi = lo;
+		if (p[0] == '-' && p[1] != ']') {
+			hi = (unsigned char)*++p;
+			if (hi == '[')
+				return NULL;
+			if (hi == '\\')
+				hi = (unsigned char)*++p;
+			if (hi == '\0' || hi >= 0x80 || hi < lo)
+				return NULL;
+			p++;
+		}
+		while (lo <= hi) {
+			set[lo >> 6] |= 1ULL << (lo & 63);
+			lo++;
+		}
+	}
+	if (negate) {
+		set[0] = ~set[0] & ~1ULL; /* NUL never matches */
+		set[1] = ~set[1];
+	}
+	return p + 1;
+}
+
+void FAST_FUNC match_compile(struct match_prog *prog, const char *pattern, unsigned flags)
+{
+	enum { STAR = 1, ANY, SET };
+	struct {
+		uint8_t type, ch;
+		uint64_t set[2];
+	} atom[MATCH_MAX_ATOMS];
+	const char *p;
+	unsigned n, i;
+
+	prog->pattern = pattern;
+	prog->flags = flags;
+	prog->compiled = 0;
+	prog->has_class = 0;
+
+	n = 0;
+	p = pattern;
+	while (*p) {
+		unsigned c = (unsigned char)*p++;
+
+		if (c == '*' && n != 0 && atom[n - 1].type == STAR)
+			continue;
+		if (n == MATCH_MAX_ATOMS)
+			return;
+		atom[n].type = 0;
+		if (c == '*') {
+			atom[n].type = STAR;
+		} else if (c == '?') {
+			atom[n].type = ANY;
+			prog->has_class = 1;
+		} else if (c == '[') {
+			p = parse_bracket(atom[n].set, p);
+			if (!p)
+				return;
+			atom[n].type = SET;
+			prog->has_class = 1;
+		} else if (c == '\\') {
+			c = (unsigned char)*p++;
+			if (c == '\0')
+				return;
+		}
+		if (c >= 0x80)
+			return;
+		atom[n].ch = c;
+		n++;
+	}
+
+	memset(prog->chmask, 0, sizeof(prog->chmask));
+	prog->star = 0;
+	for (i = 0; i < n; i++) {
+		/* Suffix matches scan the string backwards, with reversed pattern */
+		uint64_t bit = 1ULL << ((flags & SCAN_MATCH_RIGHT_HALF) ? n - 1 - i : i);
+		unsigned c;
+
+		switch (atom[i].type) {
+		case STAR:
+			prog->star |= bit;
+			break;
+		case ANY:
+			for (c = 1; c < 128; c++)
+				prog->chmask[c] |= bit;
+			break;
+		case SET:
+			for (c = 1; c < 128; c++)
+				if (atom[i].set[c >> 6] & (1ULL << (c & 63)))
+					prog->chmask[c] |= bit;
+			break;
+		default:
+			prog->chmask[atom[i].ch] |= bit;
+		}
+	}
+	prog->final = 1ULL << n;
+	prog->compiled = 1;
+}
+
+#define FALLBACK ((char*)-1L)
+
+static char *run_prog(const struct match_prog *prog, char *string)
+{
+	unsigned flags = prog->flags;
+	/* "#" scans from left, "%" from right: they want the shortest match */
+	int shortest = (flags == SCAN_MOVE_FROM_LEFT + SCAN_MATCH_LEFT_HALF
+			|| flags == SCAN_MOVE_FROM_RIGHT + SCAN_MATCH_RIGHT_HALF);
+	char *found = NULL;
+	char *p;
+	uint64_t d;
+
+	p = string;
+	if (flags & SCAN_MATCH_RIGHT_HALF)
+		p += strlen(string);
+	d = 1 | ((1 & prog->star) << 1);
+	for (;;) {
+		unsigned c;
+
+		if (d & prog->final) {
+			found = p;
+			if (shortest)
+				break;
+		}
+		if (flags & SCAN_MATCH_RIGHT_HALF) {
+			if (p == string)
+				break;
+			c = (unsigned char)*--p;
+		} else {
+			c = (unsigned char)*p++;
+			if (c == '\0')
+				break;
+		}
+		if (c >= 0x80) {
+			if (prog->has_class)
+				return FALLBACK;
+			d &= prog->star;
+		} else {
+			d = ((d & prog->chmask[c]) << 1) | (d & prog->star);
+		}
+		d |= (d & prog->star) << 1;
+		if (!d)
+			break;
+	}
+	return found;
+}
+
+char* FAST_FUNC match_scan(const struct match_prog *prog, char *string)
+{
+	if (prog->compiled) {
+		char *loc = run_prog(prog, string);
+		if (loc != FALLBACK)
+			return loc;
+	}
+	return scan_with_fnmatch(string, prog->pattern, prog->flags);
+}
+
+char* FAST_FUNC scan_and_match(char *string, const char *pattern, unsigned flags)
+{
+	struct match_prog prog;
+
+	match_compile(&prog, pattern, flags);
+	return match_scan(&prog, string);
+}
+
+int FAST_FUNC shell_fnmatch(const char *pattern, const char *string)
+{
+	struct match_prog prog;
+
+	match_compile(&prog, pattern, SCAN_MOVE_FROM_RIGHT + SCAN_MATCH_LEFT_HALF);
+	if (prog.compiled) {
+		char *loc = run_prog(&prog, (char*)string);
+		if (loc != FALLBACK)
+			return (loc && *loc == '\0') ? 0 : FNM_NOMATCH;
+	}
+	return fnmatch(pattern, string, 0);
+}
+
 #ifdef STANDALONE
 int main(int argc, char **argv)
 {
@@ -5,8 +5,6 @@
 
 PUSH_AND_SET_FUNCTION_VISIBILITY_TO_HIDDEN
 
-//TODO! Why ash.c still uses internal version?!
-
 enum {
 	SCAN_MOVE_FROM_LEFT = (1 << 0),
 	SCAN_MOVE_FROM_RIGHT = (1 << 1),
@@ -14,8 +12,27 @@ enum {
 	SCAN_MATCH_RIGHT_HALF = (1 << 3),
 };
 
+/* Pattern compiled for repeated scans with the same flags */
+#define MATCH_MAX_ATOMS 63
+struct match_prog {
+	const char *pattern;
+	unsigned flags;
+	smallint compiled;
+	smallint has_class;
+	uint64_t star;
+	uint64_t final;
+	uint64_t chmask[128];
+};
+void FAST_FUNC match_compile(struct match_prog *prog, const char *pattern, unsigned flags);
+/* Returns ptr past the matched prefix (SCAN_MATCH_LEFT_HALF)
+ * or to the start of the matched suffix (SCAN_MATCH_RIGHT_HALF) */
+char* FAST_FUNC match_scan(const struct match_prog *prog, char *string);
+
 char* FAST_FUNC scan_and_match(char *string, const char *pattern, unsigned flags);
 
+/* Same as fnmatch(pattern, string, 0) */
+int FAST_FUNC shell_fnmatch(const char *pattern, const char *string);
+
 static inline unsigned pick_scan(char op1, char op2)
 {
 	unsigned scan_flags;
@@ -70,6 +70,10 @@ shell_builtin_read(struct builtin_read_params *params)
 	char **argv;
 	const char *ifs;
 	int read_flags;
+	/* Read-ahead for regular files, see below */
+	char rbuf[1024];
+	unsigned rbuf_pos, rbuf_len, rbuf_size;
+	struct stat st;
 
 	errno = err = 0;
 
@@ -189,6 +193,20 @@ shell_builtin_read(struct builtin_read_params *params)
 	buffer = NULL;
 	bufpos = 0;
 	delim = params->opt_d ? params->opt_d[0] : '\n';
+	/* Reading one byte at a time is needed to not consume input past
+	 * the delimiter: other readers of this fd (our children, or the shell
+	 * itself reading a script) must see it. Regular files can be read
+	 * in blocks, we seek back over the unused part when we are done.
+	 * Make sure that seeking works before relying on it (some
+	 * filesystems, e.g. FUSE ones, may refuse it even on regular files).
+	 */
+	rbuf_pos = rbuf_len = 0;
+	rbuf_size = 1;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	 && lseek(fd, 0, SEEK_CUR) >= 0
+	) {
+		rbuf_size = sizeof(rbuf);
+	}
 	do {
 		char c;
 		int timeout;
@@ -196,6 +214,9 @@ shell_builtin_read(struct builtin_read_params *params)
 		if ((bufpos & 0xff) == 0)
 			buffer = xrealloc(buffer, bufpos + 0x101);
 
+		if (rbuf_pos < rbuf_len)
+			goto got_char;
+
 		timeout = -1;
 		if (params->opt_t) {
 			timeout = end_ms - (unsigned)monotonic_ms();
@@ -222,13 +243,16 @@ shell_builtin_read(struct builtin_read_params *params)
 			retval = (const char *)(uintptr_t)1;
 			goto ret;
 		}
-		if (read(fd, &buffer[bufpos], 1) != 1) {
+		rbuf_len = read(fd, rbuf, rbuf_size);
+		rbuf_pos = 0;
+		if ((int)rbuf_len <= 0) {
 			err = errno;
+			rbuf_len = 0;
 			retval = (const char *)(uintptr_t)1;
 			break;
 		}
-
-		c = buffer[bufpos];
+ got_char:
+		c = buffer[bufpos] = rbuf[rbuf_pos++];
 		if (!(read_flags & BUILTIN_READ_RAW)) {
 			if (backslash) {
 				backslash = 0;
@@ -276,6 +300,9 @@ shell_builtin_read(struct builtin_read_params *params)
 		bufpos++;
 	} while (--nchars);
 
+	if (rbuf_pos < rbuf_len)
+		lseek(fd, (off_t)rbuf_pos - rbuf_len, SEEK_CUR);
+
 	if (argv[0]) {
 		/* Remove trailing space $IFS chars */
 		while (--bufpos >= 0
@@ -47,6 +47,10 @@
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#ifdef __NR_futex
+# include <linux/futex.h>
+#endif
 
 #define DEBUG 0
 
@@ -100,6 +104,27 @@ static void sem_up(int semid)
 		error_exit("semop[SMrup]");
 }
 
+/*
+ * Sleep until syslogd moves tail away from cur.
+ * syslogd does FUTEX_WAKE on tail after each message;
+ * timeout is a fallback for syslogd which doesn't.
+ */
+static void wait_for_tail_change(unsigned cur)
+{
+#ifdef __NR_futex
+	/* __NR_futex takes kernel's "long, long" timespec
+	 * regardless of libc's time_t width */
+	struct {
+		long tv_sec;
+		long tv_nsec;
+	} ts = { 1, 0 };
+
+	syscall(__NR_futex, &shbuf->tail, FUTEX_WAIT, cur, &ts, NULL, 0);
+#else
+	sleep1();
+#endif
+}
+
 static void interrupted(int sig)
 {
 	/* shmdt(shbuf); - on Linux, shmdt is not mandatory on exit */
@@ -180,7 +205,7 @@ int logread_main(int argc UNUSED_PARAM, char **argv)
 			if (cur == shbuf_tail) {
 				sem_up(log_semid);
 				fflush_all();
-				sleep1(); /* TODO: replace me with a sleep_on */
+				wait_for_tail_change(cur);
 				continue;
 			}
 		}
@@ -116,6 +116,17 @@
 //config:	support, as klogd and logread aren't needed.
 //config:
 //config:	NOTICE: Syslog facilities in log entries needs kernel 3.5+.
+//config:
+//config:config FEATURE_SYSLOGD_BATCH
+//config:	bool "Batched receive and buffered writes"
+//config:	default y
+//config:	depends on SYSLOGD
+//config:	help
+//config:	Receive up to 16 queued messages per recvmmsg() call, and
+//config:	forward them to remote hosts with one sendmmsg() call.
+//config:	Also adds -W option to coalesce writes to log files,
+//config:	which reduces the number of small writes to flash.
+//config:	Needs Linux 3.0+.
 
 //applet:IF_SYSLOGD(APPLET(syslogd, BB_DIR_SBIN, BB_SUID_DROP))
 
@@ -145,6 +156,9 @@
 //usage:     "\n	-s SIZE		Max size (KB) before rotation (default 200KB, 0=off)"
 //usage:     "\n	-b N		N rotated logs to keep (default 1, max 99, 0=purge)"
 //usage:	)
+//usage:	IF_FEATURE_SYSLOGD_BATCH(
+//usage:     "\n	-W KB[:SEC]	Buffer up to KB of writes per file, flush every SEC (default 1)"
+//usage:	)
 //usage:     "\n	-l N		Log only messages more urgent than prio N (1-8)"
 //usage:     "\n	-S		Smaller output"
 //usage:     "\n	-t		Strip client-generated timestamps"
@@ -182,6 +196,10 @@
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#ifdef __NR_futex
+# include <linux/futex.h>
+#endif
 #endif
 
 
@@ -198,6 +216,8 @@
 enum {
 	MAX_READ = CONFIG_FEATURE_SYSLOGD_READ_BUFFER_SIZE,
 	DNS_WAIT_SEC = 2 * 60,
+	/* how many datagrams to pull from /dev/log in one go */
+	RECV_BATCH = ENABLE_FEATURE_SYSLOGD_BATCH ? 16 : 1,
 };
 
 /* Semaphore operation structures */
@@ -224,6 +244,11 @@ typedef struct logFile_t {
 	unsigned size;
 	uint8_t isRegular;
 #endif
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	/* -W: not yet written data */
+	char *wbuf;
+	unsigned wbuf_len;
+#endif
 } logFile_t;
 
 #if ENABLE_FEATURE_SYSLOGD_CFG
@@ -260,6 +285,11 @@ IF_FEATURE_SYSLOGD_CFG( \
 IF_FEATURE_KMSG_SYSLOG( \
 	int kmsgfd; \
 	int primask; \
+) \
+IF_FEATURE_SYSLOGD_BATCH( \
+	/* -W: size of per-file write buffer, 0 = unbuffered */ \
+	unsigned wbuf_size; \
+	unsigned flush_ms; \
 )
 
 struct init_globals {
@@ -278,8 +308,23 @@ struct globals {
 	/* localhost's name. We print only first 64 chars */
 	char *hostname;
 
-	/* We recv into recvbuf... */
-	char recvbuf[MAX_READ * (1 + ENABLE_FEATURE_SYSLOGD_DUP)];
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	/* some log file has buffered data which must be written out
+	 * no later than wbuf_deadline (monotonic ms) */
+	smallint wbuf_pending;
+	unsigned wbuf_deadline;
+	struct mmsghdr recvmsgs[RECV_BATCH];
+	struct iovec recviov[RECV_BATCH];
+#endif
+	/* lengths of messages received by recv_messages(),
+	 * -1 for messages which should be ignored */
+	int recvlen[RECV_BATCH];
+#if ENABLE_FEATURE_SYSLOGD_DUP
+	int last_sz;
+	char last_buf[MAX_READ];
+#endif
+	/* We recv into recvbuf (MAX_READ bytes per message)... */
+	char recvbuf[MAX_READ * RECV_BATCH];
 	/* ...then copy to parsebuf, escaping control chars */
 	/* (can grow x2 max) */
 	char parsebuf[MAX_READ*2];
@@ -309,6 +354,9 @@ static const struct init_globals init_data = {
 	.SMwup = { {1, -1, IPC_NOWAIT} },
 	.SMwdn = { {0, 0}, {1, 0}, {1, +1} },
 #endif
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	.flush_ms = 1000,
+#endif
 };
 
 #define G (*ptr_to_globals)
@@ -333,6 +381,7 @@ enum {
 	IF_FEATURE_SYSLOGD_DUP(   OPTBIT_dup        ,)	// -D
 	IF_FEATURE_SYSLOGD_CFG(   OPTBIT_cfg        ,)	// -f
 	IF_FEATURE_KMSG_SYSLOG(   OPTBIT_kmsg       ,)	// -K
+	IF_FEATURE_SYSLOGD_BATCH( OPTBIT_wbuf       ,)	// -W
 
 	OPT_mark        = 1 << OPTBIT_mark    ,
 	OPT_nofork      = 1 << OPTBIT_nofork  ,
@@ -348,6 +397,7 @@ enum {
 	OPT_dup         = IF_FEATURE_SYSLOGD_DUP(   (1 << OPTBIT_dup        )) + 0,
 	OPT_cfg         = IF_FEATURE_SYSLOGD_CFG(   (1 << OPTBIT_cfg        )) + 0,
 	OPT_kmsg        = IF_FEATURE_KMSG_SYSLOG(   (1 << OPTBIT_kmsg       )) + 0,
+	OPT_wbuf        = IF_FEATURE_SYSLOGD_BATCH( (1 << OPTBIT_wbuf       )) + 0,
 };
 #define OPTION_STR "m:nO:l:St" \
 	IF_FEATURE_ROTATE_LOGFILE("s:" ) \
@@ -357,18 +407,21 @@ enum {
 	IF_FEATURE_IPC_SYSLOG(    "C::") \
 	IF_FEATURE_SYSLOGD_DUP(   "D"  ) \
 	IF_FEATURE_SYSLOGD_CFG(   "f:" ) \
-	IF_FEATURE_KMSG_SYSLOG(   "K"  )
+	IF_FEATURE_KMSG_SYSLOG(   "K"  ) \
+	IF_FEATURE_SYSLOGD_BATCH( "W:" )
 #define OPTION_DECL *opt_m, *opt_l \
 	IF_FEATURE_ROTATE_LOGFILE(,*opt_s) \
 	IF_FEATURE_ROTATE_LOGFILE(,*opt_b) \
 	IF_FEATURE_IPC_SYSLOG(    ,*opt_C = NULL) \
-	IF_FEATURE_SYSLOGD_CFG(   ,*opt_f = NULL)
+	IF_FEATURE_SYSLOGD_CFG(   ,*opt_f = NULL) \
+	IF_FEATURE_SYSLOGD_BATCH( ,*opt_W)
 #define OPTION_PARAM &opt_m, &(G.logFile.path), &opt_l \
 	IF_FEATURE_ROTATE_LOGFILE(,&opt_s) \
 	IF_FEATURE_ROTATE_LOGFILE(,&opt_b) \
 	IF_FEATURE_REMOTE_LOG(    ,&remoteAddrList) \
 	IF_FEATURE_IPC_SYSLOG(    ,&opt_C) \
-	IF_FEATURE_SYSLOGD_CFG(   ,&opt_f)
+	IF_FEATURE_SYSLOGD_CFG(   ,&opt_f) \
+	IF_FEATURE_SYSLOGD_BATCH( ,&opt_W)
 
 
 #if ENABLE_FEATURE_SYSLOGD_CFG
@@ -640,6 +693,10 @@ static void log_to_shmem(const char *msg)
 	if (semop(G.s_semid, G.SMwup, 1) == -1) {
 		bb_simple_perror_msg_and_die("SMwup");
 	}
+#ifdef __NR_futex
+	/* Wake up "logread -f" processes sleeping on tail */
+	syscall(__NR_futex, &G.shbuf->tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
 	if (DEBUG)
 		printf("tail:%d\n", G.shbuf->tail);
 }
@@ -687,13 +744,12 @@ static void kmsg_cleanup(void) {}
 static void log_to_kmsg(int pri UNUSED_PARAM, const char *msg UNUSED_PARAM) {}
 #endif /* FEATURE_KMSG_SYSLOG */
 
-/* Print a message to the log file. */
-static void log_locally(time_t now, char *msg, logFile_t *log_file)
+/* Write LEN bytes of (possibly several) messages to the log file. */
+static void write_logfile(time_t now, const char *msg, int len, logFile_t *log_file)
 {
 #ifdef SYSLOGD_WRLOCK
 	struct flock fl;
 #endif
-	int len = strlen(msg);
 
 	/* fd can't be 0 (we connect fd 0 to /dev/log socket) */
 	/* fd is 1 if "-O -" is in use */
@@ -803,6 +859,58 @@ static void log_locally(time_t now, char *msg, logFile_t *log_file)
 #endif
 }
 
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+static void flush_logfile(logFile_t *log_file)
+{
+	if (log_file->wbuf_len) {
+		write_logfile(0, log_file->wbuf, log_file->wbuf_len, log_file);
+		log_file->wbuf_len = 0;
+	}
+}
+
+static void flush_all_logfiles(void)
+{
+#if ENABLE_FEATURE_SYSLOGD_CFG
+	logRule_t *rule;
+
+	/* several rules may share one file: second flush is a no-op */
+	for (rule = G.log_rules; rule; rule = rule->next)
+		flush_logfile(rule->file);
+#endif
+	flush_logfile(&G.logFile);
+	G.wbuf_pending = 0;
+}
+#else
+static void flush_all_logfiles(void) {}
+#endif
+
+/* Print a message to the log file. */
+static void log_locally(time_t now, char *msg, logFile_t *log_file)
+{
+	int len = strlen(msg);
+
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	/* -W: accumulate messages, write them out when the buffer
+	 * fills up or flush_ms after the first one was buffered */
+	if (G.wbuf_size && len <= G.wbuf_size) {
+		if (log_file->wbuf_len + len > G.wbuf_size)
+			flush_logfile(log_file);
+		if (!log_file->wbuf)
+			log_file->wbuf = xmalloc(G.wbuf_size);
+		memcpy(log_file->wbuf + log_file->wbuf_len, msg, len);
+		log_file->wbuf_len += len;
+		if (!G.wbuf_pending) {
+			G.wbuf_pending = 1;
+			G.wbuf_deadline = (unsigned)monotonic_ms() + G.flush_ms;
+		}
+		return;
+	}
+	/* else: unbuffered, or the message is too big - keep ordering */
+	flush_logfile(log_file);
+#endif
+	write_logfile(now, msg, len, log_file);
+}
+
 static void parse_fac_prio_20(int pri, char *res20)
 {
 	const CODE *c_pri, *c_fac;
@@ -998,6 +1106,123 @@ static int try_to_resolve_remote(remoteHost_t *rh)
 	}
 	return xsocket(rh->remoteAddr->u.sa.sa_family, SOCK_DGRAM, 0);
 }
+
+/* Send CNT received messages (those with recvlen >= 0)
+ * to all remote hosts */
+static void forward_to_remote(int cnt UNUSED_PARAM)
+{
+	llist_t *item;
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < cnt; i++) {
+		if (G.recvlen[i] < 0)
+			continue;
+		iov[n].iov_base = G.recvbuf + i * MAX_READ;
+		iov[n].iov_len = G.recvlen[i] + 1; /* + '\n' */
+		n++;
+	}
+	if (n == 0)
+		return;
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#else
+	if (G.recvlen[0] < 0)
+		return;
+#endif
+
+	/* We are not modifying log messages in any way before send */
+	/* Remote site cannot trust _us_ anyway and need to do validation again */
+	for (item = G.remoteHosts; item != NULL; item = item->link) {
+		remoteHost_t *rh = (remoteHost_t *)item->data;
+		int r;
+
+		if (rh->remoteFD == -1) {
+			rh->remoteFD = try_to_resolve_remote(rh);
+			if (rh->remoteFD == -1)
+				continue;
+		}
+
+		/* Send message(s) to remote logger.
+		 * On some errors, close and set remoteFD to -1
+		 * so that DNS resolution is retried.
+		 */
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+		for (i = 0; i < n; i++) {
+			msgs[i].msg_hdr.msg_name = &(rh->remoteAddr->u.sa);
+			msgs[i].msg_hdr.msg_namelen = rh->remoteAddr->len;
+		}
+		/* Partial send (socket buffer full) drops the rest,
+		 * same as sendto() failing with EAGAIN would */
+		r = sendmmsg(rh->remoteFD, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+		r = sendto(rh->remoteFD, G.recvbuf, G.recvlen[0] + 1,
+				MSG_DONTWAIT | MSG_NOSIGNAL,
+				&(rh->remoteAddr->u.sa), rh->remoteAddr->len);
+#endif
+		if (r == -1) {
+			switch (errno) {
+			case ECONNRESET:
+			case ENOTCONN: /* paranoia */
+			case EPIPE:
+				close(rh->remoteFD);
+				rh->remoteFD = -1;
+				free(rh->remoteAddr);
+				rh->remoteAddr = NULL;
+			}
+		}
+	}
+}
+#endif
+
+/* Receive one or more messages into recvbuf[], set recvlen[].
+ * Returns number of messages, or -1 on error. */
+static int recv_messages(void)
+{
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	int i, cnt;
+
+	/* Block until a message arrives, then also take
+	 * whatever else is already queued, without blocking */
+	cnt = recvmmsg(STDIN_FILENO, G.recvmsgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+	for (i = 0; i < cnt; i++)
+		G.recvlen[i] = G.recvmsgs[i].msg_len;
+	return cnt;
+#else
+	G.recvlen[0] = read(STDIN_FILENO, G.recvbuf, MAX_READ - 1);
+	return G.recvlen[0] < 0 ? -1 : 1;
+#endif
+}
+
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+/* If buffered log data is due, write it out. Otherwise wait
+ * for new messages no longer than until it becomes due.
+ * Returns 0 if interrupted by a signal. */
+static int flush_or_wait(void)
+{
+	if (G.wbuf_pending) {
+		int r = (int)(G.wbuf_deadline - (unsigned)monotonic_ms());
+		if (r > 0) {
+			struct pollfd pfd;
+			pfd.fd = STDIN_FILENO;
+			pfd.events = POLLIN;
+			r = poll(&pfd, 1, r);
+			if (r < 0)
+				return 0;
+		}
+		if (r <= 0)
+			flush_all_logfiles();
+	}
+	return 1;
+}
+#else
+# define flush_or_wait() 1
 #endif
 
 /* By doing init in a separate function we decrease stack usage
@@ -1007,6 +1232,7 @@ static int NOINLINE syslogd_init(char **argv)
 {
 	int opts;
 	int fd;
+	IF_FEATURE_SYSLOGD_BATCH(int i;)
 	char OPTION_DECL;
 #if ENABLE_FEATURE_REMOTE_LOG
 	llist_t *remoteAddrList = NULL;
@@ -1042,6 +1268,22 @@ static int NOINLINE syslogd_init(char **argv)
 #if ENABLE_FEATURE_IPC_SYSLOG
 	if (opt_C) // -Cn
 		G.shm_size = xatoul_range(opt_C, 4, INT_MAX/1024) * 1024;
+#endif
+#if ENABLE_FEATURE_SYSLOGD_BATCH
+	if (opts & OPT_wbuf) { // -W KB[:SEC]
+		char *sec = strchr(opt_W, ':');
+		if (sec) {
+			*sec++ = '\0';
+			G.flush_ms = xatou_range(sec, 1, INT_MAX/1000) * 1000;
+		}
+		G.wbuf_size = xatou_range(opt_W, 1, 1024) * 1024;
+	}
+	for (i = 0; i < RECV_BATCH; i++) {
+		G.recviov[i].iov_base = G.recvbuf + i * MAX_READ;
+		G.recviov[i].iov_len = MAX_READ - 1;
+		G.recvmsgs[i].msg_hdr.msg_iov = &G.recviov[i];
+		G.recvmsgs[i].msg_hdr.msg_iovlen = 1;
+	}
 #endif
 	/* If they have not specified remote logging, then log locally */
 	if (ENABLE_FEATURE_REMOTE_LOG && !(opts & OPT_remotelog)) // -R
@@ -1084,16 +1326,6 @@ int syslogd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int syslogd_main(int argc UNUSED_PARAM, char **argv)
 {
 	int opts;
-#if ENABLE_FEATURE_REMOTE_LOG
-	llist_t *item;
-#endif
-#if ENABLE_FEATURE_SYSLOGD_DUP
-	int last_sz = -1;
-	char *last_buf;
-	char *recvbuf;
-#else
-#define recvbuf (G.recvbuf)
-#endif
 
 	INIT_G();
 	opts = syslogd_init(argv);
@@ -1101,97 +1333,79 @@ int syslogd_main(int argc UNUSED_PARAM, char **argv)
 	timestamp_and_log_internal("syslogd started: BusyBox v" BB_VER);
 	write_pidfile_std_path_and_ext("syslogd");
 
-#if ENABLE_FEATURE_SYSLOGD_DUP
-	recvbuf = G.recvbuf;
-#endif
+	IF_FEATURE_SYSLOGD_DUP(G.last_sz = -1;)
 	while (!bb_got_signal) {
-		ssize_t sz;
+		int cnt, i;
 
-#if ENABLE_FEATURE_SYSLOGD_DUP
-		last_buf = recvbuf;
-		if (recvbuf == G.recvbuf)
-			recvbuf = G.recvbuf + MAX_READ;
-		else
-			recvbuf = G.recvbuf;
-#endif
- read_again:
-		sz = read(STDIN_FILENO, recvbuf, MAX_READ - 1);
-		if (sz < 0) {
+		if (!flush_or_wait())
+			continue; /* signal */
+		cnt = recv_messages();
+		if (cnt < 0) {
 			if (!bb_got_signal)
 				bb_perror_msg("read from %s", _PATH_LOG);
 			break;
 		}
 
-		/* Drop trailing '\n' and NULs (typically there is one NUL) */
-		while (1) {
-			if (sz == 0)
-				goto read_again;
-			/* man 3 syslog says: "A trailing newline is added when needed".
-			 * However, neither glibc nor uclibc do this:
-			 * syslog(prio, "test")   sends "test\0" to /dev/log,
-			 * syslog(prio, "test\n") sends "test\n\0".
-			 * IOW: newline is passed verbatim!
-			 * I take it to mean that it's syslogd's job
-			 * to make those look identical in the log files. */
-			if (recvbuf[sz-1] != '\0' && recvbuf[sz-1] != '\n')
-				break;
-			sz--;
-		}
+		for (i = 0; i < cnt; i++) {
+			char *recvbuf = G.recvbuf + i * MAX_READ;
+			int sz = G.recvlen[i];
+
+			/* Drop trailing '\n' and NULs (typically there is one NUL) */
+			while (1) {
+				if (sz == 0)
+					goto skip;
+				/* man 3 syslog says: "A trailing newline is added when needed".
+				 * However, neither glibc nor uclibc do this:
+				 * syslog(prio, "test")   sends "test\0" to /dev/log,
+				 * syslog(prio, "test\n") sends "test\n\0".
+				 * IOW: newline is passed verbatim!
+				 * I take it to mean that it's syslogd's job
+				 * to make those look identical in the log files. */
+				if (recvbuf[sz-1] != '\0' && recvbuf[sz-1] != '\n')
+					break;
+				sz--;
+			}
 #if ENABLE_FEATURE_SYSLOGD_DUP
-		if ((opts & OPT_dup) && (sz == last_sz))
-			if (memcmp(last_buf, recvbuf, sz) == 0)
-				continue;
-		last_sz = sz;
+			if (opts & OPT_dup) {
+				if (sz == G.last_sz && memcmp(G.last_buf, recvbuf, sz) == 0)
+					goto skip;
+				G.last_sz = sz;
+				memcpy(G.last_buf, recvbuf, sz);
+			}
 #endif
+			/* Stock syslogd sends it '\n'-terminated
+			 * over network, mimic that */
+			if (ENABLE_FEATURE_REMOTE_LOG)
+				recvbuf[sz] = '\n';
+			G.recvlen[i] = sz;
+			continue;
+ skip:
+			G.recvlen[i] = -1;
+		}
+
 #if ENABLE_FEATURE_REMOTE_LOG
-		/* Stock syslogd sends it '\n'-terminated
-		 * over network, mimic that */
-		recvbuf[sz] = '\n';
-
-		/* We are not modifying log messages in any way before send */
-		/* Remote site cannot trust _us_ anyway and need to do validation again */
-		for (item = G.remoteHosts; item != NULL; item = item->link) {
-			remoteHost_t *rh = (remoteHost_t *)item->data;
-
-			if (rh->remoteFD == -1) {
-				rh->remoteFD = try_to_resolve_remote(rh);
-				if (rh->remoteFD == -1)
-					continue;
-			}
+		forward_to_remote(cnt);
+#endif
+		if (!ENABLE_FEATURE_REMOTE_LOG || (option_mask32 & OPT_locallog)) {
+			for (i = 0; i < cnt; i++) {
+				char *recvbuf = G.recvbuf + i * MAX_READ;
+				int sz = G.recvlen[i];
 
-			/* Send message to remote logger.
-			 * On some errors, close and set remoteFD to -1
-			 * so that DNS resolution is retried.
-			 */
-			if (sendto(rh->remoteFD, recvbuf, sz+1,
-					MSG_DONTWAIT | MSG_NOSIGNAL,
-					&(rh->remoteAddr->u.sa), rh->remoteAddr->len) == -1
-			) {
-				switch (errno) {
-				case ECONNRESET:
-				case ENOTCONN: /* paranoia */
-				case EPIPE:
-					close(rh->remoteFD);
-					rh->remoteFD = -1;
-					free(rh->remoteAddr);
-					rh->remoteAddr = NULL;
-				}
+				if (sz < 0)
+					continue;
+				recvbuf[sz] = '\0'; /* ensure it *is* NUL terminated */
+				split_escape_and_log(recvbuf, sz);
 			}
 		}
-#endif
-		if (!ENABLE_FEATURE_REMOTE_LOG || (opts & OPT_locallog)) {
-			recvbuf[sz] = '\0'; /* ensure it *is* NUL terminated */
-			split_escape_and_log(recvbuf, sz);
-		}
 	} /* while (!bb_got_signal) */
 
 	timestamp_and_log_internal("syslogd exiting");
+	flush_all_logfiles();
 	remove_pidfile_std_path_and_ext("syslogd");
 	ipcsyslog_cleanup();
 	if (opts & OPT_kmsg)
 		kmsg_cleanup();
 	kill_myself_with_sig(bb_got_signal);
-#undef recvbuf
 }
 
 /* Clean up. Needed because we are included from syslogd_and_logger.c */